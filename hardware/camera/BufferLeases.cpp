@@ -0,0 +1,428 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Lifetime tracking of the vendor buffers behind deferred data callbacks.
+ *
+ * A data callback hands the client a buffer of a heap the vendor got through
+ * get_memory, but the worker delivers it later, when the vendor may already be
+ * writing the next frame into the very same buffer. Every buffer of a tracked
+ * heap that sits in the worker queue is leased until its callback returns or is
+ * dropped.
+ *
+ * The vendor writes its heaps round robin and keeps BL_VENDOR_SLACK buffers ahead
+ * of the one it delivers, so each data callback revokes the leases on those: a
+ * queued frame in one of them is dropped, and if the client is reading one right
+ * now the vendor thread waits for its callback to return. The client never reads
+ * a leased buffer the vendor has started to write, unless a client callback runs
+ * longer than BL_PIN_WAIT_MS, which is counted as an overrun.
+ *
+ * Once the leases of a heap would leave it fewer than BL_VENDOR_SLACK free buffers
+ * the frame is copied instead, on the vendor thread while it still owns the
+ * buffer, into a client buffer allocated along with the heap. When no copy is
+ * free the frame is dropped. Frames of heaps we never saw allocated are passed
+ * through untracked.
+ */
+
+#define LOG_NDEBUG 1
+#define LOG_TAG "Camera2WrapperLeases"
+
+#include "BufferLeases.h"
+#include "CallbackWorkerThread.h"
+#include <cutils/log.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static long long lease_timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+BufferLeases::BufferLeases() : m_copyMode(BL_COPY_AUTO), m_getMemory(0), m_user(0),
+        m_nextHeap(0), m_delivering(0), m_outstanding(0), m_outstandingMax(0), m_leases(0),
+        m_untracked(0), m_recycled(0), m_revoked(0), m_pinWaits(0), m_pinOverruns(0),
+        m_copied(0), m_copyAllocs(0), m_copyFailed(0), m_copyBytes(0), m_copyNs(0) {
+    pthread_condattr_t attr;
+
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    memset(m_heaps, 0, sizeof(m_heaps));
+    memset(m_copies, 0, sizeof(m_copies));
+}
+
+BufferLeases::~BufferLeases() {
+    ReleaseCopies(true);
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_lock);
+}
+
+void BufferLeases::SetCopyMode(int mode) {
+    pthread_mutex_lock(&m_lock);
+    m_copyMode = mode;
+    pthread_mutex_unlock(&m_lock);
+}
+
+void BufferLeases::SetClient(camera_request_memory getMemory, void* user) {
+    pthread_mutex_lock(&m_lock);
+    if (getMemory != m_getMemory || user != m_user)
+        ReleaseCopies(false);
+    m_getMemory = getMemory;
+    m_user = user;
+    pthread_mutex_unlock(&m_lock);
+}
+
+void BufferLeases::ReleaseCopies(bool all) {
+    for (int i = 0; i < BL_MAX_COPIES; i++) {
+        Copy& copy = m_copies[i];
+
+        /* Copies still in flight go back through Release */
+        if (!copy.mem || (copy.busy && !all))
+            continue;
+
+        copy.mem->release(copy.mem);
+        copy.mem = NULL;
+        copy.busy = false;
+    }
+}
+
+BufferLeases::Heap* BufferLeases::FindHeap(const camera_memory_t* mem) {
+    for (int i = 0; i < BL_MAX_HEAPS; i++) {
+        if (m_heaps[i].mem == mem)
+            return &m_heaps[i];
+    }
+    return NULL;
+}
+
+void BufferLeases::OnAllocated(const camera_memory_t* mem, size_t bufSize, unsigned int numBufs) {
+    if (!mem)
+        return;
+
+    pthread_mutex_lock(&m_lock);
+
+    /* A freed heap may come back at the same address, otherwise take a free or idle slot */
+    Heap* heap = FindHeap(mem);
+    for (int i = 0; !heap && i < BL_MAX_HEAPS; i++) {
+        Heap* candidate = &m_heaps[(m_nextHeap + i) % BL_MAX_HEAPS];
+        if (!candidate->pinned) {
+            heap = candidate;
+            m_nextHeap = (m_nextHeap + i + 1) % BL_MAX_HEAPS;
+        }
+    }
+    if (!heap) {
+        heap = &m_heaps[m_nextHeap];
+        m_nextHeap = (m_nextHeap + 1) % BL_MAX_HEAPS;
+    }
+
+    /* Leases on whatever heap used the slot are void, Release ignores them */
+    m_outstanding -= heap->pinned;
+    heap->mem = mem;
+    heap->bufSize = bufSize;
+    heap->numBufs = numBufs;
+    heap->pinned = 0;
+    memset(heap->pins, 0, sizeof(heap->pins));
+    for (int i = 0; i < BL_MAX_INDEXES; i++)
+        heap->gens[i]++;
+
+    pthread_mutex_unlock(&m_lock);
+
+    if (m_copyMode != BL_COPY_NEVER)
+        ReserveCopies(bufSize);
+}
+
+void BufferLeases::ReserveCopies(size_t size) {
+    pthread_mutex_lock(&m_lock);
+
+    for (int have = 0; ; ) {
+        Copy* slot = NULL;
+
+        for (int i = 0; i < BL_MAX_COPIES; i++) {
+            Copy& copy = m_copies[i];
+
+            if (copy.mem && copy.size == size)
+                have++;
+            else if (!copy.busy && (!slot || !slot->mem))
+                slot = &copy;
+        }
+
+        if (have >= BL_COPIES_PER_HEAP || !slot || !m_getMemory)
+            break;
+
+        /* Reserve the slot, the client allocates outside our lock */
+        camera_memory_t* idle = slot->mem;
+        camera_request_memory getMemory = m_getMemory;
+        void* user = m_user;
+        slot->mem = NULL;
+        slot->busy = true;
+
+        pthread_mutex_unlock(&m_lock);
+
+        /* Make room by dropping an idle copy of another size */
+        if (idle)
+            idle->release(idle);
+
+        camera_memory_t* mem = getMemory(-1, size, 1, user);
+        if (mem && (!mem->data || mem->size < size)) {
+            mem->release(mem);
+            mem = NULL;
+        }
+
+        pthread_mutex_lock(&m_lock);
+
+        /* A copy for a client that went away meanwhile is of no use */
+        if (mem && (getMemory != m_getMemory || user != m_user)) {
+            pthread_mutex_unlock(&m_lock);
+            mem->release(mem);
+            pthread_mutex_lock(&m_lock);
+            mem = NULL;
+        }
+
+        slot->mem = mem;
+        slot->size = size;
+        slot->busy = false;
+
+        if (!mem) {
+            m_copyFailed++;
+            break;
+        }
+        m_copyAllocs++;
+        have = 0;
+    }
+
+    pthread_mutex_unlock(&m_lock);
+}
+
+BufferLeases::Copy* BufferLeases::TakeCopy(size_t size) {
+    for (int i = 0; i < BL_MAX_COPIES; i++) {
+        Copy& copy = m_copies[i];
+
+        if (!copy.busy && copy.mem && copy.size == size) {
+            copy.busy = true;
+            return &copy;
+        }
+    }
+    return NULL;
+}
+
+void BufferLeases::Revoke(Heap* heap, unsigned int index) {
+    uint32_t lease = (heap - m_heaps) * BL_MAX_INDEXES + index + 1;
+
+    if (!heap->pins[index])
+        return;
+
+    /* Queued frames of the buffer are dropped by Begin from now on */
+    heap->gens[index]++;
+    m_revoked++;
+
+    if (m_delivering != lease)
+        return;
+
+    /* The client is reading it, hold the vendor off until its callback returns */
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += BL_PIN_WAIT_MS / 1000;
+    deadline.tv_nsec += (BL_PIN_WAIT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    m_pinWaits++;
+    while (m_delivering == lease) {
+        if (pthread_cond_timedwait(&m_cond, &m_lock, &deadline) == ETIMEDOUT) {
+            ALOGE("%s: Client still reading buffer %u of heap %p after %d mS", __FUNCTION__,
+                    index, heap->mem, BL_PIN_WAIT_MS);
+            m_pinOverruns++;
+            break;
+        }
+    }
+}
+
+bool BufferLeases::Acquire(WorkerMessage* msg) {
+    if (!msg->data)
+        return true;
+
+    pthread_mutex_lock(&m_lock);
+
+    Heap* heap = FindHeap(msg->data);
+    if (!heap || msg->index >= heap->numBufs || heap->numBufs > BL_MAX_INDEXES) {
+        m_untracked++;
+        pthread_mutex_unlock(&m_lock);
+        return true;
+    }
+
+    unsigned int index = msg->index;
+    bool recycled = heap->pins[index] > 0;
+
+    /* The vendor wrote into a buffer that is still queued, that frame is lost */
+    if (recycled) {
+        heap->gens[index]++;
+        m_recycled++;
+    }
+
+    /* The buffers the vendor writes next must not be read any more */
+    for (unsigned int i = 1; i <= BL_VENDOR_SLACK && i < heap->numBufs; i++) {
+        Revoke(heap, (index + i) % heap->numBufs);
+
+        /* The heap may have been replaced while we waited */
+        if (heap->mem != msg->data) {
+            m_untracked++;
+            pthread_mutex_unlock(&m_lock);
+            return true;
+        }
+    }
+
+    bool needCopy = m_copyMode == BL_COPY_ALWAYS || (m_copyMode == BL_COPY_AUTO &&
+            (recycled || heap->pinned + 1 + BL_VENDOR_SLACK > heap->numBufs));
+
+    if (!needCopy) {
+        heap->pins[index]++;
+        heap->pinned++;
+        if (++m_outstanding > m_outstandingMax)
+            m_outstandingMax = m_outstanding;
+        m_leases++;
+
+        msg->lease = (heap - m_heaps) * BL_MAX_INDEXES + index + 1;
+        msg->leaseGen = heap->gens[index];
+
+        pthread_mutex_unlock(&m_lock);
+        return true;
+    }
+
+    /* Copies come from the ones allocated with the heap, better no frame than a torn one */
+    Copy* copy = TakeCopy(heap->bufSize);
+    if (!copy) {
+        m_copyFailed++;
+        pthread_mutex_unlock(&m_lock);
+        return false;
+    }
+
+    camera_memory_t* mem = copy->mem;
+    const void* src = (const char*)heap->mem->data + index * heap->bufSize;
+    size_t size = heap->bufSize;
+
+    pthread_mutex_unlock(&m_lock);
+
+    /* The vendor owns the buffer until this callback returns, copy it outside our lock */
+    long long start = lease_timestamp();
+    memcpy(mem->data, src, size);
+    long long ns = lease_timestamp() - start;
+
+    msg->data = mem;
+    msg->index = 0;
+    msg->copied = true;
+
+    pthread_mutex_lock(&m_lock);
+    m_copied++;
+    m_copyBytes += size;
+    m_copyNs += ns;
+    pthread_mutex_unlock(&m_lock);
+
+    return true;
+}
+
+bool BufferLeases::Begin(const WorkerMessage* msg) {
+    bool valid = true;
+
+    if (!msg->lease)
+        return true;
+
+    pthread_mutex_lock(&m_lock);
+    const Heap& heap = m_heaps[(msg->lease - 1) / BL_MAX_INDEXES];
+    valid = heap.mem == msg->data && heap.gens[(msg->lease - 1) % BL_MAX_INDEXES] == msg->leaseGen;
+    if (valid)
+        m_delivering = msg->lease;
+    pthread_mutex_unlock(&m_lock);
+
+    return valid;
+}
+
+void BufferLeases::Unpin(const WorkerMessage* msg) {
+    Heap& heap = m_heaps[(msg->lease - 1) / BL_MAX_INDEXES];
+    unsigned int index = (msg->lease - 1) % BL_MAX_INDEXES;
+
+    /* The heap slot may have been reused for another heap since */
+    if (heap.mem == msg->data && heap.pins[index]) {
+        heap.pins[index]--;
+        heap.pinned--;
+        m_outstanding--;
+    }
+}
+
+void BufferLeases::Release(const WorkerMessage* msg) {
+    if (!msg->copied && !msg->lease)
+        return;
+
+    pthread_mutex_lock(&m_lock);
+
+    if (msg->copied) {
+        for (int i = 0; i < BL_MAX_COPIES; i++) {
+            if (m_copies[i].mem == msg->data)
+                m_copies[i].busy = false;
+        }
+
+        /* The client changed meanwhile, its copies can go now */
+        if (!m_getMemory || msg->user != m_user)
+            ReleaseCopies(false);
+    } else {
+        /* The callback returned, a vendor waiting for the buffer can go on */
+        if (m_delivering == msg->lease) {
+            m_delivering = 0;
+            pthread_cond_broadcast(&m_cond);
+        }
+        Unpin(msg);
+    }
+
+    pthread_mutex_unlock(&m_lock);
+}
+
+void BufferLeases::Dump(int fd) {
+    static const char* const sModeNames[] = { "never", "auto", "always" };
+
+    pthread_mutex_lock(&m_lock);
+
+    dprintf(fd, "  buffer leases, copy %s: %u outstanding (max %u), %llu leased, %llu untracked, "
+            "%llu recycled while queued\n",
+            m_copyMode >= BL_COPY_NEVER && m_copyMode <= BL_COPY_ALWAYS ? sModeNames[m_copyMode] : "?",
+            m_outstanding, m_outstandingMax, (unsigned long long)m_leases,
+            (unsigned long long)m_untracked, (unsigned long long)m_recycled);
+    dprintf(fd, "    %llu revoked ahead of the vendor, %llu times the vendor waited for the client, "
+            "%llu overruns\n",
+            (unsigned long long)m_revoked, (unsigned long long)m_pinWaits,
+            (unsigned long long)m_pinOverruns);
+    dprintf(fd, "    %llu copied (%llu KiB avg %lld uS), %llu copy buffers allocated, %llu frames dropped without a copy\n",
+            (unsigned long long)m_copied, (unsigned long long)(m_copyBytes / 1024),
+            m_copied ? m_copyNs / (long long)m_copied / 1000 : 0,
+            (unsigned long long)m_copyAllocs, (unsigned long long)m_copyFailed);
+
+    for (int i = 0; i < BL_MAX_HEAPS; i++) {
+        const Heap& heap = m_heaps[i];
+
+        if (!heap.mem)
+            continue;
+
+        dprintf(fd, "    heap %p: %u x %zu bytes, %u leased\n", heap.mem, heap.numBufs,
+                heap.bufSize, heap.pinned);
+    }
+
+    pthread_mutex_unlock(&m_lock);
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BUFFER_LEASES_H
+#define _BUFFER_LEASES_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <hardware/camera.h>
+
+struct WorkerMessage;
+
+/* When data callbacks are delivered from a copy instead of the vendor buffer */
+#define BL_COPY_NEVER           0
+#define BL_COPY_AUTO            1   /* Once the vendor is about to need a leased buffer back */
+#define BL_COPY_ALWAYS          2
+
+/* Client heaps the vendor allocated that we track */
+#define BL_MAX_HEAPS            8
+
+/* Buffers per heap that can be leased, the rest is delivered untracked */
+#define BL_MAX_INDEXES          32
+
+/* Copies alive at the same time, in flight or waiting for reuse */
+#define BL_MAX_COPIES           6
+
+/* Copies allocated along with each heap, one being delivered, one queued and one being made */
+#define BL_COPIES_PER_HEAP      3
+
+/* Buffers the vendor needs free to keep streaming, one being written and the next */
+#define BL_VENDOR_SLACK         2
+
+/* Longest the vendor waits for the client to finish with a buffer it is about to write */
+#define BL_PIN_WAIT_MS          100
+
+class BufferLeases {
+public:
+    BufferLeases();
+    ~BufferLeases();
+
+    void SetCopyMode(int mode);
+
+    /* Copies are requested from the client, the ones from an older client are released */
+    void SetClient(camera_request_memory getMemory, void* user);
+
+    /* Remembers a heap the vendor got from the client and allocates copies of its size */
+    void OnAllocated(const camera_memory_t* mem, size_t bufSize, unsigned int numBufs);
+
+    /*
+     * Leases the buffer of a data callback, or copies it while the vendor still owns
+     * it. False if the frame has to be dropped, nothing is held then.
+     */
+    bool Acquire(WorkerMessage* msg);
+
+    /*
+     * Called by the worker right before delivery. False once the vendor may be
+     * writing the leased buffer, otherwise the vendor does not write it until
+     * Release. The message has to be released either way.
+     */
+    bool Begin(const WorkerMessage* msg);
+
+    /* Gives back what Acquire took, once the message is delivered or dropped */
+    void Release(const WorkerMessage* msg);
+
+    void Dump(int fd);
+
+private:
+    BufferLeases(const BufferLeases&);
+    BufferLeases& operator=(const BufferLeases&);
+
+    struct Heap {
+        const camera_memory_t* mem;
+        size_t bufSize;
+        uint32_t numBufs;
+        uint32_t pinned;
+        uint16_t pins[BL_MAX_INDEXES];
+        /* Bumped when the vendor delivers a buffer that is still leased */
+        uint32_t gens[BL_MAX_INDEXES];
+    };
+
+    struct Copy {
+        camera_memory_t* mem;
+        size_t size;
+        bool busy;
+    };
+
+    Heap* FindHeap(const camera_memory_t* mem);
+    void Revoke(Heap* heap, unsigned int index);
+    void Unpin(const WorkerMessage* msg);
+    Copy* TakeCopy(size_t size);
+    void ReserveCopies(size_t size);
+    void ReleaseCopies(bool all);
+
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_cond;
+    int m_copyMode;
+    camera_request_memory m_getMemory;
+    void* m_user;
+
+    Heap m_heaps[BL_MAX_HEAPS];
+    uint32_t m_nextHeap;
+    Copy m_copies[BL_MAX_COPIES];
+
+    /* Lease of the frame the client callback is reading, 0 for none */
+    uint32_t m_delivering;
+
+    uint32_t m_outstanding;
+    uint32_t m_outstandingMax;
+    uint64_t m_leases;
+    uint64_t m_untracked;
+    uint64_t m_recycled;
+    uint64_t m_revoked;
+    uint64_t m_pinWaits;
+    uint64_t m_pinOverruns;
+    uint64_t m_copied;
+    uint64_t m_copyAllocs;
+    uint64_t m_copyFailed;
+    uint64_t m_copyBytes;
+    long long m_copyNs;
+};
+
+#endif
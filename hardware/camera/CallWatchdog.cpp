@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Hang watchdog for the HAL1 vendor calls and client callbacks.
+ *
+ * The callback worker keeps the vendor and the client from deadlocking each
+ * other in the known cases, but when either side still hangs the camera just
+ * freezes without a trace. Every vendor call and every client callback marks its
+ * start and end in a slot, and a monitor thread checks the slots a few times per
+ * budget. An operation that overruns the budget is reported once, along with the
+ * stacks of every thread that is inside a watched operation at that moment, which
+ * usually shows both halves of the deadlock.
+ *
+ * With recovery on, the callback worker stops queueing droppable callbacks while
+ * a client callback is stuck, so the vendor is not held up by backpressure
+ * against a client that will not return.
+ */
+
+#define LOG_NDEBUG 1
+#define LOG_TAG "Camera2WrapperWatchdog"
+
+#include "CallWatchdog.h"
+#include <cutils/log.h>
+#include <utils/CallStack.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char* const sKindNames[] = {
+    "vendor call", "client callback",
+};
+
+static long long watchdog_timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+CallWatchdog::CallWatchdog() : m_cameraId(-1), m_budgetNs(0), m_recover(false),
+        m_stuckClient(-1), m_running(false), m_exit(false), m_numReports(0),
+        m_stuckVendor(0), m_stuckClients(0) {
+    for (int i = 0; i < WD_MAX_OPS; i++) {
+        m_ops[i].startNs.store(0, memory_order_relaxed);
+        m_ops[i].seq.store(0, memory_order_relaxed);
+        m_reported[i] = 0;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&m_lock, NULL);
+}
+
+CallWatchdog::~CallWatchdog() {
+    Stop();
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_lock);
+}
+
+bool CallWatchdog::Start(int cameraId, int budgetMs, bool recover) {
+    if (budgetMs <= 0)
+        return false;
+
+    m_cameraId = cameraId;
+    m_budgetNs = budgetMs * 1000000LL;
+    m_recover = recover;
+    m_exit = false;
+
+    if (pthread_create(&m_thread, NULL, ThreadEntry, this)) {
+        ALOGE("%s: failed to start the watchdog of camera %d", __FUNCTION__, cameraId);
+        return false;
+    }
+    m_running = true;
+
+    return true;
+}
+
+void CallWatchdog::Stop() {
+    if (!m_running)
+        return;
+
+    pthread_mutex_lock(&m_lock);
+    m_exit = true;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_lock);
+
+    pthread_join(m_thread, NULL);
+    m_running = false;
+}
+
+int CallWatchdog::Enter(int kind, const char* name, int32_t msgType) {
+    if (!m_running)
+        return -1;
+
+    for (int i = 0; i < WD_MAX_OPS; i++) {
+        Op& op = m_ops[i];
+        long long free = 0;
+
+        /* -1 claims the slot, the monitor skips it until the start time is in */
+        if (!op.startNs.compare_exchange_strong(free, -1, memory_order_acquire))
+            continue;
+
+        op.seq.fetch_add(1, memory_order_relaxed);
+        op.tid.store(gettid(), memory_order_relaxed);
+        op.kind.store(kind, memory_order_relaxed);
+        op.name.store(name, memory_order_relaxed);
+        op.msgType.store(msgType, memory_order_relaxed);
+        op.startNs.store(watchdog_timestamp(), memory_order_release);
+
+        return i;
+    }
+
+    /* More operations in flight than slots, this one goes unwatched */
+    return -1;
+}
+
+void CallWatchdog::Exit(int slot) {
+    int stuck = slot;
+
+    if (m_stuckClient.compare_exchange_strong(stuck, -1, memory_order_relaxed))
+        ALOGE("%s: camera %d client callback returned, delivering callbacks again",
+                __FUNCTION__, m_cameraId);
+
+    m_ops[slot].startNs.store(0, memory_order_release);
+}
+
+void* CallWatchdog::ThreadEntry(void* arg) {
+    ((CallWatchdog*)arg)->Monitor();
+    return NULL;
+}
+
+void CallWatchdog::Monitor() {
+    /* Check a few times per budget so an overrun is caught close to the budget */
+    long long periodNs = m_budgetNs / 4;
+    if (periodNs > 500000000LL)
+        periodNs = 500000000LL;
+    if (periodNs < 10000000LL)
+        periodNs = 10000000LL;
+
+    pthread_mutex_lock(&m_lock);
+    while (!m_exit) {
+        long long wake = watchdog_timestamp() + periodNs;
+        struct timespec ts;
+        ts.tv_sec = wake / 1000000000LL;
+        ts.tv_nsec = wake % 1000000000LL;
+
+        if (pthread_cond_timedwait(&m_cond, &m_lock, &ts) != ETIMEDOUT)
+            continue;
+
+        pthread_mutex_unlock(&m_lock);
+        Check(watchdog_timestamp());
+        pthread_mutex_lock(&m_lock);
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
+void CallWatchdog::LogStack(pid_t tid, android::String8* out) {
+    android::CallStack stack;
+
+    stack.update(0, tid);
+    stack.log(LOG_TAG, ANDROID_LOG_ERROR, "    ");
+
+    out->appendFormat("    thread %d:\n", tid);
+    out->append(stack.toString("      "));
+}
+
+void CallWatchdog::Check(long long now) {
+    for (int i = 0; i < WD_MAX_OPS; i++) {
+        Op& op = m_ops[i];
+        long long start = op.startNs.load(memory_order_acquire);
+
+        if (start <= 0 || now - start < m_budgetNs)
+            continue;
+
+        uint32_t seq = op.seq.load(memory_order_relaxed);
+        if (m_reported[i] == seq)
+            continue;
+
+        Report report;
+        report.whenNs = now;
+        report.stuckNs = now - start;
+        report.kind = op.kind.load(memory_order_relaxed);
+        report.name = op.name.load(memory_order_relaxed);
+        report.msgType = op.msgType.load(memory_order_relaxed);
+        report.tid = op.tid.load(memory_order_relaxed);
+
+        /* The operation may have finished and the slot been reused meanwhile */
+        atomic_thread_fence(memory_order_acquire);
+        if (op.startNs.load(memory_order_relaxed) != start)
+            continue;
+        m_reported[i] = seq;
+
+        ALOGE("%s: camera %d %s %s (msg_type 0x%x) on thread %d stuck for %lld mS",
+                __FUNCTION__, m_cameraId, sKindNames[report.kind], report.name,
+                report.msgType, report.tid, report.stuckNs / 1000000);
+
+        /* The stuck thread first, then whoever else is inside a watched operation */
+        LogStack(report.tid, &report.stacks);
+        for (int j = 0; j < WD_MAX_OPS; j++) {
+            if (j == i || m_ops[j].startNs.load(memory_order_acquire) <= 0)
+                continue;
+
+            pid_t tid = m_ops[j].tid.load(memory_order_relaxed);
+            ALOGE("%s: camera %d also inside %s %s on thread %d", __FUNCTION__, m_cameraId,
+                    sKindNames[m_ops[j].kind.load(memory_order_relaxed)],
+                    m_ops[j].name.load(memory_order_relaxed), tid);
+            if (tid != report.tid)
+                LogStack(tid, &report.stacks);
+        }
+
+        if (report.kind == WD_CLIENT_CALLBACK && m_recover) {
+            ALOGE("%s: camera %d dropping callbacks until the client returns",
+                    __FUNCTION__, m_cameraId);
+            m_stuckClient.store(i, memory_order_relaxed);
+
+            /* It may have returned while we were unwinding, Exit missed the flag then */
+            if (op.startNs.load(memory_order_acquire) != start)
+                m_stuckClient.store(-1, memory_order_relaxed);
+        }
+
+        pthread_mutex_lock(&m_lock);
+        if (report.kind == WD_CLIENT_CALLBACK)
+            m_stuckClients++;
+        else
+            m_stuckVendor++;
+        m_reports[m_numReports++ % WD_MAX_REPORTS] = report;
+        pthread_mutex_unlock(&m_lock);
+    }
+}
+
+void CallWatchdog::Dump(int fd) {
+    long long now = watchdog_timestamp();
+
+    if (!m_running) {
+        dprintf(fd, "  watchdog off\n");
+        return;
+    }
+
+    pthread_mutex_lock(&m_lock);
+
+    dprintf(fd, "  watchdog budget %lld mS, recovery %s: %llu vendor calls and %llu client callbacks overran it\n",
+            m_budgetNs / 1000000, m_recover ? "on" : "off",
+            (unsigned long long)m_stuckVendor, (unsigned long long)m_stuckClients);
+
+    for (int i = 0; i < WD_MAX_OPS; i++) {
+        long long start = m_ops[i].startNs.load(memory_order_acquire);
+
+        if (start <= 0)
+            continue;
+
+        dprintf(fd, "    in flight: %s %s (msg_type 0x%x) on thread %d for %lld mS\n",
+                sKindNames[m_ops[i].kind.load(memory_order_relaxed)],
+                m_ops[i].name.load(memory_order_relaxed),
+                m_ops[i].msgType.load(memory_order_relaxed),
+                m_ops[i].tid.load(memory_order_relaxed), (now - start) / 1000000);
+    }
+
+    uint32_t count = m_numReports < WD_MAX_REPORTS ? m_numReports : WD_MAX_REPORTS;
+    for (uint32_t i = 0; i < count; i++) {
+        const Report& report = m_reports[(m_numReports - 1 - i) % WD_MAX_REPORTS];
+
+        dprintf(fd, "    %lld mS ago: %s %s (msg_type 0x%x) on thread %d stuck for %lld mS\n",
+                (now - report.whenNs) / 1000000, sKindNames[report.kind], report.name,
+                report.msgType, report.tid, report.stuckNs / 1000000);
+        dprintf(fd, "%s", report.stacks.string());
+    }
+
+    pthread_mutex_unlock(&m_lock);
+}
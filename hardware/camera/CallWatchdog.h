@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CALL_WATCHDOG_H
+#define _CALL_WATCHDOG_H
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <utils/String8.h>
+
+/* Kinds of watched operations */
+#define WD_VENDOR_CALL      0
+#define WD_CLIENT_CALLBACK  1
+
+/* Operations that can be watched at the same time */
+#define WD_MAX_OPS          8
+
+/* Stuck operations kept for the dump */
+#define WD_MAX_REPORTS      4
+
+class CallWatchdog {
+public:
+    CallWatchdog();
+    ~CallWatchdog();
+
+    /* Starts the monitor thread, returns false and watches nothing if budgetMs is 0 */
+    bool Start(int cameraId, int budgetMs, bool recover);
+
+    /* Stops the monitor thread, must not race with Enter or Exit */
+    void Stop();
+
+    /* Marks the start of an operation, returns its slot or -1 if it is not watched */
+    int Enter(int kind, const char* name, int32_t msgType);
+
+    /* Marks the end of an operation started by Enter */
+    void Exit(int slot);
+
+    /* True while recovery is on and a client callback overran the budget */
+    bool ClientStuck() const { return m_stuckClient.load(std::memory_order_relaxed) >= 0; }
+
+    void Dump(int fd);
+
+private:
+    CallWatchdog(const CallWatchdog&);
+    CallWatchdog& operator=(const CallWatchdog&);
+
+    struct Op {
+        /* 0 while the slot is free */
+        std::atomic<long long> startNs;
+        /* Bumped on every Enter so a report never mixes two operations */
+        std::atomic<uint32_t> seq;
+        std::atomic<pid_t> tid;
+        std::atomic<int> kind;
+        std::atomic<const char*> name;
+        std::atomic<int32_t> msgType;
+    };
+
+    struct Report {
+        long long whenNs;
+        long long stuckNs;
+        int kind;
+        const char* name;
+        int32_t msgType;
+        pid_t tid;
+        android::String8 stacks;
+    };
+
+    static void* ThreadEntry(void* arg);
+    void Monitor();
+    void Check(long long now);
+    void LogStack(pid_t tid, android::String8* out);
+
+    int m_cameraId;
+    long long m_budgetNs;
+    bool m_recover;
+
+    Op m_ops[WD_MAX_OPS];
+
+    /* Monitor thread private, seq of the operation last reported per slot */
+    uint32_t m_reported[WD_MAX_OPS];
+
+    /* Slot of the client callback recovery is dropping callbacks for, or -1 */
+    std::atomic<int> m_stuckClient;
+
+    pthread_t m_thread;
+    bool m_running;
+    bool m_exit;
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_cond;
+
+    /* Protected by m_lock */
+    Report m_reports[WD_MAX_REPORTS];
+    uint32_t m_numReports;
+    uint64_t m_stuckVendor;
+    uint64_t m_stuckClients;
+};
+
+/* Watches the enclosing scope, a NULL watchdog watches nothing */
+class WatchdogScope {
+public:
+    WatchdogScope(CallWatchdog* watchdog, int kind, const char* name, int32_t msgType = 0) :
+            m_watchdog(watchdog), m_slot(watchdog ? watchdog->Enter(kind, name, msgType) : -1) {}
+    ~WatchdogScope() {
+        if (m_slot >= 0)
+            m_watchdog->Exit(m_slot);
+    }
+
+private:
+    WatchdogScope(const WatchdogScope&);
+    WatchdogScope& operator=(const WatchdogScope&);
+
+    CallWatchdog* m_watchdog;
+    int m_slot;
+};
+
+#endif
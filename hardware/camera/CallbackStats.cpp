@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Always-on statistics for the HAL1 callback pipeline.
+ *
+ * Every counter is a relaxed atomic so recording costs a handful of uncontended
+ * increments per callback. Latencies go into log2 buckets in microseconds, which is
+ * plenty to tell a 1mS dispatch from a 30mS one when correlating preview jank.
+ */
+
+#define LOG_NDEBUG 1
+#define LOG_TAG "Camera2WrapperCbStats"
+
+#include "CallbackStats.h"
+#include <cutils/log.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+static long long stats_timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char* const sTypeNames[CB_STATS_TYPES] = {
+    "ERROR", "SHUTTER", "FOCUS", "ZOOM", "PREVIEW_FRAME", "VIDEO_FRAME",
+    "POSTVIEW_FRAME", "RAW_IMAGE", "COMPRESSED_IMAGE", "RAW_IMAGE_NOTIFY",
+    "PREVIEW_METADATA", "FOCUS_MOVE", "0x1000", "0x2000", "0x4000", "0x8000",
+    "VENDOR",
+};
+
+static const char* const sDropNames[CB_STATS_DROP_REASONS] = {
+    "stale", "superseded", "cleared", "overflow", "stuck", "recycled",
+};
+
+const char *camera_wrapper_cb_type_name(int type)
+{
+    if (type < 0 || type >= CB_STATS_TYPES)
+        return "?";
+    return sTypeNames[type];
+}
+
+uint64_t camera_wrapper_cb_hist_percentile(const uint64_t *hist, int percentile)
+{
+    uint64_t total = 0, seen = 0;
+
+    for (int i = 0; i < CB_STATS_HIST_BUCKETS; i++)
+        total += hist[i];
+    if (!total)
+        return 0;
+
+    /* Report the upper bound of the bucket that holds the percentile */
+    uint64_t target = (total * percentile + 99) / 100;
+    for (int i = 0; i < CB_STATS_HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= target)
+            return 1ULL << i;
+    }
+
+    return 1ULL << (CB_STATS_HIST_BUCKETS - 1);
+}
+
+CallbackStats::CallbackStats() {
+    Reset();
+}
+
+void CallbackStats::Reset() {
+    m_queueDepth.store(0, memory_order_relaxed);
+    m_queueDepthMax.store(0, memory_order_relaxed);
+    m_clears.store(0, memory_order_relaxed);
+    m_cleared.store(0, memory_order_relaxed);
+    m_stalls.store(0, memory_order_relaxed);
+    m_stallUs.store(0, memory_order_relaxed);
+    m_spilled.store(0, memory_order_relaxed);
+    m_spillExhausted.store(0, memory_order_relaxed);
+    m_resetNs.store(stats_timestamp(), memory_order_relaxed);
+
+    for (int t = 0; t < CB_STATS_TYPES; t++) {
+        TypeStats& ts = m_types[t];
+        ts.posted.store(0, memory_order_relaxed);
+        ts.delivered.store(0, memory_order_relaxed);
+        for (int i = 0; i < CB_STATS_DROP_REASONS; i++)
+            ts.drops[i].store(0, memory_order_relaxed);
+        for (int i = 0; i < CB_STATS_HIST_BUCKETS; i++) {
+            ts.queueHist[i].store(0, memory_order_relaxed);
+            ts.execHist[i].store(0, memory_order_relaxed);
+        }
+        ts.queueMaxUs.store(0, memory_order_relaxed);
+        ts.execMaxUs.store(0, memory_order_relaxed);
+    }
+}
+
+int CallbackStats::Bucket(long long ns) {
+    long long us = ns / 1000;
+
+    if (us <= 0)
+        return 0;
+
+    int bucket = 64 - __builtin_clzll((unsigned long long)us);
+    return bucket < CB_STATS_HIST_BUCKETS ? bucket : CB_STATS_HIST_BUCKETS - 1;
+}
+
+void CallbackStats::UpdateMax(atomic<uint64_t> &max, uint64_t value) {
+    uint64_t cur = max.load(memory_order_relaxed);
+    while (value > cur && !max.compare_exchange_weak(cur, value, memory_order_relaxed))
+        ;
+}
+
+void CallbackStats::OnPost(int type) {
+    m_types[type].posted.fetch_add(1, memory_order_relaxed);
+}
+
+void CallbackStats::OnDrop(int type, int reason) {
+    m_types[type].drops[reason].fetch_add(1, memory_order_relaxed);
+}
+
+void CallbackStats::OnClear(uint32_t flushed) {
+    m_clears.fetch_add(1, memory_order_relaxed);
+    m_cleared.fetch_add(flushed, memory_order_relaxed);
+}
+
+void CallbackStats::OnStall(long long ns) {
+    m_stalls.fetch_add(1, memory_order_relaxed);
+    m_stallUs.fetch_add(ns / 1000, memory_order_relaxed);
+}
+
+void CallbackStats::OnSpill(bool exhausted) {
+    m_spilled.fetch_add(1, memory_order_relaxed);
+    if (exhausted)
+        m_spillExhausted.fetch_add(1, memory_order_relaxed);
+}
+
+void CallbackStats::OnDispatch(int type, long long queueNs, long long execNs) {
+    TypeStats& ts = m_types[type];
+
+    ts.delivered.fetch_add(1, memory_order_relaxed);
+    ts.queueHist[Bucket(queueNs)].fetch_add(1, memory_order_relaxed);
+    ts.execHist[Bucket(execNs)].fetch_add(1, memory_order_relaxed);
+    UpdateMax(ts.queueMaxUs, queueNs / 1000);
+    UpdateMax(ts.execMaxUs, execNs / 1000);
+}
+
+void CallbackStats::OnQueueDepth(uint32_t depth) {
+    m_queueDepth.store(depth, memory_order_relaxed);
+    if (depth > m_queueDepthMax.load(memory_order_relaxed))
+        m_queueDepthMax.store(depth, memory_order_relaxed);
+}
+
+void CallbackStats::Snapshot(struct camera_wrapper_cb_stats *out) const {
+    memset(out, 0, sizeof(*out));
+
+    out->window_ms = (stats_timestamp() - m_resetNs.load(memory_order_relaxed)) / 1000000;
+
+    out->queue_depth = m_queueDepth.load(memory_order_relaxed);
+    out->queue_depth_max = m_queueDepthMax.load(memory_order_relaxed);
+    out->clears = m_clears.load(memory_order_relaxed);
+    out->cleared = m_cleared.load(memory_order_relaxed);
+    out->stalls = m_stalls.load(memory_order_relaxed);
+    out->stall_us = m_stallUs.load(memory_order_relaxed);
+    out->spilled = m_spilled.load(memory_order_relaxed);
+    out->spill_exhausted = m_spillExhausted.load(memory_order_relaxed);
+
+    for (int t = 0; t < CB_STATS_TYPES; t++) {
+        const TypeStats& ts = m_types[t];
+        struct camera_wrapper_cb_type_stats& o = out->types[t];
+
+        o.posted = ts.posted.load(memory_order_relaxed);
+        o.delivered = ts.delivered.load(memory_order_relaxed);
+        for (int i = 0; i < CB_STATS_DROP_REASONS; i++)
+            o.drops[i] = ts.drops[i].load(memory_order_relaxed);
+        for (int i = 0; i < CB_STATS_HIST_BUCKETS; i++) {
+            o.queue_hist[i] = ts.queueHist[i].load(memory_order_relaxed);
+            o.exec_hist[i] = ts.execHist[i].load(memory_order_relaxed);
+        }
+        o.queue_max_us = ts.queueMaxUs.load(memory_order_relaxed);
+        o.exec_max_us = ts.execMaxUs.load(memory_order_relaxed);
+    }
+}
+
+void CallbackStats::Dump(int fd, const char *name) const {
+    struct camera_wrapper_cb_stats stats;
+
+    Snapshot(&stats);
+
+    dprintf(fd, "%s callback pipeline, last %llu mS:\n", name, (unsigned long long)stats.window_ms);
+    dprintf(fd, "  queue depth %u (max %u), %llu clears flushed %llu, %llu stalls for %lluuS\n",
+            stats.queue_depth, stats.queue_depth_max,
+            (unsigned long long)stats.clears, (unsigned long long)stats.cleared,
+            (unsigned long long)stats.stalls, (unsigned long long)stats.stall_us);
+    dprintf(fd, "  %llu spilled from a full ring, %llu of them heap allocated\n",
+            (unsigned long long)stats.spilled, (unsigned long long)stats.spill_exhausted);
+
+    for (int t = 0; t < CB_STATS_TYPES; t++) {
+        const struct camera_wrapper_cb_type_stats& o = stats.types[t];
+
+        if (!o.posted)
+            continue;
+
+        dprintf(fd, "  %-17s posted %llu delivered %llu (%llu/s)", sTypeNames[t],
+                (unsigned long long)o.posted, (unsigned long long)o.delivered,
+                stats.window_ms ? (unsigned long long)(o.delivered * 1000 / stats.window_ms) : 0ULL);
+        for (int i = 0; i < CB_STATS_DROP_REASONS; i++)
+            dprintf(fd, " %s %llu", sDropNames[i], (unsigned long long)o.drops[i]);
+        dprintf(fd, "\n");
+
+        dprintf(fd, "    queue p50 <%lluuS p99 <%lluuS max %lluuS, exec p50 <%lluuS p99 <%lluuS max %lluuS\n",
+                (unsigned long long)camera_wrapper_cb_hist_percentile(o.queue_hist, 50),
+                (unsigned long long)camera_wrapper_cb_hist_percentile(o.queue_hist, 99),
+                (unsigned long long)o.queue_max_us,
+                (unsigned long long)camera_wrapper_cb_hist_percentile(o.exec_hist, 50),
+                (unsigned long long)camera_wrapper_cb_hist_percentile(o.exec_hist, 99),
+                (unsigned long long)o.exec_max_us);
+    }
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CALLBACK_STATS_H
+#define _CALLBACK_STATS_H
+
+#include <stdint.h>
+
+/* One entry per CAMERA_MSG_* bit plus one for unknown vendor types */
+#define CB_STATS_TYPES          17
+
+/* Bucket i counts latencies in [2^(i-1), 2^i) uS, bucket 0 is below 1uS */
+#define CB_STATS_HIST_BUCKETS   24
+
+#define CB_STATS_DROP_STALE         0
+#define CB_STATS_DROP_SUPERSEDED    1
+#define CB_STATS_DROP_CLEARED       2
+#define CB_STATS_DROP_OVERFLOW      3
+#define CB_STATS_DROP_STUCK         4
+#define CB_STATS_DROP_RECYCLED      5
+#define CB_STATS_DROP_REASONS       6
+
+struct camera_wrapper_cb_type_stats {
+    uint64_t posted;
+    uint64_t delivered;
+    uint64_t drops[CB_STATS_DROP_REASONS];
+
+    /* Enqueue to dispatch latency */
+    uint64_t queue_hist[CB_STATS_HIST_BUCKETS];
+    uint64_t queue_max_us;
+
+    /* Time spent inside the client callback */
+    uint64_t exec_hist[CB_STATS_HIST_BUCKETS];
+    uint64_t exec_max_us;
+};
+
+struct camera_wrapper_cb_stats {
+    /* Time the statistics cover, since the device was opened or the last reset */
+    uint64_t window_ms;
+
+    uint32_t queue_depth;
+    uint32_t queue_depth_max;
+
+    /* ClearCallbacks calls and the callbacks they flushed */
+    uint64_t clears;
+    uint64_t cleared;
+
+    /* HAL thread stalls caused by backpressure */
+    uint64_t stalls;
+    uint64_t stall_us;
+
+    /* Callbacks that spilled out of the full ring, and those the spill pool had to heap allocate */
+    uint64_t spilled;
+    uint64_t spill_exhausted;
+
+    struct camera_wrapper_cb_type_stats types[CB_STATS_TYPES];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Copies the callback pipeline statistics of an open HAL1 camera, returns 0 on success */
+int camera_wrapper_get_cb_stats(int camera_id, struct camera_wrapper_cb_stats *stats);
+
+/* Resets the callback pipeline statistics of an open HAL1 camera */
+void camera_wrapper_reset_cb_stats(int camera_id);
+
+/* Returns the CAMERA_MSG_* name of a stats type index */
+const char *camera_wrapper_cb_type_name(int type);
+
+/* Returns the latency in uS at the given percentile (0-100) of a histogram */
+uint64_t camera_wrapper_cb_hist_percentile(const uint64_t *hist, int percentile);
+
+#ifdef __cplusplus
+}
+
+#include <atomic>
+
+class CallbackStats {
+public:
+    CallbackStats();
+
+    void Reset();
+
+    /* Producer side, may be called from any vendor thread */
+    void OnPost(int type);
+    void OnDrop(int type, int reason);
+    void OnClear(uint32_t flushed);
+    void OnStall(long long ns);
+    void OnSpill(bool exhausted);
+
+    /* Worker side */
+    void OnDispatch(int type, long long queueNs, long long execNs);
+    void OnQueueDepth(uint32_t depth);
+
+    void Snapshot(struct camera_wrapper_cb_stats *out) const;
+    void Dump(int fd, const char *name) const;
+
+private:
+    CallbackStats(const CallbackStats&);
+    CallbackStats& operator=(const CallbackStats&);
+
+    static int Bucket(long long ns);
+    static void UpdateMax(std::atomic<uint64_t> &max, uint64_t value);
+
+    struct TypeStats {
+        std::atomic<uint64_t> posted;
+        std::atomic<uint64_t> delivered;
+        std::atomic<uint64_t> drops[CB_STATS_DROP_REASONS];
+        std::atomic<uint64_t> queueHist[CB_STATS_HIST_BUCKETS];
+        std::atomic<uint64_t> queueMaxUs;
+        std::atomic<uint64_t> execHist[CB_STATS_HIST_BUCKETS];
+        std::atomic<uint64_t> execMaxUs;
+    };
+
+    std::atomic<uint32_t> m_queueDepth;
+    std::atomic<uint32_t> m_queueDepthMax;
+    std::atomic<uint64_t> m_clears;
+    std::atomic<uint64_t> m_cleared;
+    std::atomic<uint64_t> m_stalls;
+    std::atomic<uint64_t> m_stallUs;
+    std::atomic<uint64_t> m_spilled;
+    std::atomic<uint64_t> m_spillExhausted;
+    std::atomic<long long> m_resetNs;
+    TypeStats m_types[CB_STATS_TYPES];
+};
+
+#endif
+
+#endif
@@ -37,6 +37,13 @@
  * This worker thread offloads the actual callbacks to another thread which allows the
  * HAL to finish the client calls and avoid the deadlock scenario.
  *
+ * Callbacks are posted into a preallocated lock-free ring that the worker drains,
+ * with a small spill pool for callbacks that must not be lost when it is full and
+ * a latest-frame slot for preview frames. A policy table per msg_type decides what
+ * may be dropped when stale or superseded. Data callbacks may hold a lease on the
+ * vendor buffer, given back once the message is retired. The HAL thread is only
+ * slowed down while the worker is actually behind.
+ *
  */
 
 #define LOG_NDEBUG 1
@@ -46,30 +53,126 @@
 #include <iostream>
 #include <cutils/log.h>
 
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
 using namespace std;
 
-#define MSG_EXIT_THREAD         1
 #define MSG_EXECUTE_CALLBACK      2
 #define MSG_UPDATE_CALLBACKS    3
 
+
+/* Preview slot, the held frame and frames being written by vendor threads */
+#define CB_PREVIEW_POOL_SIZE    4
+
+#define CB_DEFAULT_STALE_NS     5000000LL   /* 5mS, unknown vendor msg types */
+#define CB_FRAME_STALE_NS       33000000LL  /* One frame at 30fps */
+#define CB_EVENT_STALE_NS       100000000LL /* 100mS */
+
+/*
+ * Delivery policies indexed by the lowest CAMERA_MSG_* bit of the msg_type. Preview
+ * frames are only worth delivering while fresh, whereas one-shot events like focus,
+ * shutter and the JPEG itself are always delivered.
+ */
+static const CbDeliveryPolicy sDeliveryPolicies[CB_POLICY_TYPES] = {
+    /* CAMERA_MSG_ERROR */              { 0,                    CB_POLICY_GUARANTEED },
+    /* CAMERA_MSG_SHUTTER */            { 0,                    CB_POLICY_GUARANTEED },
+    /* CAMERA_MSG_FOCUS */              { 0,                    CB_POLICY_GUARANTEED },
+    /* CAMERA_MSG_ZOOM */               { CB_EVENT_STALE_NS,    0 },
+    /* CAMERA_MSG_PREVIEW_FRAME */      { CB_FRAME_STALE_NS,    CB_POLICY_LATEST_WINS },
+    /* CAMERA_MSG_VIDEO_FRAME */        { CB_FRAME_STALE_NS,    0 },
+    /* CAMERA_MSG_POSTVIEW_FRAME */     { 0,                    CB_POLICY_GUARANTEED },
+    /* CAMERA_MSG_RAW_IMAGE */          { 0,                    CB_POLICY_GUARANTEED },
+    /* CAMERA_MSG_COMPRESSED_IMAGE */   { 0,                    CB_POLICY_GUARANTEED },
+    /* CAMERA_MSG_RAW_IMAGE_NOTIFY */   { 0,                    CB_POLICY_GUARANTEED },
+    /* CAMERA_MSG_PREVIEW_METADATA */   { CB_FRAME_STALE_NS,    CB_POLICY_LATEST_WINS },
+    /* CAMERA_MSG_FOCUS_MOVE */         { CB_EVENT_STALE_NS,    0 },
+    /* 0x1000 - 0x8000, unused */       { CB_DEFAULT_STALE_NS,  0 },
+                                        { CB_DEFAULT_STALE_NS,  0 },
+                                        { CB_DEFAULT_STALE_NS,  0 },
+                                        { CB_DEFAULT_STALE_NS,  0 },
+    /* Vendor specific msg types */     { CB_DEFAULT_STALE_NS,  0 },
+};
+
 struct ThreadMsg
 {
-    ThreadMsg(int i, const void* m, long long ts) { id = i; msg = m; CallerTS = ts; }
+    /* Slot sequence number, owned by the ring */
+    std::atomic<uint32_t> seq;
+
     int id;
-    const void* msg;
+    uint32_t gen;
     long long CallerTS;
+    uint32_t latestSeq;
+    WorkerMessage msg;
+    CallbackData callbacks;
+
+    /* Global post order, used to merge the ring and the spill list */
+    uint64_t postSeq;
+
+    /* Spill list link */
+    ThreadMsg* next;
 };
 
-CallbackWorkerThread::CallbackWorkerThread() : m_thread(0) {
+static void copy_message(ThreadMsg* out, const ThreadMsg* in)
+{
+    out->id = in->id;
+    out->gen = in->gen;
+    out->CallerTS = in->CallerTS;
+    out->latestSeq = in->latestSeq;
+    out->msg = in->msg;
+    out->callbacks = in->callbacks;
+    out->postSeq = in->postSeq;
+}
+
+static int futex(std::atomic<int32_t>* addr, int op, int32_t val,
+        const struct timespec* timeout = NULL)
+{
+    return syscall(SYS_futex, reinterpret_cast<int32_t*>(addr), op, val, timeout, NULL, 0);
+}
+
+CallbackWorkerThread::CallbackWorkerThread() : m_thread(0), m_name(0), m_ring(0), m_ringSize(0),
+        m_ringMask(0), m_head(0), m_tail(0), m_spillStack(0), m_spillHead(0), m_spillTail(0),
+        m_spillPending(0), m_postSeq(0), m_previewMailbox(0), m_previewHeld(0),
+        m_previewPending(0), m_previewCoalescing(false), m_clearGen(0), m_wakeSeq(0), m_sleeping(0), m_exit(false),
+        m_maxBacklogDepth(2), m_maxBacklogAgeMs(10), m_busySinceTs(0), m_popSeq(0),
+        m_stalledProducers(0), m_overflowPolicy(CB_OVERFLOW_DROP_NEWEST), m_overflowBudgetUs(0), m_overflowDrops(0),
+        m_watchdog(0), m_leases(0) {
+    for (int i = 0; i < CB_POLICY_TYPES; i++)
+        m_latestSeq[i].store(0, memory_order_relaxed);
 }
 
 CallbackWorkerThread::~CallbackWorkerThread() {
     ExitThread();
+    delete[] m_ring;
 }
 
-bool CallbackWorkerThread::CreateThread() {
-    if (!m_thread)
-        m_thread = new thread(&CallbackWorkerThread::Process, this);
+bool CallbackWorkerThread::CreateThread(uint32_t ringSize, uint32_t spillSize) {
+    if (m_thread)
+        return true;
+
+    /* Preallocate the ring and spill pool so that posting a callback never allocates */
+    if (!m_ring) {
+        m_ringSize = 2;
+        while (m_ringSize < ringSize && m_ringSize < (1U << 16))
+            m_ringSize <<= 1;
+        m_ringMask = m_ringSize - 1;
+        m_ring = new ThreadMsg[m_ringSize];
+        m_spillPool.Init(spillSize);
+        m_previewPool.Init(CB_PREVIEW_POOL_SIZE);
+    }
+
+    for (uint32_t i = 0; i < m_ringSize; i++)
+        m_ring[i].seq.store(i, memory_order_relaxed);
+    m_head.store(0, memory_order_relaxed);
+    m_tail.store(0, memory_order_relaxed);
+    m_busySinceTs.store(0, memory_order_relaxed);
+    m_exit.store(false, memory_order_relaxed);
+    m_overflowDrops.store(0, memory_order_relaxed);
+
+    m_thread = new thread(&CallbackWorkerThread::Process, this);
     return true;
 }
 
@@ -77,15 +180,13 @@ void CallbackWorkerThread::ExitThread() {
     if (!m_thread)
         return;
 
-    /* Create the exit thread worker message */
-    ThreadMsg* threadMsg = new ThreadMsg(MSG_EXIT_THREAD, 0, GetTimestamp());
+    /* Flag the worker to exit, anything still queued is discarded */
+    m_exit.store(true, memory_order_seq_cst);
+    WakeWorker(true);
 
-    /* Add it to the message queue */
-    {
-        lock_guard<mutex> lock(m_mutex);
-        m_queue.push(threadMsg);
-        m_cv.notify_one();
-    }
+    /* Release any HAL thread still waiting on the backlog */
+    m_popSeq.fetch_add(1, memory_order_release);
+    futex(&m_popSeq, FUTEX_WAKE_PRIVATE, INT32_MAX);
 
     /* Join the thread and then cleanup */
     m_thread->join();
@@ -93,167 +194,506 @@ void CallbackWorkerThread::ExitThread() {
     m_thread = 0;
 }
 
-void CallbackWorkerThread::AddCallback(const WorkerMessage* data) {
+bool CallbackWorkerThread::AddCallback(const WorkerMessage* data) {
     /* Assert that the thread exists */
     ALOG_ASSERT(m_thread != NULL);
 
-    /* Create a new worker thread message from the data */
-    ThreadMsg* threadMsg = new ThreadMsg(MSG_EXECUTE_CALLBACK, data, GetTimestamp());
+    const CbDeliveryPolicy* policy = GetDeliveryPolicy(data->msg_type);
+
+    /* Nothing but guaranteed callbacks is worth queueing behind a client that does not return */
+    if (m_watchdog && m_watchdog->ClientStuck() && !(policy->flags & CB_POLICY_GUARANTEED)) {
+        m_stats.OnPost(PolicyIndex(data->msg_type));
+        m_stats.OnDrop(PolicyIndex(data->msg_type), CB_STATS_DROP_STUCK);
+        return false;
+    }
+
+    /* Preview frames skip the ring and replace any undelivered older frame */
+    if (PolicyIndex(data->msg_type) == PolicyIndex(CAMERA_MSG_PREVIEW_FRAME) &&
+            m_previewCoalescing.load(memory_order_relaxed)) {
+        PostPreviewFrame(data);
+        m_stats.OnPost(PolicyIndex(data->msg_type));
+        return true;
+    }
+
+    /* Copy the callback into a free ring slot and notify the worker */
+    if (PushMessage(MSG_EXECUTE_CALLBACK, data, NULL,
+            m_overflowPolicy.load(memory_order_relaxed),
+            m_overflowBudgetUs.load(memory_order_relaxed))) {
+        m_stats.OnPost(PolicyIndex(data->msg_type));
+        return true;
+    }
+
+    /* Callbacks that must be delivered spill over instead of being dropped */
+    if (policy->flags & CB_POLICY_GUARANTEED) {
+        SpillMessage(MSG_EXECUTE_CALLBACK, data, NULL);
+        m_stats.OnPost(PolicyIndex(data->msg_type));
+        return true;
+    }
+
+    m_stats.OnPost(PolicyIndex(data->msg_type));
+    m_stats.OnDrop(PolicyIndex(data->msg_type), CB_STATS_DROP_OVERFLOW);
+    uint32_t drops = m_overflowDrops.fetch_add(1, memory_order_relaxed) + 1;
+    ALOGV("%s: Ring full, dropped msg_type %i (%u drops)", __FUNCTION__, data->msg_type, drops);
+    (void)drops;
+    return false;
+}
 
-    /* Add it to our worker queue and notify the worker */
-    std::unique_lock<std::mutex> lk(m_mutex);
-    m_queue.push(threadMsg);
-    m_cv.notify_one();
+void CallbackWorkerThread::DropCallback(const WorkerMessage* data, int reason) {
+    m_stats.OnPost(PolicyIndex(data->msg_type));
+    m_stats.OnDrop(PolicyIndex(data->msg_type), reason);
 }
 
 void CallbackWorkerThread::SetCallbacks(const CallbackData* data) {
     /* Assert that the thread exists */
     ALOG_ASSERT(m_thread != NULL);
 
-    /* Create a new worker thread message from the callback data */
-    ThreadMsg* threadMsg = new ThreadMsg(MSG_UPDATE_CALLBACKS, data, GetTimestamp());
-
-    /* Add it to our worker queue and notify the worker */
-    std::unique_lock<std::mutex> lk(m_mutex);
-    m_queue.push(threadMsg);
-    m_cv.notify_one();
+    /* Queue the callback update behind any pending callbacks, it must never be lost */
+    if (!PushMessage(MSG_UPDATE_CALLBACKS, NULL, data, CB_OVERFLOW_DROP_NEWEST, 0))
+        SpillMessage(MSG_UPDATE_CALLBACKS, NULL, data);
 }
 
 void CallbackWorkerThread::ClearCallbacks() {
     /* Assert that the thread exists */
     ALOG_ASSERT(m_thread != NULL);
 
-    /* Lock the mutex and clear the message queue */
-    std::unique_lock<std::mutex> lk(m_mutex);
+    /* Bump the generation, the worker skips every callback queued before now */
+    uint32_t gen = m_clearGen.fetch_add(1, memory_order_acq_rel) + 1;
+    m_stats.OnClear(Backlog());
+
+    ALOGV("%s: Clearing messages older than generation %u", __FUNCTION__, gen);
+    (void)gen;
+}
+
+void CallbackWorkerThread::SetOverflowPolicy(int policy, int budgetUs) {
+    m_overflowPolicy.store(policy, memory_order_relaxed);
+    m_overflowBudgetUs.store(budgetUs < 0 ? 0 : budgetUs, memory_order_relaxed);
+}
+
+void CallbackWorkerThread::SetBackpressure(int maxDepth, int maxAgeMs) {
+    m_maxBacklogDepth.store(maxDepth < 0 ? 0 : maxDepth, memory_order_relaxed);
+    m_maxBacklogAgeMs.store(maxAgeMs < 0 ? 0 : maxAgeMs, memory_order_relaxed);
+}
+
+uint32_t CallbackWorkerThread::Backlog() {
+    /* Read the tail first so a concurrent pop can never make the result wrap */
+    uint32_t tail = m_tail.load(memory_order_acquire);
+    return m_head.load(memory_order_acquire) - tail + m_spillPending.load(memory_order_relaxed) +
+            m_previewPending.load(memory_order_relaxed);
+}
+
+/*
+ * Replaces the fixed sleep the HAL thread used to take after every callback. It only
+ * stalls while the worker is behind, and never longer than maxStallUs, so a client
+ * stuck in a HAL call can not hold the HAL thread forever.
+ */
+void CallbackWorkerThread::WaitForBacklog(int maxStallUs) {
+    long long deadline = 0, stallStart = 0;
+
+    if (!m_thread || maxStallUs <= 0)
+        return;
+
+    /* Never stall the worker itself, a client callback may call back into the HAL */
+    if (this_thread::get_id() == m_thread->get_id())
+        return;
+
+    /* Waiting for a stuck client would only hold up the HAL thread */
+    if (m_watchdog && m_watchdog->ClientStuck())
+        return;
+
+    while (!m_exit.load(memory_order_relaxed)) {
+        int32_t key = m_popSeq.load(memory_order_acquire);
+        long long busySince = m_busySinceTs.load(memory_order_relaxed);
+        bool tooDeep = Backlog() > (uint32_t)m_maxBacklogDepth.load(memory_order_relaxed);
+        bool tooOld = busySince &&
+                GetTimestamp() - busySince > m_maxBacklogAgeMs.load(memory_order_relaxed) * 1000000LL;
+
+        /* Nothing to wait for, an idle or keeping-up worker costs us nothing */
+        if (!tooDeep && !tooOld)
+            break;
+
+        long long now = GetTimestamp();
+        if (!deadline) {
+            stallStart = now;
+            deadline = now + maxStallUs * 1000LL;
+        } else if (now >= deadline) {
+            ALOGV("%s: Backlog of %u still pending after %ius", __FUNCTION__, Backlog(), maxStallUs);
+            break;
+        }
+
+        /* Sleep until the worker picks up the next message or the stall budget runs out */
+        struct timespec timeout;
+        timeout.tv_sec = (deadline - now) / 1000000000LL;
+        timeout.tv_nsec = (deadline - now) % 1000000000LL;
+
+        m_stalledProducers.fetch_add(1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        futex(&m_popSeq, FUTEX_WAIT_PRIVATE, key, &timeout);
+        m_stalledProducers.fetch_sub(1, memory_order_relaxed);
+    }
+
+    if (stallStart)
+        m_stats.OnStall(GetTimestamp() - stallStart);
+}
+
+int CallbackWorkerThread::PolicyIndex(int32_t msg_type) {
+    if (msg_type <= 0 || msg_type >= (1 << (CB_POLICY_TYPES - 1)))
+        return CB_POLICY_TYPES - 1;
+
+    /* Combined types such as PREVIEW_FRAME | PREVIEW_METADATA use the lowest bit */
+    return __builtin_ctz(msg_type);
+}
+
+const CbDeliveryPolicy* CallbackWorkerThread::GetDeliveryPolicy(int32_t msg_type) {
+    return &sDeliveryPolicies[PolicyIndex(msg_type)];
+}
+
+/*
+ * Claims a ring slot without a lock, so the vendor HAL thread never waits on the thread
+ * running the client callbacks. The worker sleeps on a futex and is only woken when it
+ * actually went to sleep.
+ */
+bool CallbackWorkerThread::PushMessage(int id, const WorkerMessage* data,
+        const CallbackData* callbacks, int policy, int budgetUs) {
+    long long deadline = 0;
+    ThreadMsg* slot;
+    uint32_t pos = m_head.load(memory_order_relaxed);
+
+    /* Bounded MPMC style slot claim, vendor callbacks may arrive from several threads */
+    while (1) {
+        slot = &m_ring[pos & m_ringMask];
+        uint32_t seq = slot->seq.load(memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+
+        if (diff == 0) {
+            if (m_head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* The ring is full */
+            if (policy != CB_OVERFLOW_YIELD || budgetUs <= 0)
+                return false;
+
+            if (!deadline)
+                deadline = GetTimestamp() + budgetUs * 1000LL;
+            else if (GetTimestamp() >= deadline)
+                return false;
+
+            sched_yield();
+            pos = m_head.load(memory_order_relaxed);
+        } else {
+            pos = m_head.load(memory_order_relaxed);
+        }
+    }
+
+    FillMessage(slot, id, data, callbacks);
 
-    ALOGV("%s: Clearing %zu messages", __FUNCTION__, m_queue.size());
+    /* Publish the slot to the worker */
+    slot->seq.store(pos + 1, memory_order_release);
 
-    /* Whilst the queue is not empty */
-    while (!m_queue.empty()) {
-        /* Pop the message from the queue and delete the allocated data */
-        ThreadMsg* msg = m_queue.front();
-        m_queue.pop();
-        delete msg;
+    WakeWorker(false);
+    return true;
+}
+
+void CallbackWorkerThread::FillMessage(ThreadMsg* slot, int id, const WorkerMessage* data,
+        const CallbackData* callbacks) {
+    slot->id = id;
+    slot->gen = m_clearGen.load(memory_order_acquire);
+    slot->CallerTS = GetTimestamp();
+    slot->postSeq = m_postSeq.fetch_add(1, memory_order_relaxed);
+    slot->latestSeq = 0;
+    if (data) {
+        slot->msg = *data;
+
+        /* Stamp latest-wins messages so the worker can tell when they were superseded */
+        if (GetDeliveryPolicy(data->msg_type)->flags & CB_POLICY_LATEST_WINS)
+            slot->latestSeq = m_latestSeq[PolicyIndex(data->msg_type)]
+                    .fetch_add(1, memory_order_relaxed) + 1;
     }
+    if (callbacks)
+        slot->callbacks = *callbacks;
+}
+
+/* Takes what a full ring can not, from a preallocated pool so the heap is never touched */
+void CallbackWorkerThread::SpillMessage(int id, const WorkerMessage* data,
+        const CallbackData* callbacks) {
+    bool exhausted = false;
+    ThreadMsg* node = m_spillPool.Get(&exhausted);
 
-    m_cv.notify_one();
+    m_stats.OnSpill(exhausted);
+    FillMessage(node, id, data, callbacks);
+
+    /* Push onto the spill stack, the worker restores the post order */
+    m_spillPending.fetch_add(1, memory_order_relaxed);
+    ThreadMsg* head = m_spillStack.load(memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!m_spillStack.compare_exchange_weak(head, node, memory_order_release));
+
+    WakeWorker(false);
+}
+
+/* Preview frames bypass the ring, so a slow client never fills it with frames it will not see */
+void CallbackWorkerThread::PostPreviewFrame(const WorkerMessage* data) {
+    ThreadMsg* node = m_previewPool.Get();
+
+    FillMessage(node, MSG_EXECUTE_CALLBACK, data, NULL);
+
+    /* Swap it into the slot, an older frame the worker has not taken yet is dropped */
+    ThreadMsg* old = m_previewMailbox.exchange(node, memory_order_acq_rel);
+    if (old) {
+        m_stats.OnDrop(PolicyIndex(old->msg.msg_type), CB_STATS_DROP_SUPERSEDED);
+        Retire(&old->msg);
+        m_previewPool.Put(old);
+    } else {
+        m_previewPending.fetch_add(1, memory_order_relaxed);
+    }
+
+    WakeWorker(false);
+}
+
+void CallbackWorkerThread::SetPreviewCoalescing(bool enable) {
+    m_previewCoalescing.store(enable, memory_order_relaxed);
+}
+
+bool CallbackWorkerThread::PopMessage(ThreadMsg* out) {
+    uint32_t tail = m_tail.load(memory_order_relaxed);
+    ThreadMsg* slot = &m_ring[tail & m_ringMask];
+    bool ringReady = slot->seq.load(memory_order_acquire) == tail + 1;
+
+    /* Move newly spilled messages to our FIFO, the stack holds them newest first */
+    if (m_spillStack.load(memory_order_relaxed)) {
+        ThreadMsg* list = m_spillStack.exchange(NULL, memory_order_acquire);
+        ThreadMsg* reversed = NULL;
+        ThreadMsg* last = list;
+
+        while (list) {
+            ThreadMsg* next = list->next;
+            list->next = reversed;
+            reversed = list;
+            list = next;
+        }
+
+        if (m_spillTail)
+            m_spillTail->next = reversed;
+        else
+            m_spillHead = reversed;
+        m_spillTail = last;
+    }
+
+    /* Take the newest coalesced preview frame, it replaces one we are still holding */
+    if (m_previewMailbox.load(memory_order_relaxed)) {
+        ThreadMsg* node = m_previewMailbox.exchange(NULL, memory_order_acquire);
+
+        if (node && m_previewHeld) {
+            m_stats.OnDrop(PolicyIndex(m_previewHeld->msg.msg_type), CB_STATS_DROP_SUPERSEDED);
+            Retire(&m_previewHeld->msg);
+            m_previewPool.Put(m_previewHeld);
+            m_previewPending.fetch_sub(1, memory_order_relaxed);
+        }
+        if (node)
+            m_previewHeld = node;
+    }
+
+    /* Deliver whichever of the ring, the spill list and the preview slot holds the oldest message */
+    ThreadMsg* candidate = ringReady ? slot : NULL;
+    if (m_spillHead && (!candidate || m_spillHead->postSeq < candidate->postSeq))
+        candidate = m_spillHead;
+    if (m_previewHeld && (!candidate || m_previewHeld->postSeq < candidate->postSeq))
+        candidate = m_previewHeld;
+
+    if (!candidate)
+        return false;
+
+    copy_message(out, candidate);
+
+    if (candidate == m_previewHeld) {
+        m_previewHeld = NULL;
+        m_previewPool.Put(candidate);
+        m_previewPending.fetch_sub(1, memory_order_relaxed);
+    } else if (candidate == m_spillHead) {
+        m_spillHead = candidate->next;
+        if (!m_spillHead)
+            m_spillTail = NULL;
+
+        m_spillPool.Put(candidate);
+        m_spillPending.fetch_sub(1, memory_order_relaxed);
+    } else {
+        /* Hand the slot back to the producers for the next lap */
+        slot->seq.store(tail + m_ringSize, memory_order_release);
+        m_tail.store(tail + 1, memory_order_relaxed);
+    }
+
+    /* Let stalled producers re-evaluate the backlog */
+    m_popSeq.fetch_add(1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (m_stalledProducers.load(memory_order_relaxed))
+        futex(&m_popSeq, FUTEX_WAKE_PRIVATE, INT32_MAX);
+
+    return true;
+}
+
+bool CallbackWorkerThread::RingEmpty() {
+    uint32_t tail = m_tail.load(memory_order_relaxed);
+
+    if (m_spillHead || m_spillStack.load(memory_order_acquire))
+        return false;
+
+    if (m_previewHeld || m_previewMailbox.load(memory_order_acquire))
+        return false;
+
+    return m_ring[tail & m_ringMask].seq.load(memory_order_acquire) != tail + 1;
+}
+
+void CallbackWorkerThread::DrainSpill() {
+    ThreadMsg msg;
+
+    /* Hand every spilled message and preview frame back to their pools */
+    while (!RingEmpty()) {
+        PopMessage(&msg);
+        if (msg.id == MSG_EXECUTE_CALLBACK)
+            Retire(&msg.msg);
+    }
+}
+
+/* Every callback message is retired exactly once, delivered or dropped, to give back its lease */
+void CallbackWorkerThread::Retire(const WorkerMessage* data) {
+    if (m_leases)
+        m_leases->Release(data);
+}
+
+void CallbackWorkerThread::WakeWorker(bool force) {
+    /* Only pay for the syscall when the worker is actually asleep */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!force && !m_sleeping.load(memory_order_relaxed))
+        return;
+
+    m_wakeSeq.fetch_add(1, memory_order_release);
+    futex(&m_wakeSeq, FUTEX_WAKE_PRIVATE, 1);
+}
+
+void CallbackWorkerThread::WaitForWork() {
+    int32_t key = m_wakeSeq.load(memory_order_acquire);
+
+    m_sleeping.store(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    /* Recheck after announcing that we sleep so a concurrent push is not missed */
+    if (RingEmpty() && !m_exit.load(memory_order_relaxed))
+        futex(&m_wakeSeq, FUTEX_WAIT_PRIVATE, key);
+
+    m_sleeping.store(0, memory_order_relaxed);
 }
 
 void CallbackWorkerThread::Process() {
     camera_notify_callback UserNotifyCb = NULL;
     camera_data_callback UserDataCb = NULL;
+    ThreadMsg msgData;
+    ThreadMsg* msg = &msgData;
 
     while (1) {
-        ThreadMsg* msg = 0;
-        {
-            /* Wait for a message to be added to the queue */
-            std::unique_lock<std::mutex> lk(m_mutex);
-            while (m_queue.empty())
-                m_cv.wait(lk);
-
-            if (m_queue.empty())
-                continue;
-
-            msg = m_queue.front();
-            m_queue.pop();
+        /* Exit as soon as we are asked to, pending messages are dropped */
+        if (m_exit.load(memory_order_acquire)) {
+            DrainSpill();
+            ALOGV("%s: Exit Thread", __FUNCTION__);
+            return;
+        }
+
+        /* Wait for a message to be added to the ring */
+        if (!PopMessage(msg)) {
+            m_busySinceTs.store(0, memory_order_relaxed);
+            WaitForWork();
+            continue;
         }
 
+        /* Mark how long the current message keeps the worker busy */
+        long long dispatchTs = GetTimestamp();
+        m_busySinceTs.store(dispatchTs, memory_order_relaxed);
+        m_stats.OnQueueDepth(Backlog());
+
         switch (msg->id) {
             case MSG_EXECUTE_CALLBACK:
             {
-                /* Assert that we have a valid message */
-                ALOG_ASSERT(msg->msg != NULL);
-
-                /* Cast the the ThreadMsg void* data back to a WorkerMessage* */
-                const WorkerMessage* userData = static_cast<const WorkerMessage*>(msg->msg);
-
-                /* If the callback is not stale (newer than 5mS) */
-                if(GetTimestamp() - msg->CallerTS < 5) {
-                    /* If the callback type is set to notifycb */
-                    if(userData->CbType == CB_TYPE_NOTIFY) {
-                        /* Execute the users notify callback if it is valid */
-                        if(UserNotifyCb != NULL) {
-                            ALOGV("%s: UserNotifyCb: %i %i %i %p", __FUNCTION__, userData->msg_type, userData->ext1, userData->ext2, userData->user);
-                            UserNotifyCb(userData->msg_type, userData->ext1, userData->ext2, userData->user);
-                        }
-                    } /* If the callback type is set to notifycb */
-                    else if(userData->CbType == CB_TYPE_DATA) {
-                        /* Execute the users data callback if it is valid */
-                        if(UserDataCb != NULL) {
-                            ALOGV("%s: UserDataCb: %i %p %i %p %p", __FUNCTION__, userData->msg_type, userData->data, userData->index, userData->metadata, userData->user);
-                            UserDataCb(userData->msg_type, userData->data, userData->index, userData->metadata, userData->user);
-                        }
+                const WorkerMessage* userData = &msg->msg;
+                const CbDeliveryPolicy* policy = GetDeliveryPolicy(userData->msg_type);
+                int type = PolicyIndex(userData->msg_type);
+                long long age = dispatchTs - msg->CallerTS;
+
+                /* Skip callbacks that were queued before the last ClearCallbacks, whatever their type */
+                if (msg->gen != m_clearGen.load(memory_order_acquire)) {
+                    ALOGV("%s: Cleared msg_type %i", __FUNCTION__, userData->msg_type);
+                    m_stats.OnDrop(type, CB_STATS_DROP_CLEARED);
+                    break;
+                }
+
+                /* Skip frames that a newer frame of the same type has already replaced */
+                if ((policy->flags & CB_POLICY_LATEST_WINS) &&
+                        msg->latestSeq != m_latestSeq[type].load(memory_order_relaxed)) {
+                    ALOGV("%s: Superseded msg_type %i", __FUNCTION__, userData->msg_type);
+                    m_stats.OnDrop(type, CB_STATS_DROP_SUPERSEDED);
+                    break;
+                }
+
+                /* Skip callbacks that are older than their staleness budget */
+                if (policy->staleNs && age > policy->staleNs) {
+                    ALOGV("%s: %s Stale: msg_type %i %lliuS old", __FUNCTION__,
+                            userData->CbType == CB_TYPE_NOTIFY ? "UserNotifyCb" : "UserDataCb",
+                            userData->msg_type, age / 1000);
+                    m_stats.OnDrop(type, CB_STATS_DROP_STALE);
+                    break;
+                }
+
+                /* Skip frames the vendor has started to overwrite while they were queued */
+                if (m_leases && !m_leases->Begin(&msg->msg)) {
+                    ALOGV("%s: Recycled msg_type %i index %u", __FUNCTION__, userData->msg_type,
+                            userData->index);
+                    m_stats.OnDrop(type, CB_STATS_DROP_RECYCLED);
+                    break;
+                }
+
+                /* If the callback type is set to notifycb */
+                if(userData->CbType == CB_TYPE_NOTIFY) {
+                    /* Execute the users notify callback if it is valid */
+                    if(UserNotifyCb != NULL) {
+                        ALOGV("%s: UserNotifyCb: %i %i %i %p", __FUNCTION__, userData->msg_type, userData->ext1, userData->ext2, userData->user);
+                        WatchdogScope watch(m_watchdog, WD_CLIENT_CALLBACK, "notify", userData->msg_type);
+                        UserNotifyCb(userData->msg_type, userData->ext1, userData->ext2, userData->user);
                     }
-                } else {
-                    /* If the callback type is set to notifycb */
-                    if(userData->CbType == CB_TYPE_NOTIFY) {
-                            ALOGV("%s: UserNotifyCb Stale: %llimS old", __FUNCTION__, GetTimestamp() - msg->CallerTS);
-                    } /* If the callback type is set to notifycb */
-                    else if(userData->CbType == CB_TYPE_DATA) {
-                            ALOGV("%s: UserDataCb Stale: %llimS old", __FUNCTION__, GetTimestamp() - msg->CallerTS);
+                } /* If the callback type is set to notifycb */
+                else if(userData->CbType == CB_TYPE_DATA) {
+                    /* Execute the users data callback if it is valid */
+                    if(UserDataCb != NULL) {
+                        ALOGV("%s: UserDataCb: %i %p %i %p %p", __FUNCTION__, userData->msg_type, userData->data, userData->index, userData->metadata, userData->user);
+                        WatchdogScope watch(m_watchdog, WD_CLIENT_CALLBACK, "data", userData->msg_type);
+                        UserDataCb(userData->msg_type, userData->data, userData->index, userData->metadata, userData->user);
                     }
                 }
 
-                /* Cleanup allocated data */
-                delete userData;
-                delete msg;
+                m_stats.OnDispatch(type, age, GetTimestamp() - dispatchTs);
                 break;
             }
 
             case MSG_UPDATE_CALLBACKS:
             {
-                /* Assert that we have a valid message */
-                ALOG_ASSERT(msg->msg != NULL);
-
-                /* Cast the the ThreadMsg void* data back to a CallbackData* */
-                const CallbackData* callbackData = static_cast<const CallbackData*>(msg->msg);
-
                 ALOGV("%s: UpdateCallbacks", __FUNCTION__);
 
                 /* Copy the new callback pointers */
-                UserNotifyCb = callbackData->NewUserNotifyCb;
-                UserDataCb = callbackData->NewUserDataCb;
-
-                /* Cleanup allocated data */
-                delete callbackData;
-                delete msg;
+                UserNotifyCb = msg->callbacks.NewUserNotifyCb;
+                UserDataCb = msg->callbacks.NewUserDataCb;
                 break;
             }
 
-            case MSG_EXIT_THREAD:
-            {
-                /* Delete current message */
-                delete msg;
-                /* Then delete all pending messages in the queue */
-                std::unique_lock<std::mutex> lk(m_mutex);
-                /* Whilst the queue is not empty */
-                while (!m_queue.empty()) {
-                    /* Pop the message from the queue and delete the allocated data */
-                    msg = m_queue.front();
-                    m_queue.pop();
-                    delete msg;
-                }
-
-                ALOGV("%s: Exit Thread", __FUNCTION__);
-                return;
-            }
-
             default:
                 /* Error if we get here */
 	            ALOG_ASSERT(0);
         }
+
+        /* Delivered or dropped, the callback is done with its buffer */
+        if (msg->id == MSG_EXECUTE_CALLBACK)
+            Retire(&msg->msg);
     }
 }
 
-
-/* based on current_timestamp() function from stack overflow:
- * https://stackoverflow.com/questions/3756323/how-to-get-the-current-time-in-milliseconds-from-c-in-linux/17083824
- */
-
 long long CallbackWorkerThread::GetTimestamp() {
-    struct timeval te;
-    gettimeofday(&te, NULL); // get current time
-    long long milliseconds = te.tv_sec*1000LL + te.tv_usec/1000; // calculate milliseconds
-    return milliseconds;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
-
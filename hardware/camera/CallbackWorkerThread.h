@@ -18,20 +18,35 @@
 #define _THREAD_STD_H
 
 #include <thread>
-#include <queue>
-#include <mutex>
 #include <atomic>
-#include <condition_variable>
 
-#include <sys/time.h>
+#include <time.h>
 
 #include <hardware/camera.h>
 #include <hardware/camera2.h>
 
+#include "BufferLeases.h"
+#include "CallbackStats.h"
+#include "CallWatchdog.h"
+#include "ObjectPool.h"
+
 #define CB_TYPE_NONE    0
 #define CB_TYPE_NOTIFY  1
 #define CB_TYPE_DATA    2
 
+/* One delivery policy per CAMERA_MSG_* bit plus one for unknown vendor types */
+#define CB_POLICY_TYPES CB_STATS_TYPES
+
+/* Default number of preallocated worker ring slots, rounded up to a power of two */
+#define CB_RING_SIZE    64
+
+/* Default number of preallocated spill messages for callbacks that must not be dropped */
+#define CB_SPILL_SIZE   16
+
+/* What AddCallback does when the worker ring is full */
+#define CB_OVERFLOW_DROP_NEWEST 0   /* Drop the new callback and return at once */
+#define CB_OVERFLOW_YIELD       1   /* Yield for up to the overflow budget, then drop */
+
 struct WorkerMessage {
     /* Worker callback type */
     int32_t CbType;
@@ -44,6 +59,21 @@ struct WorkerMessage {
     void *user;
     int32_t ext1;
     int32_t ext2;
+
+    /* Set by BufferLeases::Acquire, the leased vendor buffer or that data points at a copy */
+    uint32_t lease;
+    uint32_t leaseGen;
+    bool copied;
+};
+
+/* Delivery policy flags, see CallbackWorkerThread.cpp for the per msg_type table */
+#define CB_POLICY_GUARANTEED    (1 << 0)    /* Never stale, spills over instead of dropping on a full ring */
+#define CB_POLICY_LATEST_WINS   (1 << 1)    /* Dropped once a newer message of the same type is queued */
+
+struct CbDeliveryPolicy {
+    /* Age after which the callback is dropped, 0 means never */
+    long long staleNs;
+    int flags;
 };
 
 struct CallbackData {
@@ -58,14 +88,17 @@ public:
     CallbackWorkerThread();
     ~CallbackWorkerThread();
 
-    /* Creates our worker, returns true on success */
-    bool CreateThread();
+    /* Creates our worker and preallocates its messages, returns true on success */
+    bool CreateThread(uint32_t ringSize = CB_RING_SIZE, uint32_t spillSize = CB_SPILL_SIZE);
 
     /* Exits the worker thread */
     void ExitThread();
 
-    /* Sends a new callback to our worker thread */
-    void AddCallback(const WorkerMessage* data);
+    /* Sends a new callback to our worker thread, returns false if it was dropped */
+    bool AddCallback(const WorkerMessage* data);
+
+    /* Counts a callback the caller dropped before it was sent */
+    void DropCallback(const WorkerMessage* data, int reason);
 
     /* Sets the callback function pointers for our worker to call */
     void SetCallbacks(const CallbackData* data);
@@ -73,20 +106,109 @@ public:
     /* Clears the worker message queue */
     void ClearCallbacks(void);
 
+    /* Sets what AddCallback does when the ring is full (CB_OVERFLOW_*) */
+    void SetOverflowPolicy(int policy, int budgetUs);
+
+    /* Sets the backlog depth and age beyond which WaitForBacklog stalls the producer */
+    void SetBackpressure(int maxDepth, int maxAgeMs);
+
+    /* Stalls the calling HAL thread for up to maxStallUs while the worker is backlogged */
+    void WaitForBacklog(int maxStallUs);
+
+    /* Sends preview frames through a latest-frame-wins slot instead of the ring */
+    void SetPreviewCoalescing(bool enable);
+
+    /* Watches the client callbacks, must be set before any callback is added */
+    void SetWatchdog(CallWatchdog* watchdog) { m_watchdog = watchdog; }
+
+    /* Releases the buffer leases of callbacks once delivered or dropped, set before any is added */
+    void SetBufferLeases(BufferLeases* leases) { m_leases = leases; }
+
+    /* Number of messages queued but not yet picked up by the worker */
+    uint32_t Backlog();
+
+    /* Latency and drop statistics of this worker */
+    CallbackStats& Stats() { return m_stats; }
+
 private:
     CallbackWorkerThread(const CallbackWorkerThread&);
     CallbackWorkerThread& operator=(const CallbackWorkerThread&);
 
+    /* Monotonic clock in nanoseconds */
     long long GetTimestamp();
 
+    /* Returns the delivery policy for a (possibly combined) msg_type */
+    static const CbDeliveryPolicy* GetDeliveryPolicy(int32_t msg_type);
+    static int PolicyIndex(int32_t msg_type);
+
+    /* Lock-free ring helpers, any thread may push but only the worker pops */
+    bool PushMessage(int id, const WorkerMessage* data, const CallbackData* callbacks,
+            int policy, int budgetUs);
+    void SpillMessage(int id, const WorkerMessage* data, const CallbackData* callbacks);
+    void PostPreviewFrame(const WorkerMessage* data);
+    void FillMessage(ThreadMsg* slot, int id, const WorkerMessage* data,
+            const CallbackData* callbacks);
+    bool PopMessage(ThreadMsg* out);
+    bool RingEmpty();
+    void DrainSpill();
+    void Retire(const WorkerMessage* data);
+
+    /* futex based wakeup of the worker thread */
+    void WakeWorker(bool force);
+    void WaitForWork();
+
     /* Entry point for the worker thread */
     void Process();
 
     std::thread* m_thread;
-    std::queue<ThreadMsg*> m_queue;
-    std::mutex m_mutex;
-    std::condition_variable m_cv;
     const char* m_name;
+
+    /* Preallocated ring of m_ringSize message slots */
+    ThreadMsg* m_ring;
+    uint32_t m_ringSize;
+    uint32_t m_ringMask;
+    std::atomic<uint32_t> m_head;
+    std::atomic<uint32_t> m_tail;
+
+    /* Messages that did not fit into the ring, pushed as a stack and drained in post order */
+    ObjectPool<ThreadMsg> m_spillPool;
+    std::atomic<ThreadMsg*> m_spillStack;
+    ThreadMsg* m_spillHead;
+    ThreadMsg* m_spillTail;
+    std::atomic<uint32_t> m_spillPending;
+    std::atomic<uint64_t> m_postSeq;
+
+    /* Latest preview frame posted by the vendor and the one the worker holds */
+    ObjectPool<ThreadMsg> m_previewPool;
+    std::atomic<ThreadMsg*> m_previewMailbox;
+    ThreadMsg* m_previewHeld;
+    std::atomic<uint32_t> m_previewPending;
+    std::atomic<bool> m_previewCoalescing;
+
+    /* Bumped by ClearCallbacks, queued callbacks from older generations are skipped */
+    std::atomic<uint32_t> m_clearGen;
+
+    std::atomic<int32_t> m_wakeSeq;
+    std::atomic<int32_t> m_sleeping;
+    std::atomic<bool> m_exit;
+
+    /* Backpressure state, m_busySinceTs is 0 while the worker is idle */
+    std::atomic<int> m_maxBacklogDepth;
+    std::atomic<int> m_maxBacklogAgeMs;
+    std::atomic<long long> m_busySinceTs;
+    std::atomic<int32_t> m_popSeq;
+    std::atomic<int32_t> m_stalledProducers;
+
+    std::atomic<int> m_overflowPolicy;
+    std::atomic<int> m_overflowBudgetUs;
+    std::atomic<uint32_t> m_overflowDrops;
+
+    /* Sequence of the newest queued message per msg_type bit, for CB_POLICY_LATEST_WINS */
+    std::atomic<uint32_t> m_latestSeq[CB_POLICY_TYPES];
+
+    CallbackStats m_stats;
+    CallWatchdog* m_watchdog;
+    BufferLeases* m_leases;
 };
 
 #endif
@@ -18,108 +18,412 @@
 #define LOG_PARAMETERS
 
 #define LOG_TAG "Camera2Wrapper"
-#include <android/fdsan.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
 
 #include <unistd.h>
+#include <pthread.h>
 #include <stdatomic.h>
 
 #include "CameraWrapper.h"
 #include "Camera2Wrapper.h"
+#include "BufferLeases.h"
 #include "CallbackWorkerThread.h"
+#include "CallWatchdog.h"
+#include "ParamFixups.h"
 
-CallbackWorkerThread cbThread;
+#include <time.h>
 
-#include <sys/time.h>
-
-/* current_timestamp() function from stack overflow:
- * https://stackoverflow.com/questions/3756323/how-to-get-the-current-time-in-milliseconds-from-c-in-linux/17083824
- */
-
-long long current_timestamp() {
-    struct timeval te;
-    gettimeofday(&te, NULL); // get current time
-    long long milliseconds = te.tv_sec*1000LL + te.tv_usec/1000; // calculate milliseconds
-    // printf("milliseconds: %lld\n", milliseconds);
-    return milliseconds;
+/* Monotonic time in mS, unaffected by wall clock changes */
+static long long current_timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
+/* Upper bound of simultaneously open HAL1 cameras tracked for the stats API */
+#define CAMERA2_MAX_DEVICES 8
+
+/* Auto focus requests whose report is outstanding, see the focus tracking below */
+#define FOCUS_MAX_REQUESTS      8
+
+/* Give up waiting for the vendor focus report after this long by default */
+#define FOCUS_TIMEOUT_MS        3000
+
+/* Report vendor calls and client callbacks running longer than this by default */
+#define WATCHDOG_BUDGET_MS      2000
+
+typedef struct camera2_focus_request {
+    uint32_t seq;
+    long long start;
+    bool cancelled;
+} camera2_focus_request_t;
+
+typedef struct camera2_focus {
+    pthread_mutex_t lock;
+    uint32_t next_seq;
+    long long timeout;
+
+    /* Outstanding auto focus requests, oldest first */
+    camera2_focus_request_t requests[FOCUS_MAX_REQUESTS];
+    uint32_t head;
+    uint32_t count;
+
+    /* Time to focus statistics */
+    uint64_t focused;
+    uint64_t failed;
+    uint64_t cancelled;
+    uint64_t stale;
+    uint64_t unreported;
+    uint64_t timed_out;
+    long long last_ms;
+    long long max_ms;
+    long long total_ms;
+} camera2_focus_t;
+
+/* Last parameter string run through a fixup and its fixed up result */
+typedef struct camera2_params_cache {
+    pthread_mutex_t lock;
+    uint64_t hash;
+    char *in;
+    char *out;
+    uint64_t hits;
+    uint64_t misses;
+} camera2_params_cache_t;
+
 typedef struct wrapper_camera2_device {
     camera_device_t base;
     int id;
     camera_device_t *vendor;
+
+    /* Callback dispatch pipeline of this camera */
+    CallbackWorkerThread *cbThread;
+    atomic_int BlockCbs;
+
+    /* Reports hung vendor calls and client callbacks */
+    CallWatchdog *Watchdog;
+
+    /* Keeps the vendor buffers of queued data callbacks from being shown while reused */
+    BufferLeases *Leases;
+
+    /* Matches focus reports to the auto focus requests in flight */
+    camera2_focus_t Focus;
+
+    /* Client callbacks that are forwarded without going through the worker */
+    camera_data_timestamp_callback UserDataTimestampCb;
+    camera_request_memory UserGetMemory;
+    void *user;
+
+    /* Fixed up parameters, keyed by the vendor resp. client string */
+    camera2_params_cache_t GetParamsCache;
+    camera2_params_cache_t SetParamsCache;
 } wrapper_camera2_device_t;
 
+/* Open cameras, protected by gCameraWrapperLock */
+static wrapper_camera2_device_t *gOpenDevices[CAMERA2_MAX_DEVICES];
+
 #define VENDOR_CALL(device, func, ...) ({ \
     wrapper_camera2_device_t *__wrapper_dev = (wrapper_camera2_device_t*) device; \
+    WatchdogScope __watch(__wrapper_dev->Watchdog, WD_VENDOR_CALL, #func); \
     __wrapper_dev->vendor->ops->func(__wrapper_dev->vendor, ##__VA_ARGS__); \
 })
 
 #define CAMERA_ID(device) (((wrapper_camera2_device_t *)(device))->id)
 
-static camera_module_t *gVendorModule = 0;
+/*******************************************************************
+ * Camera2 wrapper fixup functions
+ *
+ * The rule table and the single pass rewrite live in ParamFixups.cpp.
+ *******************************************************************/
 
-static int check_vendor_module()
+static char * camera2_fixup_getparams(int id, const char * settings)
 {
-    android_fdsan_set_error_level(ANDROID_FDSAN_ERROR_LEVEL_DISABLED);
-    int rv = 0;
-    ALOGV("%s", __FUNCTION__);
+    return camera2_apply_fixups(gParamFixups, gNumParamFixups, id, FIXUP_GET, settings);
+}
 
-    if(gVendorModule)
-        return 0;
+static bool camera2_setparams_need_fixup(int id)
+{
+    return camera2_need_fixup(gParamFixups, gNumParamFixups, id, FIXUP_SET);
+}
 
-    rv = hw_get_module_by_class("camera", "vendor", (const hw_module_t **)&gVendorModule);
-    if (rv)
-        ALOGE("failed to open vendor camera module");
-    return rv;
+static char * camera2_fixup_setparams(int id, const char * settings)
+{
+    return camera2_apply_fixups(gParamFixups, gNumParamFixups, id, FIXUP_SET, settings);
 }
 
 /*******************************************************************
- * Camera2 wrapper fixup functions
+ * Camera2 wrapper parameter cache
+ *
+ * Apps poll get_parameters and push set_parameters many times a second
+ * while zooming and focusing, mostly with an unchanged string. Remember
+ * the last string and its fixed up result so only a changed string pays
+ * for the unflatten/flatten round trip.
  *******************************************************************/
 
-static char * camera2_fixup_getparams(int id __unused, const char * settings)
+static void camera2_params_cache_init(camera2_params_cache_t *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+static void camera2_params_cache_release(camera2_params_cache_t *cache)
+{
+    free(cache->in);
+    free(cache->out);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/* 64 bit FNV-1a */
+static uint64_t camera2_params_hash(const char *settings)
 {
-    android::CameraParameters params;
-    params.unflatten(android::String8(settings));
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (const unsigned char *p = (const unsigned char *)settings; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
 
-#ifdef LOG_PARAMETERS
-    ALOGV("%s: Original parameters:", __FUNCTION__);
-    params.dump();
-#endif
+/* Returns a malloc'd fixed up copy of settings, or NULL if the fixup failed */
+static char * camera2_cached_fixup(camera2_params_cache_t *cache, int id, const char *settings,
+        char * (*fixup)(int, const char *))
+{
+    uint64_t hash = camera2_params_hash(settings);
+    char *ret = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->out && cache->hash == hash && !strcmp(cache->in, settings)) {
+        cache->hits++;
+        ret = strdup(cache->out);
+        pthread_mutex_unlock(&cache->lock);
+        return ret;
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
 
-    params.set("video-size-values", "3840x2160,2560x1440,1920x1080,1440x1080,1088x1088,1280x720,960x720,800x450,720x480,640x480,480x320,352x288,320x240,256x144,176x144");
+    ret = fixup(id, settings);
+    if (!ret)
+        return NULL;
 
-#ifdef LOG_PARAMETERS
-    ALOGV("%s: Fixed parameters:", __FUNCTION__);
-    params.dump();
-#endif
+    char *in = strdup(settings);
+    char *out = strdup(ret);
+    if (!in || !out) {
+        free(in);
+        free(out);
+        return ret;
+    }
 
-    android::String8 strParams = params.flatten();
-    char *ret = strdup(strParams.string());
+    pthread_mutex_lock(&cache->lock);
+    free(cache->in);
+    free(cache->out);
+    cache->hash = hash;
+    cache->in = in;
+    cache->out = out;
+    pthread_mutex_unlock(&cache->lock);
 
     return ret;
 }
 
-static char * camera2_fixup_setparams(int id __unused, const char * settings)
+static void camera2_params_cache_dump(camera2_params_cache_t *cache, int fd, const char *name)
 {
-    android::CameraParameters params;
-    params.unflatten(android::String8(settings));
+    pthread_mutex_lock(&cache->lock);
+    dprintf(fd, "  %s parameter cache: %llu hits, %llu misses\n", name,
+            (unsigned long long)cache->hits, (unsigned long long)cache->misses);
+    pthread_mutex_unlock(&cache->lock);
+}
 
-#ifdef LOG_PARAMETERS
-    ALOGV("%s: Original parameters:", __FUNCTION__);
-    params.dump();
-#endif
+/*******************************************************************
+ * Camera2 wrapper focus tracking
+ *
+ * The vendor HAL may still report CAMERA_MSG_FOCUS for an auto focus that
+ * was cancelled, which the client no longer expects, or never report it at
+ * all. Reports are matched by state rather than by order. cancel_auto_focus
+ * marks every outstanding request cancelled and always reaches the vendor,
+ * a report while only cancelled requests are outstanding is dropped. A new
+ * auto_focus retires the cancelled requests at once, so the next report
+ * settles the newest live request and the older ones it superseded.
+ * Requests that are never reported expire after the focus timeout.
+ *******************************************************************/
 
-#ifdef LOG_PARAMETERS
-    ALOGV("%s: Fixed parameters:", __FUNCTION__);
-    params.dump();
-#endif
+static void camera2_focus_init(camera2_focus_t *focus)
+{
+    memset(focus, 0, sizeof(*focus));
+    pthread_mutex_init(&focus->lock, NULL);
+    focus->timeout = property_get_int32("persist.vendor.sys.camera.wrapper.focus_timeout_ms",
+            FOCUS_TIMEOUT_MS);
+}
 
-    android::String8 strParams = params.flatten();
-    char *ret = strdup(strParams.string());
+static void camera2_focus_release(camera2_focus_t *focus)
+{
+    pthread_mutex_destroy(&focus->lock);
+}
 
-    return ret;
+static camera2_focus_request_t *camera2_focus_at(camera2_focus_t *focus, uint32_t i)
+{
+    return &focus->requests[(focus->head + i) % FOCUS_MAX_REQUESTS];
+}
+
+/* Removes the i-th outstanding request, must be called with the lock held */
+static void camera2_focus_remove(camera2_focus_t *focus, uint32_t i)
+{
+    for (; i + 1 < focus->count; i++)
+        *camera2_focus_at(focus, i) = *camera2_focus_at(focus, i + 1);
+    focus->count--;
+}
+
+/* Drops requests the vendor did not report in time, must be called with the lock held */
+static void camera2_focus_expire(camera2_focus_t *focus, long long now)
+{
+    for (uint32_t i = 0; i < focus->count;) {
+        camera2_focus_request_t *request = camera2_focus_at(focus, i);
+
+        if (now - request->start < focus->timeout) {
+            i++;
+            continue;
+        }
+
+        if (request->cancelled) {
+            focus->unreported++;
+        } else {
+            ALOGE("%s: no report for auto focus %u after %lld mS", __FUNCTION__, request->seq,
+                    now - request->start);
+            focus->timed_out++;
+        }
+
+        camera2_focus_remove(focus, i);
+    }
+}
+
+/* Called before the vendor auto_focus, which may report focus synchronously */
+static uint32_t camera2_focus_start(camera2_focus_t *focus)
+{
+    long long now = current_timestamp();
+
+    pthread_mutex_lock(&focus->lock);
+    camera2_focus_expire(focus, now);
+
+    /* Whatever the vendor reports from now on is not for a cancelled request */
+    for (uint32_t i = 0; i < focus->count;) {
+        if (camera2_focus_at(focus, i)->cancelled) {
+            focus->unreported++;
+            camera2_focus_remove(focus, i);
+        } else {
+            i++;
+        }
+    }
+
+    if (focus->count == FOCUS_MAX_REQUESTS) {
+        focus->timed_out++;
+        camera2_focus_remove(focus, 0);
+    }
+
+    camera2_focus_request_t *request = camera2_focus_at(focus, focus->count++);
+    request->seq = ++focus->next_seq;
+    request->start = now;
+    request->cancelled = false;
+    uint32_t seq = request->seq;
+    pthread_mutex_unlock(&focus->lock);
+
+    return seq;
+}
+
+/* The vendor refused auto focus seq, no report will come for it */
+static void camera2_focus_abort(camera2_focus_t *focus, uint32_t seq)
+{
+    pthread_mutex_lock(&focus->lock);
+    for (uint32_t i = 0; i < focus->count; i++) {
+        if (camera2_focus_at(focus, i)->seq == seq) {
+            camera2_focus_remove(focus, i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&focus->lock);
+}
+
+/* Stopping the preview ends every auto focus without a report */
+static void camera2_focus_reset(camera2_focus_t *focus)
+{
+    pthread_mutex_lock(&focus->lock);
+    focus->count = 0;
+    pthread_mutex_unlock(&focus->lock);
+}
+
+/* Called for CAMERA_MSG_FOCUS, returns false if the report must not reach the client */
+static bool camera2_focus_report(camera2_focus_t *focus, int32_t success)
+{
+    long long now = current_timestamp();
+    bool deliver = true;
+
+    pthread_mutex_lock(&focus->lock);
+    camera2_focus_expire(focus, now);
+
+    /* No auto focus outstanding, e.g. a continuous focus mode reporting on its own */
+    if (!focus->count)
+        goto done;
+
+    {
+        /* Outstanding requests are either all live or all cancelled, see camera2_focus_start */
+        camera2_focus_request_t request = *camera2_focus_at(focus, 0);
+
+        if (request.cancelled) {
+            ALOGV("%s: dropping report of cancelled auto focus %u after %lld mS",
+                    __FUNCTION__, request.seq, now - request.start);
+            camera2_focus_remove(focus, 0);
+            focus->stale++;
+            deliver = false;
+            goto done;
+        }
+
+        /* The newest auto focus is settled, the older ones were superseded by it */
+        request = *camera2_focus_at(focus, focus->count - 1);
+        long long elapsed = now - request.start;
+        focus->count = 0;
+
+        if (success)
+            focus->focused++;
+        else
+            focus->failed++;
+        focus->last_ms = elapsed;
+        focus->total_ms += elapsed;
+        if (elapsed > focus->max_ms)
+            focus->max_ms = elapsed;
+    }
+
+done:
+    pthread_mutex_unlock(&focus->lock);
+    return deliver;
+}
+
+/* Called before the vendor cancel_auto_focus, reports of the requests in flight are stale */
+static void camera2_focus_cancel(camera2_focus_t *focus)
+{
+    pthread_mutex_lock(&focus->lock);
+    for (uint32_t i = 0; i < focus->count; i++) {
+        camera2_focus_request_t *request = camera2_focus_at(focus, i);
+
+        if (!request->cancelled) {
+            request->cancelled = true;
+            focus->cancelled++;
+        }
+    }
+    pthread_mutex_unlock(&focus->lock);
+}
+
+static void camera2_focus_dump(camera2_focus_t *focus, int fd)
+{
+    pthread_mutex_lock(&focus->lock);
+    uint64_t reports = focus->focused + focus->failed;
+    dprintf(fd, "  focus: %llu focused, %llu failed, time to focus avg %lld mS max %lld mS last %lld mS\n",
+            (unsigned long long)focus->focused, (unsigned long long)focus->failed,
+            reports ? focus->total_ms / (long long)reports : 0, focus->max_ms, focus->last_ms);
+    dprintf(fd, "  focus: %llu cancelled, %llu stale reports dropped, %llu cancels without report\n",
+            (unsigned long long)focus->cancelled, (unsigned long long)focus->stale,
+            (unsigned long long)focus->unreported);
+    dprintf(fd, "  focus: %llu never reported, %u outstanding\n",
+            (unsigned long long)focus->timed_out, focus->count);
+    pthread_mutex_unlock(&focus->lock);
 }
 
 /*******************************************************************
@@ -137,62 +441,95 @@ static int camera2_set_preview_window(struct camera_device * device,
     return VENDOR_CALL(device, set_preview_window, window);
 }
 
-atomic_int BlockCbs;
+/* The vendor gets our wrapper device as its callback cookie, the client cookie lives in it */
 
 void WrappedNotifyCb (int32_t msg_type, int32_t ext1, int32_t ext2, void *user) {
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) user;
     ALOGV("%s->In", __FUNCTION__);
 
+    /* Match every focus report to its auto focus, even the ones blocked below */
+    if (msg_type == CAMERA_MSG_FOCUS && !camera2_focus_report(&wrapper_dev->Focus, ext1))
+        return;
+
     /* Print a log message and return if we currently blocking adding callbacks */
-    if(BlockCbs == 1) {
+    if(wrapper_dev->BlockCbs == 1) {
         ALOGV("%s->BlockCbs == 1", __FUNCTION__);
         return;
     }
 
     /* Create message to send to the callback worker */
-    WorkerMessage* newWorkerMessage = new WorkerMessage();
-    newWorkerMessage->CbType = CB_TYPE_NOTIFY;
+    WorkerMessage newWorkerMessage = {};
+    newWorkerMessage.CbType = CB_TYPE_NOTIFY;
 
     /* Copy the callback data to our worker message */
-    newWorkerMessage->msg_type = msg_type;
-    newWorkerMessage->ext1 = ext1;
-    newWorkerMessage->ext2 = ext2;
-    newWorkerMessage->user = user;
+    newWorkerMessage.msg_type = msg_type;
+    newWorkerMessage.ext1 = ext1;
+    newWorkerMessage.ext2 = ext2;
+    newWorkerMessage.user = wrapper_dev->user;
 
-    /* Post the message to the callback worker */
-    cbThread.AddCallback(newWorkerMessage);
+    /* Post the message to the callback worker, it is copied into the worker ring */
+    wrapper_dev->cbThread->AddCallback(&newWorkerMessage);
 
-    /* 5mS delay to slow down the camera hal thread */
-    usleep(5000);
+    /* Slow down the camera hal thread by up to 5mS, only while the worker is backlogged */
+    wrapper_dev->cbThread->WaitForBacklog(5000);
     ALOGV("%s->Out", __FUNCTION__);
 }
 
 void WrappedDataCb (int32_t msg_type, const camera_memory_t *data, unsigned int index,
         camera_frame_metadata_t *metadata, void *user) {
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) user;
     ALOGV("%s->In, %i, %u", __FUNCTION__, msg_type, index);
 
     /* Print a log message and return if we currently blocking adding callbacks */
-    if(BlockCbs == 1) {
+    if(wrapper_dev->BlockCbs == 1) {
         ALOGV("%s->BlockCbs == 1", __FUNCTION__);
         return;
     }
 
     /* Create message to send to the callback worker */
-    WorkerMessage* newWorkerMessage = new WorkerMessage();
-    newWorkerMessage->CbType = CB_TYPE_DATA;
+    WorkerMessage newWorkerMessage = {};
+    newWorkerMessage.CbType = CB_TYPE_DATA;
 
     /* Copy the callback data to our worker message */
-    newWorkerMessage->msg_type = msg_type;
-    newWorkerMessage->data = data;
-    newWorkerMessage->index= index;
-    newWorkerMessage->metadata = metadata;
-    newWorkerMessage->user = user;
+    newWorkerMessage.msg_type = msg_type;
+    newWorkerMessage.data = data;
+    newWorkerMessage.index= index;
+    newWorkerMessage.metadata = metadata;
+    newWorkerMessage.user = wrapper_dev->user;
+
+    /*
+     * Lease the vendor buffer until the worker is done with it, or copy it now, then
+     * post the message to the callback worker. Frames that can be neither leased nor
+     * copied are dropped.
+     */
+    if (!wrapper_dev->Leases->Acquire(&newWorkerMessage))
+        wrapper_dev->cbThread->DropCallback(&newWorkerMessage, CB_STATS_DROP_RECYCLED);
+    else if (!wrapper_dev->cbThread->AddCallback(&newWorkerMessage))
+        wrapper_dev->Leases->Release(&newWorkerMessage);
+
+    /* Slow down the camera hal thread by up to 20mS, only while the worker is backlogged */
+    wrapper_dev->cbThread->WaitForBacklog(20000);
+    ALOGV("%s->Out", __FUNCTION__);
+}
 
-    /* Post the message to the callback worker */
-    cbThread.AddCallback(newWorkerMessage);
+void WrappedDataTimestampCb (int64_t timestamp, int32_t msg_type, const camera_memory_t *data,
+        unsigned int index, void *user) {
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) user;
 
-    /* 20mS delay to slow down the camera hal thread */
-    usleep(20000);
-    ALOGV("%s->Out", __FUNCTION__);
+    /* Recording frames are forwarded directly, as they were before */
+    WatchdogScope watch(wrapper_dev->Watchdog, WD_CLIENT_CALLBACK, "data_timestamp", msg_type);
+    wrapper_dev->UserDataTimestampCb(timestamp, msg_type, data, index, wrapper_dev->user);
+}
+
+camera_memory_t* WrappedGetMemory (int fd, size_t buf_size, unsigned int num_bufs, void *user) {
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) user;
+
+    camera_memory_t *mem = wrapper_dev->UserGetMemory(fd, buf_size, num_bufs, wrapper_dev->user);
+
+    /* The vendor hands out buffers of this heap in data callbacks, track their leases */
+    wrapper_dev->Leases->OnAllocated(mem, buf_size, num_bufs);
+
+    return mem;
 }
 
 static void camera2_set_callbacks(struct camera_device * device,
@@ -207,16 +544,26 @@ static void camera2_set_callbacks(struct camera_device * device,
     if(!device)
         return;
 
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) device;
+
     /* Create and populate a new callback data structure */
-    CallbackData* newCallbackData = new CallbackData();
-    newCallbackData->NewUserNotifyCb = notify_cb;
-    newCallbackData->NewUserDataCb = data_cb;
+    CallbackData newCallbackData;
+    newCallbackData.NewUserNotifyCb = notify_cb;
+    newCallbackData.NewUserDataCb = data_cb;
 
     /* Send it to our worker thread */
-    cbThread.SetCallbacks(newCallbackData);
-
-    /* Call the set_callbacks function substituting the notify callback with our wrapper */
-    VENDOR_CALL(device, set_callbacks, WrappedNotifyCb, WrappedDataCb, data_cb_timestamp, get_memory, user);
+    wrapper_dev->cbThread->SetCallbacks(&newCallbackData);
+
+    /* Remember the client callbacks and cookie that we forward directly */
+    wrapper_dev->UserDataTimestampCb = data_cb_timestamp;
+    wrapper_dev->UserGetMemory = get_memory;
+    wrapper_dev->user = user;
+    wrapper_dev->Leases->SetClient(get_memory, user);
+
+    /* Call the set_callbacks function substituting the callbacks with our wrappers */
+    VENDOR_CALL(device, set_callbacks, WrappedNotifyCb, WrappedDataCb,
+            data_cb_timestamp ? WrappedDataTimestampCb : NULL,
+            get_memory ? WrappedGetMemory : NULL, wrapper_dev);
 }
 
 static void camera2_enable_msg_type(struct camera_device * device, int32_t msg_type)
@@ -266,16 +613,21 @@ static void camera2_stop_preview(struct camera_device * device)
     if(!device)
         return;
 
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) device;
+
     /* Block queueing more callbacks */
-    BlockCbs = 1;
+    wrapper_dev->BlockCbs = 1;
 
     /* Clear the callback queue */
-    cbThread.ClearCallbacks();
+    wrapper_dev->cbThread->ClearCallbacks();
     /* Execute stop_preview */
     VENDOR_CALL(device, stop_preview);
 
+    /* Stopping the preview ends any auto focus without a report */
+    camera2_focus_reset(&wrapper_dev->Focus);
+
     /* Unblock queueing more callbacks */
-    BlockCbs = 0;
+    wrapper_dev->BlockCbs = 0;
 }
 
 static int camera2_preview_enabled(struct camera_device * device)
@@ -339,8 +691,6 @@ static void camera2_release_recording_frame(struct camera_device * device,
     VENDOR_CALL(device, release_recording_frame, opaque);
 }
 
-long long CancelAFTimeGuard = 0;
-
 static int camera2_auto_focus(struct camera_device * device)
 {
     int Ret;
@@ -349,14 +699,18 @@ static int camera2_auto_focus(struct camera_device * device)
     if(!device)
         return -EINVAL;
 
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) device;
+
     /* Clear the callback queue */
-    cbThread.ClearCallbacks();
+    wrapper_dev->cbThread->ClearCallbacks();
+
+    /* Track the auto focus until the vendor reports it */
+    uint32_t seq = camera2_focus_start(&wrapper_dev->Focus);
 
     /* Call the auto_focus function */
     Ret = VENDOR_CALL(device, auto_focus);
-
-    /* Set the cancel_auto_focus time guard to now plus 500mS */
-    CancelAFTimeGuard = current_timestamp() + 500;
+    if (Ret)
+        camera2_focus_abort(&wrapper_dev->Focus, seq);
 
     return Ret;
 }
@@ -369,25 +723,22 @@ static int camera2_cancel_auto_focus(struct camera_device * device)
     if(!device)
         return -EINVAL;
 
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) device;
+
+    /* The vendor may still report the auto focus in flight, the client must not see it */
+    camera2_focus_cancel(&wrapper_dev->Focus);
+
     /* Block queueing more callbacks */
-    BlockCbs = 1;
+    wrapper_dev->BlockCbs = 1;
 
     /* Clear the callback queue */
-    cbThread.ClearCallbacks();
+    wrapper_dev->cbThread->ClearCallbacks();
 
-    /* Calculate the difference between our guard time and now */
-    long long TimeDiff = CancelAFTimeGuard - current_timestamp();
-    /* Post a log message and return success (skipping the call) if the diff is greater than 0 */
-    if(TimeDiff > 0) {
-        ALOGV("%s: CancelAFTimeGuard for %lli mS\n", __FUNCTION__, TimeDiff * 1000);
-        return 0;
-    }
-
-    /* No active time guard so call the vendor function */
+    /* Call the cancel_auto_focus function */
     Ret = VENDOR_CALL(device, cancel_auto_focus);
 
     /* Unblock queueing more callbacks */
-    BlockCbs = 0;
+    wrapper_dev->BlockCbs = 0;
 
     return Ret;
 }
@@ -419,10 +770,16 @@ static int camera2_set_parameters(struct camera_device * device, const char *par
     if(!device)
         return -EINVAL;
 
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) device;
     char *tmp = NULL;
-    tmp = camera2_fixup_setparams(CAMERA_ID(device), params);
 
-    int ret = VENDOR_CALL(device, set_parameters, tmp);
+    if (params && camera2_setparams_need_fixup(CAMERA_ID(device)))
+        tmp = camera2_cached_fixup(&wrapper_dev->SetParamsCache, CAMERA_ID(device), params,
+                camera2_fixup_setparams);
+
+    int ret = VENDOR_CALL(device, set_parameters, tmp ? tmp : params);
+
+    free(tmp);
 
     return ret;
 }
@@ -434,9 +791,14 @@ static char* camera2_get_parameters(struct camera_device * device)
     if(!device)
         return NULL;
 
+    wrapper_camera2_device_t *wrapper_dev = (wrapper_camera2_device_t*) device;
     char* params = VENDOR_CALL(device, get_parameters);
 
-    char * tmp = camera2_fixup_getparams(CAMERA_ID(device), params);
+    if (!params)
+        return NULL;
+
+    char * tmp = camera2_cached_fixup(&wrapper_dev->GetParamsCache, CAMERA_ID(device), params,
+            camera2_fixup_getparams);
     VENDOR_CALL(device, put_parameters, params);
     params = tmp;
 
@@ -479,6 +841,19 @@ static int camera2_dump(struct camera_device * device, int fd)
     if(!device)
         return -EINVAL;
 
+    /* Write our callback pipeline statistics ahead of the vendor dump */
+    char name[32];
+    snprintf(name, sizeof(name), "Camera2Wrapper camera %d", CAMERA_ID(device));
+    dprintf(fd, "%s, vendor module loaded in %lld uS\n", name, camera_vendor_module_load_ns() / 1000);
+    camera_info_cache_dump(fd);
+    ((wrapper_camera2_device_t*)device)->cbThread->Stats().Dump(fd, name);
+    ((wrapper_camera2_device_t*)device)->Watchdog->Dump(fd);
+    ((wrapper_camera2_device_t*)device)->Leases->Dump(fd);
+    camera2_params_cache_dump(&((wrapper_camera2_device_t*)device)->GetParamsCache, fd, "get");
+    camera2_params_cache_dump(&((wrapper_camera2_device_t*)device)->SetParamsCache, fd, "set");
+    camera2_focus_dump(&((wrapper_camera2_device_t*)device)->Focus, fd);
+    camera_memory_dump(fd);
+
     return VENDOR_CALL(device, dump, fd);
 }
 
@@ -498,16 +873,68 @@ static int camera2_device_close(hw_device_t* device)
 
     wrapper_dev = (wrapper_camera2_device_t*) device;
 
-    wrapper_dev->vendor->common.close((hw_device_t*)wrapper_dev->vendor);
+    {
+        WatchdogScope watch(wrapper_dev->Watchdog, WD_VENDOR_CALL, "close");
+        wrapper_dev->vendor->common.close((hw_device_t*)wrapper_dev->vendor);
+    }
+
+    /* Exit our callback dispatch thread once the vendor can no longer post to it */
+    wrapper_dev->cbThread->ExitThread();
+    delete wrapper_dev->cbThread;
+    delete wrapper_dev->Watchdog;
+    delete wrapper_dev->Leases;
+
+    for (int i = 0; i < CAMERA2_MAX_DEVICES; i++) {
+        if (gOpenDevices[i] == wrapper_dev)
+            gOpenDevices[i] = NULL;
+    }
+
+    camera2_params_cache_release(&wrapper_dev->GetParamsCache);
+    camera2_params_cache_release(&wrapper_dev->SetParamsCache);
+    camera2_focus_release(&wrapper_dev->Focus);
+
     if (wrapper_dev->base.ops)
         free(wrapper_dev->base.ops);
     free(wrapper_dev);
 done:
+    return ret;
+}
 
-    /* Exit our callback dispatch thread */
-    cbThread.ExitThread();
+/*******************************************************************
+ * callback statistics C API
+ *******************************************************************/
 
-    return ret;
+static wrapper_camera2_device_t *find_open_device(int camera_id)
+{
+    for (int i = 0; i < CAMERA2_MAX_DEVICES; i++) {
+        if (gOpenDevices[i] && gOpenDevices[i]->id == camera_id)
+            return gOpenDevices[i];
+    }
+    return NULL;
+}
+
+int camera_wrapper_get_cb_stats(int camera_id, struct camera_wrapper_cb_stats *stats)
+{
+    android::Mutex::Autolock lock(gCameraWrapperLock);
+
+    if (!stats)
+        return -EINVAL;
+
+    wrapper_camera2_device_t *wrapper_dev = find_open_device(camera_id);
+    if (!wrapper_dev)
+        return -ENODEV;
+
+    wrapper_dev->cbThread->Stats().Snapshot(stats);
+    return 0;
+}
+
+void camera_wrapper_reset_cb_stats(int camera_id)
+{
+    android::Mutex::Autolock lock(gCameraWrapperLock);
+
+    wrapper_camera2_device_t *wrapper_dev = find_open_device(camera_id);
+    if (wrapper_dev)
+        wrapper_dev->cbThread->Stats().Reset();
 }
 
 /*******************************************************************
@@ -526,23 +953,21 @@ int camera2_device_open(const hw_module_t* module, const char* name,
     int rv = 0;
     int num_cameras = 0;
     int cameraid;
+    camera_module_t *vendor;
     wrapper_camera2_device_t* camera2_device = NULL;
     camera_device_ops_t* camera2_ops = NULL;
 
     android::Mutex::Autolock lock(gCameraWrapperLock);
 
-    /* Create our callback dispatch thread */
-    cbThread.CreateThread();
-    BlockCbs = 0;
-
     ALOGV("%s", __FUNCTION__);
 
     if (name != NULL) {
-        if (check_vendor_module())
+        vendor = camera_vendor_module();
+        if (!vendor)
             return -EINVAL;
 
         cameraid = atoi(name);
-        num_cameras = gVendorModule->get_number_of_cameras();
+        num_cameras = vendor->get_number_of_cameras();
 
         if (cameraid > num_cameras) {
             ALOGE("camera service provided cameraid out of bounds, "
@@ -560,8 +985,38 @@ int camera2_device_open(const hw_module_t* module, const char* name,
         }
         memset(camera2_device, 0, sizeof(*camera2_device));
         camera2_device->id = cameraid;
-
-        rv = gVendorModule->open_legacy((const hw_module_t*)gVendorModule, name, CAMERA_DEVICE_API_VERSION_1_0, (hw_device_t**)&(camera2_device->vendor));
+        camera2_params_cache_init(&camera2_device->GetParamsCache);
+        camera2_params_cache_init(&camera2_device->SetParamsCache);
+        camera2_focus_init(&camera2_device->Focus);
+
+        /* Watch vendor calls and client callbacks of this camera */
+        camera2_device->Watchdog = new CallWatchdog();
+        camera2_device->Watchdog->Start(cameraid,
+                property_get_int32("persist.vendor.sys.camera.wrapper.watchdog_ms", WATCHDOG_BUDGET_MS),
+                property_get_bool("persist.vendor.sys.camera.wrapper.watchdog_recover", false));
+
+        camera2_device->Leases = new BufferLeases();
+        camera2_device->Leases->SetCopyMode(
+                property_get_int32("persist.vendor.sys.camera.wrapper.cb_copy", BL_COPY_AUTO));
+
+        /* Create the callback dispatch thread of this camera */
+        camera2_device->cbThread = new CallbackWorkerThread();
+        camera2_device->cbThread->SetWatchdog(camera2_device->Watchdog);
+        camera2_device->cbThread->SetBufferLeases(camera2_device->Leases);
+        camera2_device->cbThread->CreateThread(
+                property_get_int32("persist.vendor.sys.camera.wrapper.cb_ring_size", CB_RING_SIZE),
+                property_get_int32("persist.vendor.sys.camera.wrapper.cb_spill_size", CB_SPILL_SIZE));
+        camera2_device->cbThread->SetOverflowPolicy(
+                property_get_int32("persist.vendor.sys.camera.wrapper.cb_overflow", CB_OVERFLOW_DROP_NEWEST),
+                property_get_int32("persist.vendor.sys.camera.wrapper.cb_overflow_us", 2000));
+        camera2_device->cbThread->SetBackpressure(
+                property_get_int32("persist.vendor.sys.camera.wrapper.backlog_depth", 2),
+                property_get_int32("persist.vendor.sys.camera.wrapper.backlog_age_ms", 10));
+        camera2_device->cbThread->SetPreviewCoalescing(
+                property_get_bool("persist.vendor.sys.camera.wrapper.preview_coalesce", true));
+        camera2_device->BlockCbs = 0;
+
+        rv = vendor->open_legacy((const hw_module_t*)vendor, name, CAMERA_DEVICE_API_VERSION_1_0, (hw_device_t**)&(camera2_device->vendor));
         if (rv)
         {
             ALOGE("vendor camera open fail");
@@ -608,6 +1063,13 @@ int camera2_device_open(const hw_module_t* module, const char* name,
         camera2_ops->release = camera2_release;
         camera2_ops->dump = camera2_dump;
 
+        for (int i = 0; i < CAMERA2_MAX_DEVICES; i++) {
+            if (!gOpenDevices[i]) {
+                gOpenDevices[i] = camera2_device;
+                break;
+            }
+        }
+
         *device = &camera2_device->base.common;
     }
 
@@ -615,6 +1077,15 @@ int camera2_device_open(const hw_module_t* module, const char* name,
 
 fail:
     if(camera2_device) {
+        if (camera2_device->cbThread) {
+            camera2_device->cbThread->ExitThread();
+            delete camera2_device->cbThread;
+        }
+        delete camera2_device->Watchdog;
+        delete camera2_device->Leases;
+        camera2_params_cache_release(&camera2_device->GetParamsCache);
+        camera2_params_cache_release(&camera2_device->SetParamsCache);
+        camera2_focus_release(&camera2_device->Focus);
         free(camera2_device);
         camera2_device = NULL;
     }
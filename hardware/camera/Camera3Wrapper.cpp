@@ -17,16 +17,53 @@
 #define LOG_NDEBUG 1
 
 #define LOG_TAG "Camera3Wrapper"
-#include <android/fdsan.h>
 #include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include <pthread.h>
 
 #include "CameraWrapper.h"
 #include "Camera3Wrapper.h"
+#include "CaptureTracer.h"
+#include "RequestTracker.h"
+#include "StreamConfigCache.h"
+#include "MetadataFilter.h"
+
+struct wrapper_camera3_device;
+
+/* Callback ops handed to the vendor, they lead back to the wrapper device */
+typedef struct wrapper_camera3_callback_ops {
+    camera3_callback_ops_t ops;
+    struct wrapper_camera3_device *dev;
+} wrapper_camera3_callback_ops_t;
 
 typedef struct wrapper_camera3_device {
     camera3_device_t base;
     int id;
     camera3_device_t *vendor;
+
+    /* Framework callbacks, and ours that interpose on them */
+    const camera3_callback_ops_t *user_ops;
+    wrapper_camera3_callback_ops_t ops;
+
+    /* In-flight requests and flushes */
+    RequestTracker *tracker;
+
+    /* Rewrites of request settings and result metadata */
+    MetadataFilterChain *request_filters;
+    MetadataFilterChain *result_filters;
+
+    /* Stream configurations seen and the one the vendor runs */
+    StreamConfigCache *stream_configs;
+
+    /* Per frame latency tracing, NULL unless enabled */
+    CaptureTracer *tracer;
+
+    /* Default request settings per template, kept until the device is closed */
+    pthread_mutex_t templates_lock;
+    camera_metadata_t *templates[CAMERA3_TEMPLATE_COUNT];
+    uint64_t template_hits;
+    long long template_construct_ns;
 } wrapper_camera3_device_t;
 
 #define VENDOR_CALL(device, func, ...) ({ \
@@ -36,21 +73,78 @@ typedef struct wrapper_camera3_device {
 
 #define CAMERA_ID(device) (((wrapper_camera3_device_t *)(device))->id)
 
-static camera_module_t *gVendorModule = 0;
+/*******************************************************************
+ * Camera3 wrapper metadata filters
+ *
+ * Vendor metadata quirks are worked around by rows in this table, see
+ * MetadataFilter.h for the actions. Results may be filtered on several
+ * vendor threads at once, each of them needs a buffer of its own.
+ *******************************************************************/
+
+#define RESULT_FILTER_BUFFERS   4
 
-static int check_vendor_module()
+static const metadata_filter_t sMetadataFilters[] = {
+    /* camera id, MF_REQUEST and/or MF_RESULT, action, tag, ... */
+    { MF_ALL_CAMERAS, 0, MF_END, 0, NULL, 0, 0, 0, NULL, 0, 0, NULL },
+};
+
+/*******************************************************************
+ * Camera3 wrapper callback interposition
+ *******************************************************************/
+
+static void camera3_wrapped_process_capture_result(const camera3_callback_ops_t *ops,
+        const camera3_capture_result_t *result)
 {
-    android_fdsan_set_error_level(ANDROID_FDSAN_ERROR_LEVEL_DISABLED);
-    int rv = 0;
-    ALOGV("%s", __FUNCTION__);
+    wrapper_camera3_device_t *wrapper_dev = ((const wrapper_camera3_callback_ops_t *)ops)->dev;
+    FrameEvent event;
 
-    if(gVendorModule)
-        return 0;
+    if (wrapper_dev->tracker->OnResult(result, &event) && wrapper_dev->tracer)
+        wrapper_dev->tracer->OnResult(result, event);
 
-    rv = hw_get_module_by_class("camera", "vendor", (const hw_module_t **)&gVendorModule);
-    if (rv)
-        ALOGE("failed to open vendor camera module");
-    return rv;
+    if (wrapper_dev->result_filters->Empty() || !result->result) {
+        wrapper_dev->user_ops->process_capture_result(wrapper_dev->user_ops, result);
+        return;
+    }
+
+    /* The framework copies the metadata before it returns, the buffer is free again after */
+    camera3_capture_result_t filtered = *result;
+    MetadataBuffer *buffer;
+
+    filtered.result = wrapper_dev->result_filters->Apply(result->result, &buffer);
+    wrapper_dev->user_ops->process_capture_result(wrapper_dev->user_ops, &filtered);
+    wrapper_dev->result_filters->Release(buffer);
+}
+
+static void camera3_wrapped_notify(const camera3_callback_ops_t *ops,
+        const camera3_notify_msg_t *msg)
+{
+    wrapper_camera3_device_t *wrapper_dev = ((const wrapper_camera3_callback_ops_t *)ops)->dev;
+    FrameEvent event;
+
+    if (wrapper_dev->tracker->OnNotify(msg, &event) && wrapper_dev->tracer) {
+        if (msg->type == CAMERA3_MSG_SHUTTER)
+            wrapper_dev->tracer->OnShutter(event);
+        else
+            wrapper_dev->tracer->OnRetire(event);
+    }
+
+    wrapper_dev->user_ops->notify(wrapper_dev->user_ops, msg);
+}
+
+/* Reads the number of metadata partials the vendor sends per frame */
+static uint32_t camera3_partial_result_count(int id)
+{
+    struct camera_info info;
+    camera_metadata_ro_entry_t entry;
+
+    if (camera_cached_camera_info(id, &info) || !info.static_camera_characteristics)
+        return 1;
+
+    if (find_camera_metadata_ro_entry(info.static_camera_characteristics,
+            ANDROID_REQUEST_PARTIAL_RESULT_COUNT, &entry) || !entry.count)
+        return 1;
+
+    return entry.data.i32[0];
 }
 
 /*******************************************************************
@@ -65,7 +159,15 @@ static int camera3_initialize(const camera3_device_t *device, const camera3_call
     if (!device)
         return -1;
 
-    return VENDOR_CALL(device, initialize, callback_ops);
+    wrapper_camera3_device_t *wrapper_dev = (wrapper_camera3_device_t*) device;
+
+    wrapper_dev->user_ops = callback_ops;
+    memset(&wrapper_dev->ops, 0, sizeof(wrapper_dev->ops));
+    wrapper_dev->ops.ops.process_capture_result = camera3_wrapped_process_capture_result;
+    wrapper_dev->ops.ops.notify = camera3_wrapped_notify;
+    wrapper_dev->ops.dev = wrapper_dev;
+
+    return VENDOR_CALL(device, initialize, &wrapper_dev->ops.ops);
 }
 
 static int camera3_configure_streams(const camera3_device *device, camera3_stream_configuration_t *stream_list)
@@ -76,7 +178,25 @@ static int camera3_configure_streams(const camera3_device *device, camera3_strea
     if (!device)
         return -1;
 
-    return VENDOR_CALL(device, configure_streams, stream_list);
+    wrapper_camera3_device_t *wrapper_dev = (wrapper_camera3_device_t*) device;
+
+    if (!stream_list)
+        return VENDOR_CALL(device, configure_streams, stream_list);
+
+    if (wrapper_dev->tracer)
+        wrapper_dev->tracer->OnConfigure(stream_list);
+
+    /* Switching back to the configuration the vendor already runs needs no teardown */
+    uint64_t fingerprint = StreamConfigCache::Fingerprint(stream_list);
+    if (wrapper_dev->stream_configs->TryReuse(stream_list, fingerprint))
+        return 0;
+
+    long long start = RequestTracker::GetTimestamp();
+    int ret = VENDOR_CALL(device, configure_streams, stream_list);
+    wrapper_dev->stream_configs->OnConfigured(stream_list, fingerprint, ret,
+            RequestTracker::GetTimestamp() - start);
+
+    return ret;
 }
 
 __unused static int camera3_register_stream_buffers(const camera3_device *device, const camera3_stream_buffer_set_t *buffer_set)
@@ -98,7 +218,37 @@ static const camera_metadata_t *camera3_construct_default_request_settings(const
     if (!device)
         return NULL;
 
-    return VENDOR_CALL(device, construct_default_request_settings, type);
+    /* Vendor templates are not cached */
+    if (type <= 0 || type >= CAMERA3_TEMPLATE_COUNT)
+        return VENDOR_CALL(device, construct_default_request_settings, type);
+
+    wrapper_camera3_device_t *wrapper_dev = (wrapper_camera3_device_t*) device;
+    const camera_metadata_t *settings;
+
+    pthread_mutex_lock(&wrapper_dev->templates_lock);
+
+    if (wrapper_dev->templates[type]) {
+        wrapper_dev->template_hits++;
+        settings = wrapper_dev->templates[type];
+        goto done;
+    }
+
+    {
+        long long start = RequestTracker::GetTimestamp();
+        settings = VENDOR_CALL(device, construct_default_request_settings, type);
+        wrapper_dev->template_construct_ns += RequestTracker::GetTimestamp() - start;
+    }
+
+    /* Keep our own copy, the vendor may reuse its buffer for the next template */
+    if (settings) {
+        wrapper_dev->templates[type] = clone_camera_metadata(settings);
+        if (wrapper_dev->templates[type])
+            settings = wrapper_dev->templates[type];
+    }
+
+done:
+    pthread_mutex_unlock(&wrapper_dev->templates_lock);
+    return settings;
 }
 
 static int camera3_process_capture_request(const camera3_device_t *device, camera3_capture_request_t *request)
@@ -109,7 +259,30 @@ static int camera3_process_capture_request(const camera3_device_t *device, camer
     if (!device)
         return -1;
 
-    return VENDOR_CALL(device, process_capture_request, request);
+    wrapper_camera3_device_t *wrapper_dev = (wrapper_camera3_device_t*) device;
+
+    /* Results may come back before the vendor call returns, track the request first */
+    if (request)
+        wrapper_dev->tracker->OnRequest(request);
+
+    /* The vendor copies the settings it needs before returning */
+    const camera_metadata_t *settings = request ? request->settings : NULL;
+    MetadataBuffer *buffer = NULL;
+
+    if (settings && !wrapper_dev->request_filters->Empty())
+        request->settings = wrapper_dev->request_filters->Apply(settings, &buffer);
+
+    int ret = VENDOR_CALL(device, process_capture_request, request);
+
+    if (buffer) {
+        request->settings = settings;
+        wrapper_dev->request_filters->Release(buffer);
+    }
+
+    if (ret && request)
+        wrapper_dev->tracker->OnRequestFailed(request->frame_number);
+
+    return ret;
 }
 
 static void camera3_get_metadata_vendor_tag_ops(const camera3_device *device, vendor_tag_query_ops_t* ops)
@@ -131,6 +304,26 @@ static void camera3_dump(const camera3_device_t *device, int fd)
     if (!device)
         return;
 
+    wrapper_camera3_device_t *wrapper_dev = (wrapper_camera3_device_t*) device;
+
+    /* Write our request tracking and capture trace ahead of the vendor dump */
+    dprintf(fd, "Camera3Wrapper camera %d, vendor module loaded in %lld uS\n", CAMERA_ID(device),
+            camera_vendor_module_load_ns() / 1000);
+    camera_info_cache_dump(fd);
+    wrapper_dev->tracker->Dump(fd);
+    if (wrapper_dev->tracer)
+        wrapper_dev->tracer->Dump(fd);
+    wrapper_dev->stream_configs->Dump(fd);
+    wrapper_dev->request_filters->Dump(fd, "request");
+    wrapper_dev->result_filters->Dump(fd, "result");
+
+    pthread_mutex_lock(&wrapper_dev->templates_lock);
+    dprintf(fd, "  default request settings: %llu served from cache, %lld uS in the vendor\n",
+            (unsigned long long)wrapper_dev->template_hits,
+            wrapper_dev->template_construct_ns / 1000);
+    pthread_mutex_unlock(&wrapper_dev->templates_lock);
+    camera_memory_dump(fd);
+
     VENDOR_CALL(device, dump, fd);
 }
 
@@ -142,7 +335,13 @@ static int camera3_flush(const camera3_device_t* device)
     if (!device)
         return -1;
 
-    return VENDOR_CALL(device, flush);
+    wrapper_camera3_device_t *wrapper_dev = (wrapper_camera3_device_t*) device;
+
+    wrapper_dev->tracker->BeginFlush();
+    int ret = VENDOR_CALL(device, flush);
+    wrapper_dev->tracker->EndFlush();
+
+    return ret;
 }
 
 static int camera3_device_close(hw_device_t *device)
@@ -162,6 +361,15 @@ static int camera3_device_close(hw_device_t *device)
     wrapper_dev = (wrapper_camera3_device_t*) device;
 
     wrapper_dev->vendor->common.close((hw_device_t*)wrapper_dev->vendor);
+    delete wrapper_dev->tracer;
+    delete wrapper_dev->tracker;
+    delete wrapper_dev->stream_configs;
+    delete wrapper_dev->request_filters;
+    delete wrapper_dev->result_filters;
+    for (int i = 0; i < CAMERA3_TEMPLATE_COUNT; i++)
+        if (wrapper_dev->templates[i])
+            free_camera_metadata(wrapper_dev->templates[i]);
+    pthread_mutex_destroy(&wrapper_dev->templates_lock);
     if (wrapper_dev->base.ops)
         free(wrapper_dev->base.ops);
     free(wrapper_dev);
@@ -185,6 +393,7 @@ int camera3_device_open(const hw_module_t *module, const char *name,
     int rv = 0;
     int num_cameras = 0;
     int cameraid;
+    camera_module_t *vendor;
     wrapper_camera3_device_t *camera3_device = NULL;
     camera3_device_ops_t *camera3_ops = NULL;
 
@@ -193,11 +402,12 @@ int camera3_device_open(const hw_module_t *module, const char *name,
     ALOGV("%s", __FUNCTION__);
 
     if (name != NULL) {
-        if (check_vendor_module())
+        vendor = camera_vendor_module();
+        if (!vendor)
             return -EINVAL;
 
         cameraid = atoi(name);
-        num_cameras = gVendorModule->get_number_of_cameras();
+        num_cameras = vendor->get_number_of_cameras();
 
         if (cameraid > num_cameras) {
             ALOGE("camera service provided cameraid out of bounds, "
@@ -216,7 +426,25 @@ int camera3_device_open(const hw_module_t *module, const char *name,
         memset(camera3_device, 0, sizeof(*camera3_device));
         camera3_device->id = cameraid;
 
-        rv = gVendorModule->common.methods->open((const hw_module_t*)gVendorModule, name, (hw_device_t**)&(camera3_device->vendor));
+        pthread_mutex_init(&camera3_device->templates_lock, NULL);
+
+        camera3_device->tracker = new RequestTracker();
+        camera3_device->tracker->Init(camera3_partial_result_count(cameraid));
+
+        camera3_device->request_filters = new MetadataFilterChain();
+        camera3_device->request_filters->Init(cameraid, MF_REQUEST, sMetadataFilters, 1);
+        camera3_device->result_filters = new MetadataFilterChain();
+        camera3_device->result_filters->Init(cameraid, MF_RESULT, sMetadataFilters,
+                RESULT_FILTER_BUFFERS);
+
+        camera3_device->stream_configs = new StreamConfigCache();
+        camera3_device->stream_configs->SetFastReconfigure(
+                property_get_bool("persist.vendor.sys.camera.wrapper.fast_reconfigure", false));
+
+        if (property_get_bool("persist.vendor.sys.camera.wrapper.capture_trace", false))
+            camera3_device->tracer = new CaptureTracer();
+
+        rv = vendor->common.methods->open((const hw_module_t*)vendor, name, (hw_device_t**)&(camera3_device->vendor));
         if (rv)
         {
             ALOGE("vendor camera open fail");
@@ -255,6 +483,12 @@ int camera3_device_open(const hw_module_t *module, const char *name,
 
 fail:
     if (camera3_device) {
+        delete camera3_device->tracer;
+        delete camera3_device->tracker;
+        delete camera3_device->stream_configs;
+        delete camera3_device->request_filters;
+        delete camera3_device->result_filters;
+        pthread_mutex_destroy(&camera3_device->templates_lock);
         free(camera3_device);
         camera3_device = NULL;
     }
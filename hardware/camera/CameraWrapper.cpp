@@ -18,14 +18,41 @@
 #define LOG_PARAMETERS
 
 #define LOG_TAG "CameraWrapper"
+#ifdef __ANDROID__
 #include <android/fdsan.h>
+#endif
 #include <cutils/log.h>
 
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+
 #include "CameraWrapper.h"
 #include "Camera2Wrapper.h"
 #include "Camera3Wrapper.h"
 
+static pthread_once_t gVendorModuleOnce = PTHREAD_ONCE_INIT;
 static camera_module_t *gVendorModule = 0;
+static long long gVendorModuleLoadNs = 0;
+
+/* Upper bound of cameras whose camera_info is cached */
+#define CAMERA_INFO_CACHE_SIZE 8
+
+typedef struct camera_info_cache {
+    bool valid;
+    struct camera_info info;
+} camera_info_cache_t;
+
+/* camera_info snapshot, protected by gCameraInfoLock */
+static pthread_mutex_t gCameraInfoLock = PTHREAD_MUTEX_INITIALIZER;
+static camera_info_cache_t gCameraInfo[CAMERA_INFO_CACHE_SIZE];
+static bool gCameraInfoReady = false;
+static uint64_t gCameraInfoHits = 0;
+static uint64_t gCameraInfoMisses = 0;
+static long long gCameraInfoVendorNs = 0;
+
+/* Framework module callbacks, ours forward to them */
+static const camera_module_callbacks_t *gUserCallbacks = 0;
 
 static int camera_device_open(const hw_module_t* module, const char* name,
         hw_device_t** device);
@@ -38,21 +65,172 @@ static int camera_open_legacy(const struct hw_module_t* module, const char* id,
 static int camera_set_torch_mode(const char* camera_id, bool enabled);
 static int camera_init();
 
-static int check_vendor_module()
+static void load_vendor_module()
 {
-    android_fdsan_set_error_level(ANDROID_FDSAN_ERROR_LEVEL_DISABLED);
-    int rv = 0;
+    struct timespec start, end;
+    int rv;
+
     ALOGV("%s", __FUNCTION__);
 
-    if(gVendorModule)
-        return 0;
+#ifdef __ANDROID__
+    android_fdsan_set_error_level(ANDROID_FDSAN_ERROR_LEVEL_DISABLED);
+#endif
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     rv = hw_get_module_by_class("camera", "vendor", (const hw_module_t **)&gVendorModule);
-    if (rv)
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    gVendorModuleLoadNs = (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+
+    if (rv) {
         ALOGE("failed to open vendor camera module");
+        gVendorModule = NULL;
+        return;
+    }
+
+    ALOGI("loaded vendor camera module in %lld uS", gVendorModuleLoadNs / 1000);
+}
+
+/* Shared by the HAL1 and HAL3 wrappers, so the vendor module is only ever resolved once */
+camera_module_t *camera_vendor_module()
+{
+    pthread_once(&gVendorModuleOnce, load_vendor_module);
+    return gVendorModule;
+}
+
+long long camera_vendor_module_load_ns()
+{
+    return gVendorModuleLoadNs;
+}
+
+static int check_vendor_module()
+{
+    return camera_vendor_module() ? 0 : -EINVAL;
+}
+
+static long long camera_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*******************************************************************
+ * camera_info cache
+ *
+ * cameraserver and apps query camera_info over and over at startup and on
+ * every camera switch, while all of it is static. Snapshot it once after
+ * camera_init and drop a camera's snapshot when the vendor reports a status
+ * change for it.
+ *******************************************************************/
+
+static int camera_info_from_vendor(int camera_id, struct camera_info *info)
+{
+    long long start = camera_timestamp();
+    int rv = camera_vendor_module()->get_camera_info(camera_id, info);
+
+    gCameraInfoMisses++;
+    gCameraInfoVendorNs += camera_timestamp() - start;
+
     return rv;
 }
 
+int camera_cached_camera_info(int camera_id, struct camera_info *info)
+{
+    int rv = 0;
+
+    if (check_vendor_module())
+        return 0;
+
+    pthread_mutex_lock(&gCameraInfoLock);
+
+    if (!gCameraInfoReady || camera_id < 0 || camera_id >= CAMERA_INFO_CACHE_SIZE) {
+        rv = camera_info_from_vendor(camera_id, info);
+    } else if (gCameraInfo[camera_id].valid) {
+        *info = gCameraInfo[camera_id].info;
+        gCameraInfoHits++;
+    } else {
+        rv = camera_info_from_vendor(camera_id, info);
+        if (!rv) {
+            gCameraInfo[camera_id].info = *info;
+            gCameraInfo[camera_id].valid = true;
+        }
+    }
+
+    pthread_mutex_unlock(&gCameraInfoLock);
+
+    return rv;
+}
+
+static void camera_info_cache_snapshot()
+{
+    int num_cameras = camera_vendor_module()->get_number_of_cameras();
+    struct camera_info info;
+
+    pthread_mutex_lock(&gCameraInfoLock);
+
+    for (int i = 0; i < num_cameras && i < CAMERA_INFO_CACHE_SIZE; i++) {
+        gCameraInfo[i].valid = !camera_info_from_vendor(i, &info);
+        if (gCameraInfo[i].valid)
+            gCameraInfo[i].info = info;
+    }
+    gCameraInfoReady = true;
+
+    pthread_mutex_unlock(&gCameraInfoLock);
+}
+
+static void camera_info_cache_invalidate(int camera_id)
+{
+    pthread_mutex_lock(&gCameraInfoLock);
+    if (camera_id >= 0 && camera_id < CAMERA_INFO_CACHE_SIZE)
+        gCameraInfo[camera_id].valid = false;
+    pthread_mutex_unlock(&gCameraInfoLock);
+}
+
+void camera_info_cache_dump(int fd)
+{
+    pthread_mutex_lock(&gCameraInfoLock);
+    long long avg = gCameraInfoMisses ? gCameraInfoVendorNs / (long long)gCameraInfoMisses : 0;
+    dprintf(fd, "  camera_info: %llu served from cache, %llu from the vendor avg %lld uS, ~%lld uS saved\n",
+            (unsigned long long)gCameraInfoHits, (unsigned long long)gCameraInfoMisses,
+            avg / 1000, avg * (long long)gCameraInfoHits / 1000);
+    pthread_mutex_unlock(&gCameraInfoLock);
+}
+
+void camera_memory_dump(int fd)
+{
+    /* Only look at it when the vendor library pulled it in */
+    void *shim = dlopen("libexynoscamera_gralloc_shim.so", RTLD_NOW | RTLD_NOLOAD);
+    if (!shim)
+        return;
+
+    void (*dump)(int) = (void (*)(int))dlsym(shim, "exynos_camera_memory_dump");
+    if (dump)
+        dump(fd);
+
+    dlclose(shim);
+}
+
+static void wrapped_camera_device_status_change(const struct camera_module_callbacks* callbacks __unused,
+        int camera_id, int new_status)
+{
+    /* The camera may come back different, fetch its camera_info afresh next time */
+    camera_info_cache_invalidate(camera_id);
+
+    gUserCallbacks->camera_device_status_change(gUserCallbacks, camera_id, new_status);
+}
+
+static void wrapped_torch_mode_status_change(const struct camera_module_callbacks* callbacks __unused,
+        const char* camera_id, int new_status)
+{
+    gUserCallbacks->torch_mode_status_change(gUserCallbacks, camera_id, new_status);
+}
+
+static camera_module_callbacks_t gWrappedCallbacks = {
+    .camera_device_status_change = wrapped_camera_device_status_change,
+    .torch_mode_status_change = wrapped_torch_mode_status_change,
+};
+
 static struct hw_module_methods_t camera_module_methods = {
     .open = camera_device_open
 };
@@ -104,9 +282,7 @@ static int camera_get_number_of_cameras(void)
 static int camera_get_camera_info(int camera_id, struct camera_info *info)
 {
     ALOGV("%s", __FUNCTION__);
-    if (check_vendor_module())
-        return 0;
-    return gVendorModule->get_camera_info(camera_id, info);
+    return camera_cached_camera_info(camera_id, info);
 }
 
 static int camera_set_callbacks(const camera_module_callbacks_t *callbacks)
@@ -114,7 +290,11 @@ static int camera_set_callbacks(const camera_module_callbacks_t *callbacks)
     ALOGV("%s", __FUNCTION__);
     if (check_vendor_module())
         return 0;
-    return gVendorModule->set_callbacks(callbacks);
+    if (!callbacks)
+        return gVendorModule->set_callbacks(callbacks);
+
+    gUserCallbacks = callbacks;
+    return gVendorModule->set_callbacks(&gWrappedCallbacks);
 }
 
 static void camera_get_vendor_tag_ops(vendor_tag_ops_t* ops)
@@ -146,5 +326,10 @@ static int camera_init()
     ALOGV("%s", __FUNCTION__);
     if (check_vendor_module())
         return 0;
-    return gVendorModule->init();
+
+    int rv = gVendorModule->init();
+    if (!rv)
+        camera_info_cache_snapshot();
+
+    return rv;
 }
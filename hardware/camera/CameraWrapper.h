@@ -14,11 +14,24 @@
  * limitations under the License.
  */
 
-#include <utils/String8.h>
+#include <utils/Mutex.h>
 #include <hardware/hardware.h>
 #include <hardware/camera.h>
-#include <camera/Camera.h>
-#include <camera/CameraParameters.h>
 
 static android::Mutex gCameraWrapperLock;
 
+/* Loads the vendor camera module on first use, returns NULL if that failed */
+camera_module_t *camera_vendor_module();
+
+/* Time it took to load the vendor camera module in nS */
+long long camera_vendor_module_load_ns();
+
+/* camera_info of a camera, served from the snapshot taken after camera_init */
+int camera_cached_camera_info(int camera_id, struct camera_info *info);
+
+/* Writes the camera_info cache statistics */
+void camera_info_cache_dump(int fd);
+
+/* Writes the buffer statistics of the vendor library's memory shim, if it is loaded */
+void camera_memory_dump(int fd);
+
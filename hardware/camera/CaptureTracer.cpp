@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Opt-in per frame latency tracing for the HAL3 capture pipeline.
+ *
+ * The request tracker already follows every frame from its request until the
+ * vendor delivered everything. The tracer times shutter notifies, the final
+ * metadata partial, every returned buffer and frame completion against the
+ * request. Nothing here allocates or takes a lock.
+ */
+
+#define LOG_NDEBUG 1
+#define LOG_TAG "Camera3WrapperTracer"
+
+#include "CaptureTracer.h"
+#include <cutils/log.h>
+
+#include <stdio.h>
+
+using namespace std;
+
+CaptureTracer::CaptureTracer() {
+    Reset();
+}
+
+void CaptureTracer::Reset() {
+    for (int i = 0; i < CT_MAX_STREAMS; i++) {
+        m_streams[i].stream = NULL;
+        m_streams[i].latency.Reset();
+    }
+    m_numStreams.store(0, memory_order_relaxed);
+
+    m_shutter.Reset();
+    m_result.Reset();
+    m_complete.Reset();
+}
+
+void CaptureTracer::OnConfigure(const camera3_stream_configuration_t* streamList) {
+    uint32_t count = 0;
+
+    /* No requests are in flight across configure_streams, start over with the new streams */
+    m_numStreams.store(0, memory_order_release);
+
+    for (uint32_t i = 0; i < streamList->num_streams && count < CT_MAX_STREAMS; i++) {
+        const camera3_stream_t* stream = streamList->streams[i];
+
+        if (stream->stream_type == CAMERA3_STREAM_INPUT)
+            continue;
+
+        StreamTrace& st = m_streams[count++];
+        st.stream = stream;
+        st.width = stream->width;
+        st.height = stream->height;
+        st.format = stream->format;
+        st.latency.Reset();
+    }
+
+    m_numStreams.store(count, memory_order_release);
+}
+
+CaptureTracer::StreamTrace* CaptureTracer::FindStream(const camera3_stream_t* stream) {
+    uint32_t count = m_numStreams.load(memory_order_acquire);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (m_streams[i].stream == stream)
+            return &m_streams[i];
+    }
+
+    return NULL;
+}
+
+void CaptureTracer::OnShutter(const FrameEvent& event) {
+    m_shutter.Add(event.now - event.requestNs);
+}
+
+void CaptureTracer::OnResult(const camera3_capture_result_t* result, const FrameEvent& event) {
+    for (uint32_t i = 0; i < result->num_output_buffers; i++) {
+        StreamTrace* st = FindStream(result->output_buffers[i].stream);
+
+        if (st)
+            st->latency.Add(event.now - event.requestNs);
+    }
+
+    OnRetire(event);
+}
+
+void CaptureTracer::OnRetire(const FrameEvent& event) {
+    if (event.metadataDone)
+        m_result.Add(event.now - event.requestNs);
+    if (event.complete)
+        m_complete.Add(event.now - event.requestNs);
+}
+
+void CaptureTracer::Dump(int fd) const {
+    m_shutter.Dump(fd, "request to shutter");
+    m_result.Dump(fd, "request to metadata");
+    m_complete.Dump(fd, "request to complete");
+
+    uint32_t count = m_numStreams.load(memory_order_acquire);
+    for (uint32_t i = 0; i < count; i++) {
+        char name[48];
+
+        snprintf(name, sizeof(name), "stream %u %ux%u 0x%x", i, m_streams[i].width,
+                m_streams[i].height, m_streams[i].format);
+        m_streams[i].latency.Dump(fd, name);
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _CAPTURE_TRACER_H
+#define _CAPTURE_TRACER_H
+
+#include <atomic>
+#include <stdint.h>
+#include <hardware/camera3.h>
+
+#include "LatencyHistogram.h"
+#include "RequestTracker.h"
+
+/* Streams of one configuration that get their own latency histogram */
+#define CT_MAX_STREAMS      8
+
+class CaptureTracer {
+public:
+    CaptureTracer();
+
+    void Reset();
+
+    /* Framework thread */
+    void OnConfigure(const camera3_stream_configuration_t* streamList);
+
+    /* Vendor result threads, with what the request tracker made of the callback */
+    void OnShutter(const FrameEvent& event);
+    void OnResult(const camera3_capture_result_t* result, const FrameEvent& event);
+    void OnRetire(const FrameEvent& event);
+
+    void Dump(int fd) const;
+
+private:
+    CaptureTracer(const CaptureTracer&);
+    CaptureTracer& operator=(const CaptureTracer&);
+
+    struct StreamTrace {
+        const camera3_stream_t* stream;
+        uint32_t width;
+        uint32_t height;
+        int format;
+        LatencyHistogram latency;
+    };
+
+    StreamTrace* FindStream(const camera3_stream_t* stream);
+
+    StreamTrace m_streams[CT_MAX_STREAMS];
+    std::atomic<uint32_t> m_numStreams;
+
+    LatencyHistogram m_shutter;
+    LatencyHistogram m_result;
+    LatencyHistogram m_complete;
+};
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LATENCY_HISTOGRAM_H
+#define _LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "CallbackStats.h"
+
+/* Lock-free log2 latency histogram in uS, laid out like the callback statistics */
+struct LatencyHistogram {
+    std::atomic<uint64_t> buckets[CB_STATS_HIST_BUCKETS];
+    std::atomic<uint64_t> maxUs;
+
+    void Reset() {
+        for (int i = 0; i < CB_STATS_HIST_BUCKETS; i++)
+            buckets[i].store(0, std::memory_order_relaxed);
+        maxUs.store(0, std::memory_order_relaxed);
+    }
+
+    void Add(long long ns) {
+        long long us = ns / 1000;
+        int bucket = 0;
+
+        if (us > 0) {
+            bucket = 64 - __builtin_clzll((unsigned long long)us);
+            if (bucket >= CB_STATS_HIST_BUCKETS)
+                bucket = CB_STATS_HIST_BUCKETS - 1;
+        }
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t cur = maxUs.load(std::memory_order_relaxed);
+        while (us > 0 && (uint64_t)us > cur &&
+                !maxUs.compare_exchange_weak(cur, us, std::memory_order_relaxed))
+            ;
+    }
+
+    void Dump(int fd, const char* name) const {
+        uint64_t hist[CB_STATS_HIST_BUCKETS];
+        uint64_t count = 0;
+
+        for (int i = 0; i < CB_STATS_HIST_BUCKETS; i++) {
+            hist[i] = buckets[i].load(std::memory_order_relaxed);
+            count += hist[i];
+        }
+
+        dprintf(fd, "  %-24s %8llu samples, p50 <%lluuS p99 <%lluuS max %lluuS\n", name,
+                (unsigned long long)count,
+                (unsigned long long)camera_wrapper_cb_hist_percentile(hist, 50),
+                (unsigned long long)camera_wrapper_cb_hist_percentile(hist, 99),
+                (unsigned long long)maxUs.load(std::memory_order_relaxed));
+    }
+};
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Metadata rewrite filters for the HAL3 capture path, the camera3 counterpart of
+ * the HAL1 parameter fixups.
+ *
+ * Filters come from a table and are picked per camera and per request or result
+ * direction when the device is opened. Metadata no filter has anything to do with
+ * is passed on untouched. Otherwise it is copied into a preallocated buffer sized
+ * with room for whatever the filters add, and edited there in place, so the steady
+ * state rewrite does not touch the heap. Every filter counts how often it ran and
+ * how long it took.
+ */
+
+#define LOG_NDEBUG 1
+#define LOG_TAG "Camera3WrapperMetadata"
+
+#include "MetadataFilter.h"
+#include <cutils/log.h>
+
+#include <stdio.h>
+#include <time.h>
+
+using namespace std;
+
+/* Initial buffer capacity, enough for the usual request settings and results */
+#define MF_DEFAULT_ENTRIES  256
+#define MF_DEFAULT_DATA     (32 * 1024)
+
+static long long filter_timestamp() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double entry_value(const camera_metadata_ro_entry_t& entry, size_t i) {
+    switch (entry.type) {
+        case TYPE_BYTE:     return entry.data.u8[i];
+        case TYPE_INT32:    return entry.data.i32[i];
+        case TYPE_FLOAT:    return entry.data.f[i];
+        case TYPE_INT64:    return entry.data.i64[i];
+        case TYPE_DOUBLE:   return entry.data.d[i];
+        default:            return 0;
+    }
+}
+
+static void clamp_entry(camera_metadata_entry_t& entry, double min, double max) {
+    for (size_t i = 0; i < entry.count; i++) {
+        switch (entry.type) {
+            case TYPE_BYTE:
+                entry.data.u8[i] = entry.data.u8[i] < min ? min :
+                        entry.data.u8[i] > max ? max : entry.data.u8[i];
+                break;
+            case TYPE_INT32:
+                entry.data.i32[i] = entry.data.i32[i] < min ? min :
+                        entry.data.i32[i] > max ? max : entry.data.i32[i];
+                break;
+            case TYPE_FLOAT:
+                entry.data.f[i] = entry.data.f[i] < min ? min :
+                        entry.data.f[i] > max ? max : entry.data.f[i];
+                break;
+            case TYPE_INT64:
+                entry.data.i64[i] = entry.data.i64[i] < min ? min :
+                        entry.data.i64[i] > max ? max : entry.data.i64[i];
+                break;
+            case TYPE_DOUBLE:
+                entry.data.d[i] = entry.data.d[i] < min ? min :
+                        entry.data.d[i] > max ? max : entry.data.d[i];
+                break;
+        }
+    }
+}
+
+MetadataFilterChain::MetadataFilterChain() : m_numFilters(0), m_extraEntries(0),
+        m_extraData(0), m_rewritten(0), m_passed(0), m_grown(0), m_failed(0) {
+    for (int i = 0; i < MF_MAX_FILTERS; i++) {
+        m_filters[i] = NULL;
+        m_costs[i].applied.store(0, memory_order_relaxed);
+        m_costs[i].ns.store(0, memory_order_relaxed);
+    }
+}
+
+void MetadataFilterChain::Init(int cameraId, int target, const metadata_filter_t* table,
+        uint32_t numBuffers) {
+    for (const metadata_filter_t* filter = table; filter->action != MF_END; filter++) {
+        if (!(filter->target & target))
+            continue;
+        if (filter->camera_id != MF_ALL_CAMERAS && filter->camera_id != cameraId)
+            continue;
+
+        if (m_numFilters == MF_MAX_FILTERS) {
+            ALOGE("%s: too many metadata filters, ignoring %s", __FUNCTION__, filter->name);
+            break;
+        }
+        m_filters[m_numFilters++] = filter;
+
+        if (filter->action == MF_SET) {
+            m_extraEntries++;
+            m_extraData += calculate_camera_metadata_entry_data_size(
+                    get_camera_metadata_tag_type(filter->tag), filter->count);
+        } else if (filter->action == MF_CUSTOM) {
+            m_extraEntries += filter->extra_entries;
+            m_extraData += filter->extra_data;
+        }
+    }
+
+    if (!m_numFilters)
+        return;
+
+    /* Preallocate the buffers up front, the capture path only grows them if it must */
+    MetadataBuffer* buffers[MF_MAX_BUFFERS];
+
+    if (numBuffers > MF_MAX_BUFFERS)
+        numBuffers = MF_MAX_BUFFERS;
+
+    m_buffers.Init(numBuffers);
+    for (uint32_t i = 0; i < numBuffers; i++) {
+        buffers[i] = m_buffers.Get();
+        Reserve(buffers[i], MF_DEFAULT_ENTRIES + m_extraEntries, MF_DEFAULT_DATA + m_extraData);
+    }
+    for (uint32_t i = 0; i < numBuffers; i++)
+        m_buffers.Put(buffers[i]);
+}
+
+bool MetadataFilterChain::NeedsRewrite(const camera_metadata_t* src) const {
+    camera_metadata_ro_entry_t entry;
+
+    for (uint32_t i = 0; i < m_numFilters; i++) {
+        const metadata_filter_t* filter = m_filters[i];
+
+        switch (filter->action) {
+            case MF_REMOVE:
+                if (!find_camera_metadata_ro_entry(src, filter->tag, &entry))
+                    return true;
+                break;
+            case MF_CLAMP:
+                if (find_camera_metadata_ro_entry(src, filter->tag, &entry))
+                    break;
+                for (size_t j = 0; j < entry.count; j++) {
+                    double value = entry_value(entry, j);
+                    if (value < filter->min || value > filter->max)
+                        return true;
+                }
+                break;
+            default:
+                return true;
+        }
+    }
+
+    return false;
+}
+
+bool MetadataFilterChain::Reserve(MetadataBuffer* buffer, size_t entries, size_t data) {
+    size_t size = calculate_camera_metadata_size(entries, data);
+
+    if (buffer->size >= size)
+        return true;
+
+    if (buffer->mem)
+        m_grown.fetch_add(1, memory_order_relaxed);
+
+    void* mem = realloc(buffer->mem, size);
+    if (!mem)
+        return false;
+
+    buffer->mem = mem;
+    buffer->size = size;
+    return true;
+}
+
+int MetadataFilterChain::Run(const metadata_filter_t* filter, camera_metadata_t* metadata) {
+    camera_metadata_entry_t entry;
+    bool present = !find_camera_metadata_entry(metadata, filter->tag, &entry);
+
+    switch (filter->action) {
+        case MF_SET:
+            if (present)
+                return update_camera_metadata_entry(metadata, entry.index, filter->data,
+                        filter->count, NULL);
+            return add_camera_metadata_entry(metadata, filter->tag, filter->data, filter->count);
+        case MF_REMOVE:
+            return present ? delete_camera_metadata_entry(metadata, entry.index) : 0;
+        case MF_CLAMP:
+            if (present)
+                clamp_entry(entry, filter->min, filter->max);
+            return 0;
+        case MF_CUSTOM:
+            return filter->apply(metadata, filter);
+    }
+
+    return 0;
+}
+
+const camera_metadata_t* MetadataFilterChain::Apply(const camera_metadata_t* src,
+        MetadataBuffer** buffer) {
+    *buffer = NULL;
+
+    if (!src || !m_numFilters || !NeedsRewrite(src)) {
+        m_passed.fetch_add(1, memory_order_relaxed);
+        return src;
+    }
+
+    MetadataBuffer* buf = m_buffers.Get();
+    size_t entries = get_camera_metadata_entry_count(src) + m_extraEntries;
+    size_t data = get_camera_metadata_data_count(src) + m_extraData;
+    camera_metadata_t* dst = NULL;
+
+    if (Reserve(buf, entries, data))
+        dst = place_camera_metadata(buf->mem, buf->size, entries, data);
+
+    if (!dst || append_camera_metadata(dst, src)) {
+        ALOGE("%s: unable to copy metadata, passing it on unfiltered", __FUNCTION__);
+        m_failed.fetch_add(1, memory_order_relaxed);
+        m_buffers.Put(buf);
+        return src;
+    }
+
+    for (uint32_t i = 0; i < m_numFilters; i++) {
+        long long start = filter_timestamp();
+
+        if (Run(m_filters[i], dst))
+            ALOGE("%s: metadata filter %s failed", __FUNCTION__, m_filters[i]->name);
+
+        m_costs[i].applied.fetch_add(1, memory_order_relaxed);
+        m_costs[i].ns.fetch_add(filter_timestamp() - start, memory_order_relaxed);
+    }
+
+    m_rewritten.fetch_add(1, memory_order_relaxed);
+    *buffer = buf;
+    return dst;
+}
+
+void MetadataFilterChain::Release(MetadataBuffer* buffer) {
+    if (buffer)
+        m_buffers.Put(buffer);
+}
+
+void MetadataFilterChain::Dump(int fd, const char* name) const {
+    if (!m_numFilters)
+        return;
+
+    dprintf(fd, "  %s metadata: %llu rewritten, %llu passed on, %llu buffers grown, %llu failed\n",
+            name, (unsigned long long)m_rewritten.load(memory_order_relaxed),
+            (unsigned long long)m_passed.load(memory_order_relaxed),
+            (unsigned long long)m_grown.load(memory_order_relaxed),
+            (unsigned long long)m_failed.load(memory_order_relaxed));
+
+    for (uint32_t i = 0; i < m_numFilters; i++) {
+        uint64_t applied = m_costs[i].applied.load(memory_order_relaxed);
+        uint64_t ns = m_costs[i].ns.load(memory_order_relaxed);
+
+        dprintf(fd, "    %-32s %llu applied, avg %llu nS\n", m_filters[i]->name,
+                (unsigned long long)applied, (unsigned long long)(applied ? ns / applied : 0));
+    }
+}
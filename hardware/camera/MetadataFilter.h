@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _METADATA_FILTER_H
+#define _METADATA_FILTER_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#include <system/camera_metadata.h>
+
+#include "ObjectPool.h"
+
+/* Which metadata a filter rewrites */
+#define MF_REQUEST      (1 << 0)
+#define MF_RESULT       (1 << 1)
+
+/* Ends a filter table */
+#define MF_END          0
+/* Sets the tag to count values of data, adding it if missing */
+#define MF_SET          1
+/* Drops the tag */
+#define MF_REMOVE       2
+/* Limits every value of the tag to [min, max] */
+#define MF_CLAMP        3
+/* Calls apply on the whole buffer */
+#define MF_CUSTOM       4
+
+#define MF_ALL_CAMERAS  -1
+
+/* Filters a chain holds at most */
+#define MF_MAX_FILTERS  16
+
+/* Buffers a chain preallocates at most */
+#define MF_MAX_BUFFERS  8
+
+typedef struct metadata_filter {
+    int camera_id;
+    int target;
+    int action;
+    uint32_t tag;
+
+    /* MF_SET */
+    const void *data;
+    size_t count;
+
+    /* MF_CLAMP */
+    double min;
+    double max;
+
+    /* MF_CUSTOM, may edit metadata in place but must not grow it beyond extra_* */
+    int (*apply)(camera_metadata_t *metadata, const struct metadata_filter *filter);
+    size_t extra_entries;
+    size_t extra_data;
+
+    const char *name;
+} metadata_filter_t;
+
+/* Preallocated buffer the rewritten metadata is placed in */
+struct MetadataBuffer {
+    MetadataBuffer() : mem(0), size(0) {}
+    ~MetadataBuffer() { free(mem); }
+
+    void* mem;
+    size_t size;
+};
+
+class MetadataFilterChain {
+public:
+    MetadataFilterChain();
+
+    /* Picks the filters of table for this camera and target, buffers only when there are any */
+    void Init(int cameraId, int target, const metadata_filter_t* table, uint32_t numBuffers);
+
+    bool Empty() const { return !m_numFilters; }
+
+    /*
+     * Returns src if no filter touches it, or a rewritten copy in a buffer that must be
+     * handed back with Release once the copy is no longer used.
+     */
+    const camera_metadata_t* Apply(const camera_metadata_t* src, MetadataBuffer** buffer);
+    void Release(MetadataBuffer* buffer);
+
+    void Dump(int fd, const char* name) const;
+
+private:
+    MetadataFilterChain(const MetadataFilterChain&);
+    MetadataFilterChain& operator=(const MetadataFilterChain&);
+
+    struct FilterCost {
+        std::atomic<uint64_t> applied;
+        std::atomic<uint64_t> ns;
+    };
+
+    bool NeedsRewrite(const camera_metadata_t* src) const;
+    bool Reserve(MetadataBuffer* buffer, size_t entries, size_t data);
+    int Run(const metadata_filter_t* filter, camera_metadata_t* metadata);
+
+    const metadata_filter_t* m_filters[MF_MAX_FILTERS];
+    FilterCost m_costs[MF_MAX_FILTERS];
+    uint32_t m_numFilters;
+
+    /* Room the filters may add on top of the source metadata */
+    size_t m_extraEntries;
+    size_t m_extraData;
+
+    ObjectPool<MetadataBuffer> m_buffers;
+    std::atomic<uint64_t> m_rewritten;
+    std::atomic<uint64_t> m_passed;
+    std::atomic<uint64_t> m_grown;
+    std::atomic<uint64_t> m_failed;
+};
+
+#endif
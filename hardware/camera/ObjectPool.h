@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OBJECT_POOL_H
+#define _OBJECT_POOL_H
+
+#include <atomic>
+#include <stdint.h>
+
+/*
+ * Fixed capacity object pool with a lock-free free list.
+ *
+ * Objects are preallocated by Init, Get and Put may be called from any thread.
+ * When the pool runs dry Get falls back to the heap and counts the exhaustion,
+ * Put hands such objects back to the heap.
+ */
+template <typename T>
+class ObjectPool {
+public:
+    ObjectPool() : m_objects(0), m_next(0), m_capacity(0), m_freeHead(EMPTY),
+            m_exhausted(0) {
+    }
+
+    ~ObjectPool() {
+        delete[] m_objects;
+        delete[] m_next;
+    }
+
+    /* Preallocates capacity objects, not thread safe */
+    bool Init(uint32_t capacity) {
+        if (m_objects)
+            return capacity == m_capacity;
+
+        m_objects = new T[capacity];
+        m_next = new std::atomic<uint32_t>[capacity];
+        m_capacity = capacity;
+
+        for (uint32_t i = 0; i < capacity; i++)
+            m_next[i].store(i + 1 < capacity ? i + 1 : EMPTY, std::memory_order_relaxed);
+        m_freeHead.store(capacity ? 0 : EMPTY, std::memory_order_release);
+
+        return true;
+    }
+
+    T* Get(bool* exhausted = NULL) {
+        uint64_t head = m_freeHead.load(std::memory_order_acquire);
+
+        while ((uint32_t)head != EMPTY) {
+            uint32_t index = (uint32_t)head;
+            uint64_t next = Tag(head) | m_next[index].load(std::memory_order_relaxed);
+
+            if (m_freeHead.compare_exchange_weak(head, next, std::memory_order_acquire)) {
+                if (exhausted)
+                    *exhausted = false;
+                return &m_objects[index];
+            }
+        }
+
+        /* Exhausted, fall back to the heap */
+        m_exhausted.fetch_add(1, std::memory_order_relaxed);
+        if (exhausted)
+            *exhausted = true;
+        return new T();
+    }
+
+    void Put(T* obj) {
+        if (!Owns(obj)) {
+            delete obj;
+            return;
+        }
+
+        uint32_t index = obj - m_objects;
+        uint64_t head = m_freeHead.load(std::memory_order_relaxed);
+
+        do {
+            m_next[index].store((uint32_t)head, std::memory_order_relaxed);
+        } while (!m_freeHead.compare_exchange_weak(head, Tag(head) | index,
+                std::memory_order_release));
+    }
+
+    uint32_t Capacity() const { return m_capacity; }
+
+    /* Number of Get calls that had to fall back to the heap */
+    uint64_t Exhausted() const { return m_exhausted.load(std::memory_order_relaxed); }
+
+private:
+    ObjectPool(const ObjectPool&);
+    ObjectPool& operator=(const ObjectPool&);
+
+    static const uint32_t EMPTY = 0xffffffff;
+
+    /* The upper half of the free list head is an ABA tag bumped on every update */
+    static uint64_t Tag(uint64_t head) { return ((head >> 32) + 1) << 32; }
+
+    bool Owns(const T* obj) const {
+        return m_objects && obj >= m_objects && obj < m_objects + m_capacity;
+    }
+
+    T* m_objects;
+    std::atomic<uint32_t>* m_next;
+    uint32_t m_capacity;
+    std::atomic<uint64_t> m_freeHead;
+    std::atomic<uint64_t> m_exhausted;
+};
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_NDEBUG 1
+#define LOG_PARAMETERS
+
+#define LOG_TAG "Camera2WrapperFixups"
+#include <cutils/log.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ParamFixups.h"
+
+/*
+ * Fixups are rules on the flattened "key=value;key=value" string and are
+ * applied in a single pass over it, without building a CameraParameters.
+ */
+
+const camera2_param_fixup_t gParamFixups[] = {
+    { FIXUP_ALL_CAMERAS, FIXUP_GET, FIXUP_OVERRIDE, "video-size-values",
+      "3840x2160,2560x1440,1920x1080,1440x1080,1088x1088,1280x720,960x720,800x450,720x480,640x480,480x320,352x288,320x240,256x144,176x144" },
+};
+
+const size_t gNumParamFixups = sizeof(gParamFixups) / sizeof(gParamFixups[0]);
+
+static bool camera2_fixup_applies(const camera2_param_fixup_t *fixup, int id, int direction)
+{
+    return (fixup->direction & direction) &&
+            (fixup->camera_id == FIXUP_ALL_CAMERAS || fixup->camera_id == id);
+}
+
+static bool camera2_fixup_matches(const camera2_param_fixup_t *fixup, const char *key, size_t len)
+{
+    return !strncmp(fixup->key, key, len) && fixup->key[len] == '\0';
+}
+
+/* Returns true if entry, of length len, is one of the comma separated entries of list */
+static bool camera2_fixup_listed(const char *list, const char *entry, size_t len)
+{
+    while (*list) {
+        const char *end = strchrnul(list, ',');
+
+        if ((size_t)(end - list) == len && !strncmp(list, entry, len))
+            return true;
+
+        list = *end ? end + 1 : end;
+    }
+
+    return false;
+}
+
+static char *camera2_fixup_append(char *out, const char *str, size_t len)
+{
+    memcpy(out, str, len);
+    return out + len;
+}
+
+/* Appends the entries of value that are allowed by the filter */
+static char *camera2_fixup_filter(char *out, const char *value, size_t len, const char *allowed)
+{
+    const char *end = value + len;
+    bool first = true;
+
+    while (value < end) {
+        const char *entry_end = (const char *)memchr(value, ',', end - value);
+        if (!entry_end)
+            entry_end = end;
+
+        if (camera2_fixup_listed(allowed, value, entry_end - value)) {
+            if (!first)
+                *out++ = ',';
+            out = camera2_fixup_append(out, value, entry_end - value);
+            first = false;
+        }
+
+        value = entry_end + 1;
+    }
+
+    return out;
+}
+
+bool camera2_need_fixup(const camera2_param_fixup_t *fixups, size_t count, int id, int direction)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (camera2_fixup_applies(&fixups[i], id, direction))
+            return true;
+    }
+
+    return false;
+}
+
+char *camera2_apply_fixups(const camera2_param_fixup_t *table, size_t count, int id,
+        int direction, const char *settings)
+{
+    const camera2_param_fixup_t *fixups[FIXUP_MAX_RULES];
+    bool applied[FIXUP_MAX_RULES];
+    size_t num_fixups = 0;
+    size_t size = strlen(settings) + 1;
+
+    /* Overrides may add a key, size the output for the worst case */
+    for (size_t i = 0; i < count; i++) {
+        if (!camera2_fixup_applies(&table[i], id, direction))
+            continue;
+
+        if (num_fixups == FIXUP_MAX_RULES) {
+            ALOGE("%s: More than %d fixups apply, ignoring %s", __FUNCTION__, FIXUP_MAX_RULES,
+                    table[i].key);
+            continue;
+        }
+
+        fixups[num_fixups] = &table[i];
+        applied[num_fixups] = false;
+        num_fixups++;
+
+        if (table[i].action == FIXUP_OVERRIDE)
+            size += strlen(table[i].key) + strlen(table[i].value) + 2;
+    }
+
+    char *ret = (char *)malloc(size);
+    if (!ret)
+        return NULL;
+
+    char *out = ret;
+    const char *pos = settings;
+
+    while (*pos) {
+        const char *end = strchrnul(pos, ';');
+        const char *eq = (const char *)memchr(pos, '=', end - pos);
+        const camera2_param_fixup_t *fixup = NULL;
+        bool repeated = false;
+
+        if (eq) {
+            for (size_t i = 0; i < num_fixups; i++) {
+                if (camera2_fixup_matches(fixups[i], pos, eq - pos)) {
+                    fixup = fixups[i];
+                    repeated = applied[i];
+                    applied[i] = true;
+                    break;
+                }
+            }
+        }
+
+        /*
+         * An overridden key is written once, its repeats are dropped. The last one
+         * would win anyway, and the output is only sized for one override value.
+         */
+        bool drop = fixup && (fixup->action == FIXUP_REMOVE ||
+                (fixup->action == FIXUP_OVERRIDE && repeated));
+
+        if (!drop) {
+            if (out != ret)
+                *out++ = ';';
+
+            if (!fixup) {
+                out = camera2_fixup_append(out, pos, end - pos);
+            } else {
+                out = camera2_fixup_append(out, pos, eq - pos + 1);
+                if (fixup->action == FIXUP_OVERRIDE)
+                    out = camera2_fixup_append(out, fixup->value, strlen(fixup->value));
+                else
+                    out = camera2_fixup_filter(out, eq + 1, end - eq - 1, fixup->value);
+            }
+        }
+
+        pos = *end ? end + 1 : end;
+    }
+
+    /* Add overridden keys the string did not have */
+    for (size_t i = 0; i < num_fixups; i++) {
+        if (applied[i] || fixups[i]->action != FIXUP_OVERRIDE)
+            continue;
+
+        if (out != ret)
+            *out++ = ';';
+        out = camera2_fixup_append(out, fixups[i]->key, strlen(fixups[i]->key));
+        *out++ = '=';
+        out = camera2_fixup_append(out, fixups[i]->value, strlen(fixups[i]->value));
+    }
+
+    *out = '\0';
+
+#ifdef LOG_PARAMETERS
+    ALOGV("%s: Original parameters: %s", __FUNCTION__, settings);
+    ALOGV("%s: Fixed parameters: %s", __FUNCTION__, ret);
+#endif
+
+    return ret;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PARAM_FIXUPS_H
+#define _PARAM_FIXUPS_H
+
+#include <stddef.h>
+
+#define FIXUP_GET       (1 << 0)
+#define FIXUP_SET       (1 << 1)
+
+/* Sets key to value, adding it if the vendor did not report it */
+#define FIXUP_OVERRIDE  0
+/* Keeps only those comma separated entries of the value that are listed in value */
+#define FIXUP_FILTER    1
+/* Drops the key */
+#define FIXUP_REMOVE    2
+
+#define FIXUP_ALL_CAMERAS   -1
+
+/* Rules a single rewrite applies at most */
+#define FIXUP_MAX_RULES     32
+
+typedef struct camera2_param_fixup {
+    int camera_id;
+    int direction;
+    int action;
+    const char *key;
+    const char *value;
+} camera2_param_fixup_t;
+
+/* The fixups Camera2Wrapper applies */
+extern const camera2_param_fixup_t gParamFixups[];
+extern const size_t gNumParamFixups;
+
+/* True if any of the fixups applies to camera id in the given direction */
+bool camera2_need_fixup(const camera2_param_fixup_t *fixups, size_t count, int id, int direction);
+
+/* Returns a malloc'd copy of settings with the fixups for id and direction applied */
+char *camera2_apply_fixups(const camera2_param_fixup_t *fixups, size_t count, int id,
+        int direction, const char *settings);
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In-flight request tracking for the HAL3 capture pipeline.
+ *
+ * Every request gets a slot in a preallocated ring indexed by its frame number,
+ * holding the request time and a count of the metadata partials and buffers the
+ * vendor still owes us. The frame leaves the ring once the vendor delivered
+ * everything. Nothing here allocates or takes a lock.
+ *
+ * Flushes are the main source of mode switch stutter, so each one is timed along
+ * with the requests it had to drain, the requests and buffers the vendor returned
+ * as errors, and whatever was still outstanding or trickled in after it returned.
+ */
+
+#define LOG_NDEBUG 1
+#define LOG_TAG "Camera3WrapperTracker"
+
+#include "RequestTracker.h"
+#include <cutils/log.h>
+
+#include <stdio.h>
+#include <time.h>
+
+using namespace std;
+
+#define RT_PENDING_METADATA(pending)    ((pending) >> 16)
+#define RT_PENDING_BUFFERS(pending)     ((pending) & 0xffff)
+#define RT_PENDING(metadata, buffers)   (((metadata) << 16) | (buffers))
+
+#define RT_STATE(frame, pending)        (((uint64_t)(frame) << 32) | (pending))
+#define RT_STATE_FRAME(state)           ((uint32_t)((state) >> 32))
+#define RT_STATE_PENDING(state)         ((uint32_t)(state))
+
+/* Frame numbers wrap, compare them like sequence numbers */
+#define RT_FRAME_BEFORE(a, b)           ((int32_t)((a) - (b)) < 0)
+
+static const char* const sErrorNames[CAMERA3_MSG_NUM_ERRORS] = {
+    "?", "device", "request", "result", "buffer",
+};
+
+RequestTracker::RequestTracker() : m_partialCount(1), m_flushStart(0) {
+    Reset();
+}
+
+void RequestTracker::Init(uint32_t partialResultCount) {
+    m_partialCount = partialResultCount ? partialResultCount : 1;
+}
+
+void RequestTracker::Reset() {
+    for (int i = 0; i < RT_FRAME_SLOTS; i++) {
+        m_frames[i].requestNs.store(0, memory_order_relaxed);
+        m_frames[i].state.store(0, memory_order_relaxed);
+    }
+
+    m_inFlight.store(0, memory_order_relaxed);
+    m_inFlightMax.store(0, memory_order_relaxed);
+    m_buffersInFlight.store(0, memory_order_relaxed);
+    m_buffersInFlightMax.store(0, memory_order_relaxed);
+    m_nextFrame.store(0, memory_order_relaxed);
+    m_requests.store(0, memory_order_relaxed);
+    m_partials.store(0, memory_order_relaxed);
+    m_untracked.store(0, memory_order_relaxed);
+    for (int i = 0; i < CAMERA3_MSG_NUM_ERRORS; i++)
+        m_errors[i].store(0, memory_order_relaxed);
+
+    m_flushing.store(false, memory_order_relaxed);
+    m_flushBoundary.store(0, memory_order_relaxed);
+    m_flushDuration.Reset();
+    m_flushes.store(0, memory_order_relaxed);
+    m_flushInFlight.store(0, memory_order_relaxed);
+    m_flushErroredRequests.store(0, memory_order_relaxed);
+    m_flushErroredBuffers.store(0, memory_order_relaxed);
+    m_flushUndrained.store(0, memory_order_relaxed);
+    m_stragglers.store(0, memory_order_relaxed);
+}
+
+long long RequestTracker::GetTimestamp() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void update_max(atomic<uint32_t>& max, uint32_t value) {
+    if (value > max.load(memory_order_relaxed))
+        max.store(value, memory_order_relaxed);
+}
+
+void RequestTracker::OnRequest(const camera3_capture_request_t* request) {
+    FrameSlot& frame = m_frames[request->frame_number & (RT_FRAME_SLOTS - 1)];
+
+    /* A frame still owing results is pushed out of the ring */
+    uint64_t old = frame.state.exchange(RT_STATE(request->frame_number, 0), memory_order_acq_rel);
+    if (RT_STATE_PENDING(old)) {
+        m_untracked.fetch_add(1, memory_order_relaxed);
+        m_inFlight.fetch_sub(1, memory_order_relaxed);
+    }
+
+    frame.requestNs.store(GetTimestamp(), memory_order_relaxed);
+    frame.state.store(RT_STATE(request->frame_number,
+            RT_PENDING(m_partialCount, request->num_output_buffers)), memory_order_release);
+
+    m_nextFrame.store(request->frame_number + 1, memory_order_relaxed);
+    m_requests.fetch_add(1, memory_order_relaxed);
+
+    update_max(m_inFlightMax, m_inFlight.fetch_add(1, memory_order_relaxed) + 1);
+    update_max(m_buffersInFlightMax,
+            m_buffersInFlight.fetch_add(request->num_output_buffers, memory_order_relaxed) +
+            request->num_output_buffers);
+}
+
+void RequestTracker::OnRequestFailed(uint32_t frameNumber) {
+    FrameSlot* frame = FindFrame(frameNumber);
+    if (!frame)
+        return;
+
+    uint64_t cur = frame->state.load(memory_order_relaxed);
+    do {
+        if (!RT_STATE_PENDING(cur) || RT_STATE_FRAME(cur) != frameNumber)
+            return;
+    } while (!frame->state.compare_exchange_weak(cur, RT_STATE(frameNumber, 0),
+            memory_order_acq_rel));
+
+    m_inFlight.fetch_sub(1, memory_order_relaxed);
+    m_buffersInFlight.fetch_sub(RT_PENDING_BUFFERS(RT_STATE_PENDING(cur)), memory_order_relaxed);
+}
+
+void RequestTracker::BeginFlush() {
+    m_flushStart = GetTimestamp();
+    m_flushBoundary.store(m_nextFrame.load(memory_order_relaxed), memory_order_relaxed);
+    m_flushInFlight.fetch_add(m_inFlight.load(memory_order_relaxed), memory_order_relaxed);
+    m_flushing.store(true, memory_order_release);
+}
+
+void RequestTracker::EndFlush() {
+    uint32_t boundary = m_flushBoundary.load(memory_order_relaxed);
+    uint32_t undrained = 0;
+
+    m_flushing.store(false, memory_order_release);
+    m_flushDuration.Add(GetTimestamp() - m_flushStart);
+    m_flushes.fetch_add(1, memory_order_relaxed);
+
+    /* Flush must not return before every request it covers came back */
+    for (int i = 0; i < RT_FRAME_SLOTS; i++) {
+        uint64_t state = m_frames[i].state.load(memory_order_acquire);
+
+        if (RT_STATE_PENDING(state) && RT_FRAME_BEFORE(RT_STATE_FRAME(state), boundary))
+            undrained++;
+    }
+
+    if (undrained) {
+        ALOGV("%s: %u requests still in flight after flush", __FUNCTION__, undrained);
+        m_flushUndrained.fetch_add(undrained, memory_order_relaxed);
+    }
+}
+
+void RequestTracker::CountStraggler(uint32_t frameNumber) {
+    if (!m_flushing.load(memory_order_acquire) &&
+            RT_FRAME_BEFORE(frameNumber, m_flushBoundary.load(memory_order_relaxed)))
+        m_stragglers.fetch_add(1, memory_order_relaxed);
+}
+
+RequestTracker::FrameSlot* RequestTracker::FindFrame(uint32_t frameNumber) {
+    FrameSlot* frame = &m_frames[frameNumber & (RT_FRAME_SLOTS - 1)];
+    uint64_t state = frame->state.load(memory_order_acquire);
+
+    if (!RT_STATE_PENDING(state) || RT_STATE_FRAME(state) != frameNumber)
+        return NULL;
+
+    return frame;
+}
+
+void RequestTracker::Retire(FrameSlot* frame, uint32_t frameNumber, uint32_t metadata,
+        uint32_t buffers, bool noMoreMetadata, FrameEvent* event) {
+    uint64_t cur = frame->state.load(memory_order_relaxed);
+    uint32_t pending;
+    uint32_t next;
+
+    do {
+        pending = RT_STATE_PENDING(cur);
+
+        /* The frame was retired, or the ring wrapped and a later frame took the slot */
+        if (!pending || RT_STATE_FRAME(cur) != frameNumber)
+            return;
+
+        uint32_t metaLeft = RT_PENDING_METADATA(pending);
+        uint32_t bufLeft = RT_PENDING_BUFFERS(pending);
+
+        metaLeft = noMoreMetadata || metadata >= metaLeft ? 0 : metaLeft - metadata;
+        bufLeft = buffers >= bufLeft ? 0 : bufLeft - buffers;
+        next = RT_PENDING(metaLeft, bufLeft);
+    } while (!frame->state.compare_exchange_weak(cur, RT_STATE(frameNumber, next),
+            memory_order_acq_rel));
+
+    event->metadataDone = RT_PENDING_METADATA(pending) && !RT_PENDING_METADATA(next);
+    event->complete = !next;
+
+    if (event->complete)
+        m_inFlight.fetch_sub(1, memory_order_relaxed);
+}
+
+bool RequestTracker::OnNotify(const camera3_notify_msg_t* msg, FrameEvent* event) {
+    FrameSlot* frame = NULL;
+
+    event->now = GetTimestamp();
+    event->metadataDone = false;
+    event->complete = false;
+
+    if (msg->type == CAMERA3_MSG_SHUTTER) {
+        frame = FindFrame(msg->message.shutter.frame_number);
+    } else if (msg->type == CAMERA3_MSG_ERROR) {
+        int code = msg->message.error.error_code;
+
+        if (code <= 0 || code >= CAMERA3_MSG_NUM_ERRORS)
+            code = 0;
+        m_errors[code].fetch_add(1, memory_order_relaxed);
+
+        if (code == CAMERA3_MSG_ERROR_REQUEST && m_flushing.load(memory_order_acquire))
+            m_flushErroredRequests.fetch_add(1, memory_order_relaxed);
+
+        frame = FindFrame(msg->message.error.frame_number);
+
+        /* The vendor will not send metadata for a failed request or result */
+        if (frame && (code == CAMERA3_MSG_ERROR_REQUEST || code == CAMERA3_MSG_ERROR_RESULT)) {
+            Retire(frame, msg->message.error.frame_number, 0, 0, true, event);
+            event->metadataDone = false;
+        }
+    }
+
+    if (!frame)
+        return false;
+
+    event->requestNs = frame->requestNs.load(memory_order_relaxed);
+    return true;
+}
+
+bool RequestTracker::OnResult(const camera3_capture_result_t* result, FrameEvent* event) {
+    event->now = GetTimestamp();
+    event->metadataDone = false;
+    event->complete = false;
+
+    if (result->result)
+        m_partials.fetch_add(1, memory_order_relaxed);
+
+    if (result->num_output_buffers) {
+        m_buffersInFlight.fetch_sub(result->num_output_buffers, memory_order_relaxed);
+
+        if (m_flushing.load(memory_order_acquire)) {
+            for (uint32_t i = 0; i < result->num_output_buffers; i++) {
+                if (result->output_buffers[i].status == CAMERA3_BUFFER_STATUS_ERROR)
+                    m_flushErroredBuffers.fetch_add(1, memory_order_relaxed);
+            }
+        }
+    }
+
+    CountStraggler(result->frame_number);
+
+    FrameSlot* frame = FindFrame(result->frame_number);
+    if (!frame) {
+        m_untracked.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+
+    event->requestNs = frame->requestNs.load(memory_order_relaxed);
+    Retire(frame, result->frame_number, result->result ? 1 : 0, result->num_output_buffers, false,
+            event);
+
+    return true;
+}
+
+void RequestTracker::Dump(int fd) const {
+    dprintf(fd, "  %llu requests, %u in flight (max %u), %u buffers in flight (max %u)\n",
+            (unsigned long long)m_requests.load(memory_order_relaxed),
+            m_inFlight.load(memory_order_relaxed), m_inFlightMax.load(memory_order_relaxed),
+            m_buffersInFlight.load(memory_order_relaxed),
+            m_buffersInFlightMax.load(memory_order_relaxed));
+    dprintf(fd, "  %llu partial results, %llu results for untracked frames\n",
+            (unsigned long long)m_partials.load(memory_order_relaxed),
+            (unsigned long long)m_untracked.load(memory_order_relaxed));
+
+    dprintf(fd, "  errors:");
+    for (int i = 1; i < CAMERA3_MSG_NUM_ERRORS; i++)
+        dprintf(fd, " %s %llu", sErrorNames[i],
+                (unsigned long long)m_errors[i].load(memory_order_relaxed));
+    dprintf(fd, "\n");
+
+    dprintf(fd, "  %llu flushes draining %llu requests, %llu requests and %llu buffers returned as errors\n",
+            (unsigned long long)m_flushes.load(memory_order_relaxed),
+            (unsigned long long)m_flushInFlight.load(memory_order_relaxed),
+            (unsigned long long)m_flushErroredRequests.load(memory_order_relaxed),
+            (unsigned long long)m_flushErroredBuffers.load(memory_order_relaxed));
+    dprintf(fd, "  %llu requests still in flight after flush, %llu straggling results\n",
+            (unsigned long long)m_flushUndrained.load(memory_order_relaxed),
+            (unsigned long long)m_stragglers.load(memory_order_relaxed));
+    m_flushDuration.Dump(fd, "flush");
+}
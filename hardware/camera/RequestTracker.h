@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _REQUEST_TRACKER_H
+#define _REQUEST_TRACKER_H
+
+#include <atomic>
+#include <stdint.h>
+#include <hardware/camera3.h>
+
+#include "LatencyHistogram.h"
+
+/* Frames tracked at once, must be a power of two */
+#define RT_FRAME_SLOTS      64
+
+/* What a result or notify did to the frame it belongs to */
+struct FrameEvent {
+    long long requestNs;
+    long long now;
+
+    /* The last metadata partial arrived, or the vendor said none will */
+    bool metadataDone;
+
+    /* Every buffer and metadata partial of the frame is back */
+    bool complete;
+};
+
+class RequestTracker {
+public:
+    RequestTracker();
+
+    /* Number of partial metadata results the vendor sends per frame */
+    void Init(uint32_t partialResultCount);
+    void Reset();
+
+    /* Framework thread */
+    void OnRequest(const camera3_capture_request_t* request);
+    void OnRequestFailed(uint32_t frameNumber);
+    void BeginFlush();
+    void EndFlush();
+
+    /* Vendor result threads, return false for frames that are not tracked */
+    bool OnNotify(const camera3_notify_msg_t* msg, FrameEvent* event);
+    bool OnResult(const camera3_capture_result_t* result, FrameEvent* event);
+
+    uint32_t InFlight() const { return m_inFlight.load(std::memory_order_relaxed); }
+
+    static long long GetTimestamp();
+
+    void Dump(int fd) const;
+
+private:
+    RequestTracker(const RequestTracker&);
+    RequestTracker& operator=(const RequestTracker&);
+
+    struct FrameSlot {
+        std::atomic<long long> requestNs;
+
+        /*
+         * Frame number in the upper 32 bits, outstanding metadata partials and buffers
+         * in the lower 32, so a retire can never hit a later frame that reused the slot
+         */
+        std::atomic<uint64_t> state;
+    };
+
+    FrameSlot* FindFrame(uint32_t frameNumber);
+    void Retire(FrameSlot* frame, uint32_t frameNumber, uint32_t metadata, uint32_t buffers,
+            bool noMoreMetadata, FrameEvent* event);
+    void CountStraggler(uint32_t frameNumber);
+
+    uint32_t m_partialCount;
+
+    FrameSlot m_frames[RT_FRAME_SLOTS];
+
+    std::atomic<uint32_t> m_inFlight;
+    std::atomic<uint32_t> m_inFlightMax;
+    std::atomic<uint32_t> m_buffersInFlight;
+    std::atomic<uint32_t> m_buffersInFlightMax;
+    std::atomic<uint32_t> m_nextFrame;
+    std::atomic<uint64_t> m_requests;
+    std::atomic<uint64_t> m_partials;
+    std::atomic<uint64_t> m_untracked;
+    std::atomic<uint64_t> m_errors[CAMERA3_MSG_NUM_ERRORS];
+
+    /* Flush in progress, and the frame numbers it has to drain */
+    std::atomic<bool> m_flushing;
+    std::atomic<uint32_t> m_flushBoundary;
+    long long m_flushStart;
+
+    LatencyHistogram m_flushDuration;
+    std::atomic<uint64_t> m_flushes;
+    std::atomic<uint64_t> m_flushInFlight;
+    std::atomic<uint64_t> m_flushErroredRequests;
+    std::atomic<uint64_t> m_flushErroredBuffers;
+    std::atomic<uint64_t> m_flushUndrained;
+    std::atomic<uint64_t> m_stragglers;
+};
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Stream configuration fingerprints for the HAL3 configure_streams path.
+ *
+ * Switching between photo and video mode makes the framework reconfigure with a
+ * stream set it used seconds before, and the vendor tears down and rebuilds its
+ * whole pipeline every time. Each configuration is fingerprinted by the size,
+ * format, usage, rotation and data space of its streams and the operation mode,
+ * and the configure latency is recorded per fingerprint.
+ *
+ * With fast reconfigure enabled, a configuration that matches the one the vendor
+ * is already running, down to the very same stream objects, does not reach the
+ * vendor at all. The fields the vendor filled in last time are restored instead.
+ */
+
+#define LOG_NDEBUG 1
+#define LOG_TAG "Camera3WrapperStreamConfig"
+
+#include "StreamConfigCache.h"
+#include <cutils/log.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+static uint64_t fnv_add(uint64_t hash, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+#define FNV_ADD(hash, value) ({ \
+    __typeof__(value) __v = (value); \
+    fnv_add(hash, &__v, sizeof(__v)); \
+})
+
+StreamConfigCache::StreamConfigCache() : m_fastReconfigure(false), m_activeValid(false),
+        m_activeFingerprint(0), m_activeNumStreams(0), m_nextStats(0) {
+    pthread_mutex_init(&m_lock, NULL);
+    memset(m_active, 0, sizeof(m_active));
+    memset(m_stats, 0, sizeof(m_stats));
+}
+
+StreamConfigCache::~StreamConfigCache() {
+    pthread_mutex_destroy(&m_lock);
+}
+
+void StreamConfigCache::SetFastReconfigure(bool enable) {
+    pthread_mutex_lock(&m_lock);
+    m_fastReconfigure = enable;
+    pthread_mutex_unlock(&m_lock);
+}
+
+uint64_t StreamConfigCache::Fingerprint(const camera3_stream_configuration_t* streamList) {
+    uint64_t hash = FNV_OFFSET;
+
+    hash = FNV_ADD(hash, streamList->num_streams);
+    hash = FNV_ADD(hash, streamList->operation_mode);
+
+    for (uint32_t i = 0; i < streamList->num_streams; i++) {
+        const camera3_stream_t* stream = streamList->streams[i];
+
+        hash = FNV_ADD(hash, stream->stream_type);
+        hash = FNV_ADD(hash, stream->width);
+        hash = FNV_ADD(hash, stream->height);
+        hash = FNV_ADD(hash, stream->format);
+        hash = FNV_ADD(hash, stream->usage);
+        hash = FNV_ADD(hash, stream->rotation);
+        hash = FNV_ADD(hash, stream->data_space);
+    }
+
+    /* Session parameters can change how the vendor sets up the pipeline */
+    if (streamList->session_parameters) {
+        hash = fnv_add(hash, streamList->session_parameters,
+                get_camera_metadata_size(streamList->session_parameters));
+    }
+
+    return hash;
+}
+
+StreamConfigCache::FingerprintStats* StreamConfigCache::FindStats(uint64_t fingerprint,
+        uint32_t numStreams) {
+    for (int i = 0; i < SC_MAX_FINGERPRINTS; i++) {
+        if (m_stats[i].configures + m_stats[i].reused && m_stats[i].fingerprint == fingerprint)
+            return &m_stats[i];
+    }
+
+    /* Recycle the slots round robin */
+    FingerprintStats* stats = &m_stats[m_nextStats];
+    m_nextStats = (m_nextStats + 1) % SC_MAX_FINGERPRINTS;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->fingerprint = fingerprint;
+    stats->numStreams = numStreams;
+
+    return stats;
+}
+
+bool StreamConfigCache::TryReuse(camera3_stream_configuration_t* streamList,
+        uint64_t fingerprint) {
+    bool reuse = false;
+
+    pthread_mutex_lock(&m_lock);
+
+    if (!m_fastReconfigure || !m_activeValid || m_activeFingerprint != fingerprint ||
+            m_activeNumStreams != streamList->num_streams)
+        goto done;
+
+    /* The vendor keys its stream state on the stream objects, they must be the same */
+    for (uint32_t i = 0; i < streamList->num_streams; i++) {
+        if (streamList->streams[i] != m_active[i].stream)
+            goto done;
+    }
+
+    for (uint32_t i = 0; i < streamList->num_streams; i++) {
+        camera3_stream_t* stream = streamList->streams[i];
+
+        stream->usage = m_active[i].usage;
+        stream->max_buffers = m_active[i].maxBuffers;
+        stream->priv = m_active[i].priv;
+    }
+
+    FindStats(fingerprint, streamList->num_streams)->reused++;
+    reuse = true;
+
+    ALOGV("%s: reusing active configuration %016llx", __FUNCTION__,
+            (unsigned long long)fingerprint);
+
+done:
+    pthread_mutex_unlock(&m_lock);
+    return reuse;
+}
+
+void StreamConfigCache::OnConfigured(const camera3_stream_configuration_t* streamList,
+        uint64_t fingerprint, int ret, long long ns) {
+    pthread_mutex_lock(&m_lock);
+
+    FingerprintStats* stats = FindStats(fingerprint, streamList->num_streams);
+    stats->configures++;
+    stats->totalNs += ns;
+    stats->lastNs = ns;
+    if (ns > stats->maxNs)
+        stats->maxNs = ns;
+
+    /* A failed configure leaves the vendor without a usable configuration */
+    m_activeValid = !ret && streamList->num_streams <= SC_MAX_STREAMS;
+    if (m_activeValid) {
+        m_activeFingerprint = fingerprint;
+        m_activeNumStreams = streamList->num_streams;
+
+        for (uint32_t i = 0; i < streamList->num_streams; i++) {
+            camera3_stream_t* stream = streamList->streams[i];
+
+            m_active[i].stream = stream;
+            m_active[i].usage = stream->usage;
+            m_active[i].maxBuffers = stream->max_buffers;
+            m_active[i].priv = stream->priv;
+        }
+    }
+
+    pthread_mutex_unlock(&m_lock);
+}
+
+void StreamConfigCache::Dump(int fd) {
+    pthread_mutex_lock(&m_lock);
+
+    dprintf(fd, "  stream configurations, fast reconfigure %s, active %016llx%s:\n",
+            m_fastReconfigure ? "on" : "off", (unsigned long long)m_activeFingerprint,
+            m_activeValid ? "" : " (invalid)");
+
+    for (int i = 0; i < SC_MAX_FINGERPRINTS; i++) {
+        const FingerprintStats& stats = m_stats[i];
+
+        if (!stats.configures && !stats.reused)
+            continue;
+
+        dprintf(fd, "    %016llx %u streams: %llu configures avg %lld uS max %lld uS last %lld uS, %llu reused\n",
+                (unsigned long long)stats.fingerprint, stats.numStreams,
+                (unsigned long long)stats.configures,
+                stats.configures ? stats.totalNs / (long long)stats.configures / 1000 : 0,
+                stats.maxNs / 1000, stats.lastNs / 1000, (unsigned long long)stats.reused);
+    }
+
+    pthread_mutex_unlock(&m_lock);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _STREAM_CONFIG_CACHE_H
+#define _STREAM_CONFIG_CACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <hardware/camera3.h>
+
+/* Streams of the active configuration that can be restored without the vendor */
+#define SC_MAX_STREAMS          16
+
+/* Distinct stream configurations we keep configure latency for */
+#define SC_MAX_FINGERPRINTS     8
+
+class StreamConfigCache {
+public:
+    StreamConfigCache();
+    ~StreamConfigCache();
+
+    /* Allows configure_streams to skip the vendor for an unchanged configuration */
+    void SetFastReconfigure(bool enable);
+
+    /* Identifies a configuration by what the framework asks for, not by stream pointers */
+    static uint64_t Fingerprint(const camera3_stream_configuration_t* streamList);
+
+    /* Returns true and fills in the vendor's stream fields if the active configuration matches */
+    bool TryReuse(camera3_stream_configuration_t* streamList, uint64_t fingerprint);
+
+    /* Records a vendor configure_streams call */
+    void OnConfigured(const camera3_stream_configuration_t* streamList, uint64_t fingerprint,
+            int ret, long long ns);
+
+    void Dump(int fd);
+
+private:
+    StreamConfigCache(const StreamConfigCache&);
+    StreamConfigCache& operator=(const StreamConfigCache&);
+
+    /* What the vendor filled into a stream of the active configuration */
+    struct ActiveStream {
+        camera3_stream_t* stream;
+        uint32_t usage;
+        uint32_t maxBuffers;
+        void* priv;
+    };
+
+    struct FingerprintStats {
+        uint64_t fingerprint;
+        uint32_t numStreams;
+        uint64_t configures;
+        uint64_t reused;
+        long long totalNs;
+        long long maxNs;
+        long long lastNs;
+    };
+
+    FingerprintStats* FindStats(uint64_t fingerprint, uint32_t numStreams);
+
+    pthread_mutex_t m_lock;
+    bool m_fastReconfigure;
+
+    /* The configuration the vendor currently runs, if it is valid */
+    bool m_activeValid;
+    uint64_t m_activeFingerprint;
+    uint32_t m_activeNumStreams;
+    ActiveStream m_active[SC_MAX_STREAMS];
+
+    FingerprintStats m_stats[SC_MAX_FINGERPRINTS];
+    uint32_t m_nextStats;
+};
+
+#endif
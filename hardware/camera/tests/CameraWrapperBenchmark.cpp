@@ -0,0 +1,579 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Drives the camera wrapper on top of FakeVendorCamera, the way cameraserver
+ * would, and reports what reached the client:
+ *
+ *   HAL1  preview frames and focus notifies, emit to client callback latency
+ *   HAL3  shutters and results, request to result latency
+ *
+ * along with throughput, drops, the longest stop and close, and the vendor
+ * calls that ran into the device lock. --direct takes the wrapper out to
+ * compare against the bare vendor. The exit status is 1 if a deadlock was
+ * detected and 2 if the benchmark itself hung.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "../CallbackStats.h"
+#include "FakeVendorCamera.h"
+
+extern camera_module_t HAL_MODULE_INFO_SYM;
+
+/* Frames whose request time is kept for the HAL3 latency, a power of two */
+#define BENCH_FRAME_SLOTS   256
+
+/* How long stop, flush and close get before the benchmark counts itself as hung */
+#define BENCH_HANG_SECONDS  30
+
+struct bench_options {
+    int hal;
+    bool direct;
+    int seconds;
+    int clientUs;
+    int reentrantEvery;
+    bool dump;
+    fake_vendor_config vendor;
+};
+
+struct bench_memory {
+    camera_memory_t mem;
+    size_t bufSize;
+};
+
+/* Client side state, written from the callback threads */
+struct bench_client {
+    const bench_options *options;
+    camera_device_t *dev1;
+    camera3_device_t *dev3;
+
+    pthread_mutex_t lock;
+    std::vector<long long> latencies;
+
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> notifies;
+    std::atomic<uint64_t> shutters;
+    std::atomic<uint64_t> results;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> callbacks;
+    std::atomic<uint64_t> reentrant;
+    std::atomic<uint64_t> reentrantFailed;
+    std::atomic<long long> reentrantMaxNs;
+
+    std::atomic<long long> requestNs[BENCH_FRAME_SLOTS];
+};
+
+static bench_client gClient;
+
+static void bench_on_hang(int sig __unused)
+{
+    static const char msg[] = "benchmark hung, the wrapper or the vendor deadlocked\n";
+    write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    _exit(2);
+}
+
+static void bench_update_max(std::atomic<long long> &max, long long value)
+{
+    long long cur = max.load(std::memory_order_relaxed);
+    while (value > cur && !max.compare_exchange_weak(cur, value))
+        ;
+}
+
+static void bench_record(long long latency)
+{
+    pthread_mutex_lock(&gClient.lock);
+    gClient.latencies.push_back(latency);
+    pthread_mutex_unlock(&gClient.lock);
+}
+
+/* Client work done in every callback, and every reentrantEvery one calls back into the camera */
+static void bench_client_work()
+{
+    const bench_options *options = gClient.options;
+    uint64_t n = ++gClient.callbacks;
+
+    if (options->clientUs > 0)
+        usleep(options->clientUs);
+
+    if (options->reentrantEvery <= 0 || n % options->reentrantEvery)
+        return;
+
+    long long start = fake_vendor_timestamp();
+    bool ok;
+
+    if (gClient.dev1)
+        ok = gClient.dev1->ops->msg_type_enabled(gClient.dev1, CAMERA_MSG_PREVIEW_FRAME);
+    else
+        ok = gClient.dev3->ops->construct_default_request_settings(gClient.dev3,
+                CAMERA3_TEMPLATE_PREVIEW) != NULL;
+
+    gClient.reentrant++;
+    if (!ok)
+        gClient.reentrantFailed++;
+    bench_update_max(gClient.reentrantMaxNs, fake_vendor_timestamp() - start);
+}
+
+/*******************************************************************
+ * HAL1 client
+ *******************************************************************/
+
+static void bench_release_memory(camera_memory_t *mem)
+{
+    free(mem->data);
+    delete (bench_memory *)mem;
+}
+
+static camera_memory_t *bench_get_memory(int fd __unused, size_t buf_size, unsigned int num_bufs,
+        void *user __unused)
+{
+    bench_memory *memory = new bench_memory();
+
+    memory->mem.data = calloc(num_bufs, buf_size);
+    memory->mem.size = buf_size * num_bufs;
+    memory->mem.handle = NULL;
+    memory->mem.release = bench_release_memory;
+    memory->bufSize = buf_size;
+
+    if (!memory->mem.data) {
+        delete memory;
+        return NULL;
+    }
+
+    return &memory->mem;
+}
+
+static void bench_notify(int32_t msg_type, int32_t ext1 __unused, int32_t ext2, void *user __unused)
+{
+    long long emit = fake_vendor_emit_time(ext2);
+
+    if (msg_type == CAMERA_MSG_FOCUS_MOVE || msg_type == CAMERA_MSG_FOCUS) {
+        gClient.notifies++;
+        if (emit)
+            bench_record(fake_vendor_timestamp() - emit);
+    }
+
+    bench_client_work();
+}
+
+static void bench_data(int32_t msg_type, const camera_memory_t *data, unsigned int index,
+        camera_frame_metadata_t *metadata __unused, void *user __unused)
+{
+    if (msg_type == CAMERA_MSG_PREVIEW_FRAME && data) {
+        const bench_memory *memory = (const bench_memory *)data;
+        const fake_vendor_frame *frame = (const fake_vendor_frame *)
+                ((const char *)data->data + index * memory->bufSize);
+
+        gClient.frames++;
+        bench_record(fake_vendor_timestamp() - frame->emitNs);
+    }
+
+    bench_client_work();
+}
+
+static int bench_hal1(const bench_options *options, camera_module_t *module,
+        struct camera_wrapper_cb_stats *stats, long long *stopNs)
+{
+    hw_device_t *device = NULL;
+
+    int rv = module->open_legacy(&module->common, "0", CAMERA_DEVICE_API_VERSION_1_0, &device);
+    if (rv) {
+        fprintf(stderr, "open_legacy failed: %d\n", rv);
+        return rv;
+    }
+
+    camera_device_t *dev = (camera_device_t *)device;
+    gClient.dev1 = dev;
+
+    dev->ops->set_callbacks(dev, bench_notify, bench_data, NULL, bench_get_memory, &gClient);
+    dev->ops->enable_msg_type(dev, CAMERA_MSG_PREVIEW_FRAME | CAMERA_MSG_FOCUS |
+            CAMERA_MSG_FOCUS_MOVE);
+
+    rv = dev->ops->start_preview(dev);
+    if (rv) {
+        fprintf(stderr, "start_preview failed: %d\n", rv);
+        dev->common.close(device);
+        return rv;
+    }
+
+    /* Poll the parameters like an app does, and focus once a second */
+    long long end = fake_vendor_timestamp() + options->seconds * 1000000000LL;
+    for (int tick = 0; fake_vendor_timestamp() < end; tick++) {
+        char *params = dev->ops->get_parameters(dev);
+        if (params) {
+            dev->ops->set_parameters(dev, params);
+            dev->ops->put_parameters(dev, params);
+        }
+
+        if (tick % 10 == 0)
+            dev->ops->auto_focus(dev);
+
+        usleep(100000);
+    }
+
+    alarm(BENCH_HANG_SECONDS);
+
+    long long start = fake_vendor_timestamp();
+    dev->ops->stop_preview(dev);
+    *stopNs = fake_vendor_timestamp() - start;
+
+    if (!options->direct)
+        camera_wrapper_get_cb_stats(0, stats);
+    if (options->dump)
+        dev->ops->dump(dev, STDOUT_FILENO);
+
+    start = fake_vendor_timestamp();
+    dev->common.close(device);
+    *stopNs = std::max(*stopNs, fake_vendor_timestamp() - start);
+    gClient.dev1 = NULL;
+
+    alarm(0);
+
+    return 0;
+}
+
+/*******************************************************************
+ * HAL3 client
+ *******************************************************************/
+
+static void bench_process_capture_result(const camera3_callback_ops_t *ops __unused,
+        const camera3_capture_result_t *result)
+{
+    if (result->num_output_buffers) {
+        long long requested = gClient.requestNs[result->frame_number % BENCH_FRAME_SLOTS];
+
+        gClient.results++;
+        if (result->output_buffers[0].status == CAMERA3_BUFFER_STATUS_OK)
+            bench_record(fake_vendor_timestamp() - requested);
+    }
+
+    bench_client_work();
+}
+
+static void bench_notify3(const camera3_callback_ops_t *ops __unused, const camera3_notify_msg_t *msg)
+{
+    if (msg->type == CAMERA3_MSG_SHUTTER)
+        gClient.shutters++;
+    else
+        gClient.errors++;
+}
+
+static camera3_callback_ops_t sBenchCallbackOps = {
+    .process_capture_result = bench_process_capture_result,
+    .notify = bench_notify3,
+};
+
+static int bench_hal3(const bench_options *options, camera_module_t *module, long long *stopNs,
+        uint64_t *requests)
+{
+    hw_device_t *device = NULL;
+
+    int rv = module->common.methods->open(&module->common, "0", &device);
+    if (rv) {
+        fprintf(stderr, "open failed: %d\n", rv);
+        return rv;
+    }
+
+    camera3_device_t *dev = (camera3_device_t *)device;
+    gClient.dev3 = dev;
+
+    camera3_stream_t stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.stream_type = CAMERA3_STREAM_OUTPUT;
+    stream.width = 1920;
+    stream.height = 1080;
+    stream.format = HAL_PIXEL_FORMAT_YCBCR_420_888;
+
+    camera3_stream_t *streams[] = { &stream };
+    camera3_stream_configuration_t config;
+    memset(&config, 0, sizeof(config));
+    config.num_streams = 1;
+    config.streams = streams;
+    config.operation_mode = CAMERA3_STREAM_CONFIGURATION_NORMAL_MODE;
+
+    const camera_metadata_t *settings = NULL;
+
+    rv = dev->ops->initialize(dev, &sBenchCallbackOps);
+    if (!rv)
+        rv = dev->ops->configure_streams(dev, &config);
+    if (!rv) {
+        settings = dev->ops->construct_default_request_settings(dev, CAMERA3_TEMPLATE_PREVIEW);
+        if (!settings)
+            rv = -EINVAL;
+    }
+    if (rv) {
+        fprintf(stderr, "stream setup failed: %d\n", rv);
+        dev->common.close(device);
+        return rv;
+    }
+
+    /* The framework thread, it blocks in process_capture_request while the pipeline is full */
+    static int handles[BENCH_FRAME_SLOTS];
+    static buffer_handle_t buffers[BENCH_FRAME_SLOTS];
+    long long end = fake_vendor_timestamp() + options->seconds * 1000000000LL;
+    uint32_t frame = 0;
+
+    while (fake_vendor_timestamp() < end) {
+        uint32_t slot = frame % BENCH_FRAME_SLOTS;
+        buffers[slot] = (buffer_handle_t)&handles[slot];
+
+        camera3_stream_buffer_t buffer;
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.stream = &stream;
+        buffer.buffer = &buffers[slot];
+        buffer.status = CAMERA3_BUFFER_STATUS_OK;
+        buffer.acquire_fence = -1;
+        buffer.release_fence = -1;
+
+        camera3_capture_request_t request;
+        memset(&request, 0, sizeof(request));
+        request.frame_number = frame;
+        request.settings = frame ? NULL : settings;
+        request.num_output_buffers = 1;
+        request.output_buffers = &buffer;
+
+        gClient.requestNs[slot] = fake_vendor_timestamp();
+        rv = dev->ops->process_capture_request(dev, &request);
+        if (rv) {
+            fprintf(stderr, "process_capture_request %u failed: %d\n", frame, rv);
+            break;
+        }
+        frame++;
+    }
+    *requests = frame;
+
+    alarm(BENCH_HANG_SECONDS);
+
+    long long start = fake_vendor_timestamp();
+    dev->ops->flush(dev);
+    *stopNs = fake_vendor_timestamp() - start;
+
+    if (options->dump)
+        dev->ops->dump(dev, STDOUT_FILENO);
+
+    start = fake_vendor_timestamp();
+    dev->common.close(device);
+    *stopNs = std::max(*stopNs, fake_vendor_timestamp() - start);
+    gClient.dev3 = NULL;
+
+    alarm(0);
+
+    return 0;
+}
+
+/*******************************************************************
+ * Report
+ *******************************************************************/
+
+static long long bench_percentile(const std::vector<long long> &sorted, int percentile)
+{
+    if (sorted.empty())
+        return 0;
+
+    size_t index = (sorted.size() - 1) * percentile / 100;
+    return sorted[index];
+}
+
+static void bench_report(const bench_options *options, const struct camera_wrapper_cb_stats *stats,
+        long long elapsedNs, long long stopNs, uint64_t requests)
+{
+    fake_vendor_stats vendor;
+    fake_vendor_get_stats(&vendor);
+
+    pthread_mutex_lock(&gClient.lock);
+    std::vector<long long> sorted(gClient.latencies);
+    pthread_mutex_unlock(&gClient.lock);
+    std::sort(sorted.begin(), sorted.end());
+
+    double seconds = elapsedNs / 1e9;
+
+    printf("hal%d %s, %.1f s at %d fps, jitter %d uS, burst %d every %d\n", options->hal,
+            options->direct ? "direct" : "wrapped", seconds, options->vendor.fps,
+            options->vendor.jitterUs, options->vendor.burst, options->vendor.burstEvery);
+
+    if (options->hal == 1) {
+        uint64_t delivered = gClient.frames + gClient.notifies;
+        uint64_t emitted = vendor.frames + vendor.notifies;
+
+        printf("  emitted %llu frames, %llu notifies\n",
+                (unsigned long long)vendor.frames, (unsigned long long)vendor.notifies);
+        printf("  delivered %llu frames, %llu notifies, %.1f callbacks/s\n",
+                (unsigned long long)gClient.frames.load(), (unsigned long long)gClient.notifies.load(),
+                delivered / seconds);
+        printf("  dropped %llu", (unsigned long long)(emitted - std::min(emitted, delivered)));
+        if (!options->direct) {
+            uint64_t drops[CB_STATS_DROP_REASONS] = {};
+            for (int t = 0; t < CB_STATS_TYPES; t++)
+                for (int r = 0; r < CB_STATS_DROP_REASONS; r++)
+                    drops[r] += stats->types[t].drops[r];
+            printf(" (stale %llu, superseded %llu, cleared %llu, overflow %llu, stuck %llu, recycled %llu)",
+                    (unsigned long long)drops[CB_STATS_DROP_STALE],
+                    (unsigned long long)drops[CB_STATS_DROP_SUPERSEDED],
+                    (unsigned long long)drops[CB_STATS_DROP_CLEARED],
+                    (unsigned long long)drops[CB_STATS_DROP_OVERFLOW],
+                    (unsigned long long)drops[CB_STATS_DROP_STUCK],
+                    (unsigned long long)drops[CB_STATS_DROP_RECYCLED]);
+            printf(", %llu spilled, %llu producer stalls %llu uS", (unsigned long long)stats->spilled,
+                    (unsigned long long)stats->stalls, (unsigned long long)stats->stall_us);
+        }
+        printf("\n");
+        printf("  emit to callback latency");
+    } else {
+        printf("  requested %llu, %llu shutters, %llu results, %.1f results/s, %llu errors, %llu lost\n",
+                (unsigned long long)requests, (unsigned long long)gClient.shutters.load(),
+                (unsigned long long)gClient.results.load(), gClient.results / seconds,
+                (unsigned long long)gClient.errors.load(),
+                (unsigned long long)(requests - std::min<uint64_t>(requests, gClient.results)));
+        printf("  request to result latency");
+    }
+
+    printf(" uS: p50 %lld, p90 %lld, p99 %lld, max %lld\n",
+            bench_percentile(sorted, 50) / 1000, bench_percentile(sorted, 90) / 1000,
+            bench_percentile(sorted, 99) / 1000, sorted.empty() ? 0 : sorted.back() / 1000);
+
+    printf("  reentrant calls %llu, %llu failed, longest %lld uS\n",
+            (unsigned long long)gClient.reentrant.load(),
+            (unsigned long long)gClient.reentrantFailed.load(), gClient.reentrantMaxNs.load() / 1000);
+    printf("  longest stop/close %lld mS, longest vendor lock wait %lld mS\n", stopNs / 1000000,
+            vendor.lockWaitMaxNs / 1000000);
+    printf("  deadlocks %llu\n", (unsigned long long)vendor.deadlocks);
+}
+
+/*******************************************************************
+ * main
+ *******************************************************************/
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --hal 1|3              HAL1 preview callbacks (default) or HAL3 results\n"
+            "  --direct               drive the fake vendor without the wrapper\n"
+            "  --seconds N            run time, default 5\n"
+            "  --fps N                frames per second, default 30\n"
+            "  --jitter-us N          random delay of up to N uS per frame\n"
+            "  --burst N              send N frames back to back ...\n"
+            "  --burst-every N        ... every N frames\n"
+            "  --focus-every N        a focus notify every N preview frames, 0 for none\n"
+            "  --pipeline N           HAL3 requests in flight in the vendor\n"
+            "  --client-us N          time the client spends in each callback\n"
+            "  --reentrant-every N    every Nth callback calls back into the camera\n"
+            "  --no-callback-lock     the vendor sends callbacks without holding its lock\n"
+            "  --join-under-lock      the vendor joins its callback thread under its lock\n"
+            "  --lock-timeout-ms N    vendor lock wait counted as a deadlock, default 1000\n"
+            "  --dump                 dump the camera state at the end\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longOptions[] = {
+        { "hal", required_argument, NULL, 'h' },
+        { "direct", no_argument, NULL, 'd' },
+        { "seconds", required_argument, NULL, 's' },
+        { "fps", required_argument, NULL, 'f' },
+        { "jitter-us", required_argument, NULL, 'j' },
+        { "burst", required_argument, NULL, 'b' },
+        { "burst-every", required_argument, NULL, 'B' },
+        { "focus-every", required_argument, NULL, 'F' },
+        { "pipeline", required_argument, NULL, 'p' },
+        { "client-us", required_argument, NULL, 'c' },
+        { "reentrant-every", required_argument, NULL, 'r' },
+        { "no-callback-lock", no_argument, NULL, 'n' },
+        { "join-under-lock", no_argument, NULL, 'J' },
+        { "lock-timeout-ms", required_argument, NULL, 't' },
+        { "dump", no_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    bench_options options;
+    memset(&options, 0, sizeof(options));
+    options.hal = 1;
+    options.seconds = 5;
+    fake_vendor_default_config(&options.vendor);
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h': options.hal = atoi(optarg); break;
+        case 'd': options.direct = true; break;
+        case 's': options.seconds = atoi(optarg); break;
+        case 'f': options.vendor.fps = atoi(optarg); break;
+        case 'j': options.vendor.jitterUs = atoi(optarg); break;
+        case 'b': options.vendor.burst = atoi(optarg); break;
+        case 'B': options.vendor.burstEvery = atoi(optarg); break;
+        case 'F': options.vendor.focusEvery = atoi(optarg); break;
+        case 'p': options.vendor.pipelineDepth = atoi(optarg); break;
+        case 'c': options.clientUs = atoi(optarg); break;
+        case 'r': options.reentrantEvery = atoi(optarg); break;
+        case 'n': options.vendor.callbackUnderLock = false; break;
+        case 'J': options.vendor.joinUnderLock = true; break;
+        case 't': options.vendor.lockTimeoutMs = atoi(optarg); break;
+        case 'D': options.dump = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((options.hal != 1 && options.hal != 3) || options.seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fake_vendor_configure(&options.vendor);
+
+    gClient.options = &options;
+    pthread_mutex_init(&gClient.lock, NULL);
+    gClient.latencies.reserve((size_t)options.seconds * options.vendor.fps * 2 + 1024);
+
+    signal(SIGALRM, bench_on_hang);
+
+    camera_module_t *module = options.direct ? &gFakeVendorModule : &HAL_MODULE_INFO_SYM;
+    if (module->init)
+        module->init();
+
+    struct camera_wrapper_cb_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    long long stopNs = 0;
+    uint64_t requests = 0;
+    long long start = fake_vendor_timestamp();
+    int rv;
+
+    if (options.hal == 1)
+        rv = bench_hal1(&options, module, &stats, &stopNs);
+    else
+        rv = bench_hal3(&options, module, &stopNs, &requests);
+
+    if (rv)
+        return 1;
+
+    bench_report(&options, &stats, fake_vendor_timestamp() - start, stopNs, requests);
+
+    fake_vendor_stats vendor;
+    fake_vendor_get_stats(&vendor);
+
+    return vendor.deadlocks || gClient.reentrantFailed ? 1 : 0;
+}
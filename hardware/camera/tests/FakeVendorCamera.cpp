@@ -0,0 +1,963 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A stand-in for the Exynos camera HAL that runs on a plain Linux host.
+ *
+ * It only produces callbacks: HAL1 cameras stream preview frames and focus
+ * notifies, HAL3 cameras return a shutter and a result for every request. The
+ * pacing, jitter and bursts come from fake_vendor_config. Like the real HAL it
+ * can send callbacks while holding its device lock and join its callback
+ * thread under that lock, the patterns that deadlock a client calling back
+ * into the HAL. The device lock is only ever taken with a timeout, a call that
+ * runs into it is counted as a deadlock instead of hanging the benchmark.
+ */
+
+#define LOG_TAG "FakeVendorCamera"
+#include <cutils/log.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "FakeVendorCamera.h"
+
+/* Preview buffer size, a 640x480 NV21 frame */
+#define FAKE_VENDOR_FRAME_SIZE      (640 * 480 * 3 / 2)
+
+/* Upper bound of pipelineDepth */
+#define FAKE_VENDOR_MAX_PIPELINE    16
+
+/* Output buffers per HAL3 request the vendor keeps */
+#define FAKE_VENDOR_MAX_BUFFERS     4
+
+/* An auto focus completes this long after it was started */
+#define FAKE_VENDOR_FOCUS_MS        100
+
+/* Slice the device lock is waited for in while a thread may be asked to stop */
+#define FAKE_VENDOR_LOCK_SLICE_MS   10
+
+static const char sDefaultParams[] =
+        "preview-size=1920x1080;"
+        "preview-size-values=1920x1080,1440x1080,1280x720,960x720,640x480;"
+        "preview-format=yuv420sp;"
+        "video-size=1920x1080;"
+        "video-size-values=3840x2160,1920x1080,1280x720,640x480;"
+        "focus-mode=auto;"
+        "focus-mode-values=auto,infinity,macro,continuous-video,continuous-picture;"
+        "zoom=0;max-zoom=80;zoom-supported=true";
+
+static fake_vendor_config gConfig = {
+    .fps = 30,
+    .jitterUs = 2000,
+    .burst = 0,
+    .burstEvery = 0,
+    .focusEvery = 15,
+    .callbackUnderLock = true,
+    .joinUnderLock = false,
+    .lockTimeoutMs = 1000,
+    .pipelineDepth = 4,
+};
+static pthread_mutex_t gConfigLock = PTHREAD_MUTEX_INITIALIZER;
+
+static std::atomic<uint64_t> gFrames(0);
+static std::atomic<uint64_t> gNotifies(0);
+static std::atomic<uint64_t> gResults(0);
+static std::atomic<uint64_t> gDeadlocks(0);
+static std::atomic<long long> gLockWaitMaxNs(0);
+static std::atomic<long long> gEmitNs[FAKE_VENDOR_EMIT_SLOTS];
+
+static const camera_module_callbacks_t *gModuleCallbacks = NULL;
+
+long long fake_vendor_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long fake_vendor_emit_time(uint32_t seq)
+{
+    return gEmitNs[seq & (FAKE_VENDOR_EMIT_SLOTS - 1)].load(std::memory_order_acquire);
+}
+
+void fake_vendor_default_config(struct fake_vendor_config *config)
+{
+    pthread_mutex_lock(&gConfigLock);
+    *config = gConfig;
+    pthread_mutex_unlock(&gConfigLock);
+}
+
+void fake_vendor_configure(const struct fake_vendor_config *config)
+{
+    pthread_mutex_lock(&gConfigLock);
+    gConfig = *config;
+    if (gConfig.fps <= 0)
+        gConfig.fps = 30;
+    if (gConfig.pipelineDepth <= 0 || gConfig.pipelineDepth > FAKE_VENDOR_MAX_PIPELINE)
+        gConfig.pipelineDepth = FAKE_VENDOR_MAX_PIPELINE;
+    pthread_mutex_unlock(&gConfigLock);
+}
+
+void fake_vendor_get_stats(struct fake_vendor_stats *stats)
+{
+    stats->frames = gFrames.load();
+    stats->notifies = gNotifies.load();
+    stats->results = gResults.load();
+    stats->deadlocks = gDeadlocks.load();
+    stats->lockWaitMaxNs = gLockWaitMaxNs.load();
+}
+
+/*******************************************************************
+ * Device lock and pacing
+ *******************************************************************/
+
+/*
+ * Takes the device lock. Gives up once stop turns false, or counts a deadlock
+ * after lockTimeoutMs. Returns true with the lock held.
+ */
+static bool fake_lock(pthread_mutex_t *lock, const fake_vendor_config *config,
+        const std::atomic<bool> *stop, const char *what)
+{
+    long long start = fake_vendor_timestamp();
+    long long timeout = config->lockTimeoutMs * 1000000LL;
+
+    for (;;) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += FAKE_VENDOR_LOCK_SLICE_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        int rv = pthread_mutex_timedlock(lock, &deadline);
+        long long waited = fake_vendor_timestamp() - start;
+
+        long long max = gLockWaitMaxNs.load(std::memory_order_relaxed);
+        while (waited > max && !gLockWaitMaxNs.compare_exchange_weak(max, waited))
+            ;
+
+        if (!rv)
+            return true;
+
+        if (stop && !stop->load(std::memory_order_acquire))
+            return false;
+
+        if (waited >= timeout) {
+            ALOGE("%s: device lock not released after %lld mS, deadlock", what, waited / 1000000);
+            gDeadlocks++;
+            return false;
+        }
+    }
+}
+
+struct fake_pacer {
+    long long next;
+    uint64_t frame;
+    unsigned int seed;
+};
+
+static void fake_pacer_init(fake_pacer *pacer, unsigned int seed)
+{
+    pacer->next = fake_vendor_timestamp();
+    pacer->frame = 0;
+    pacer->seed = seed;
+}
+
+/* Sleeps until the next frame is due, returns the number of frames to send back to back */
+static int fake_pace(fake_pacer *pacer, const fake_vendor_config *config)
+{
+    pacer->frame++;
+
+    if (config->burst > 0 && config->burstEvery > 0 && pacer->frame % config->burstEvery == 0) {
+        pacer->next = fake_vendor_timestamp();
+        return config->burst;
+    }
+
+    pacer->next += 1000000000LL / config->fps;
+
+    long long due = pacer->next;
+    if (config->jitterUs > 0)
+        due += (rand_r(&pacer->seed) % config->jitterUs) * 1000LL;
+
+    long long now = fake_vendor_timestamp();
+    if (due > now) {
+        struct timespec ts;
+        ts.tv_sec = (due - now) / 1000000000LL;
+        ts.tv_nsec = (due - now) % 1000000000LL;
+        nanosleep(&ts, NULL);
+    } else if (now - pacer->next > 1000000000LL) {
+        /* Too far behind to catch up, most likely stalled by the client */
+        pacer->next = now;
+    }
+
+    return 1;
+}
+
+/*******************************************************************
+ * HAL1 camera
+ *******************************************************************/
+
+typedef struct fake_camera1 {
+    camera_device_t base;
+    int id;
+    fake_vendor_config config;
+
+    pthread_mutex_t lock;
+    camera_notify_callback notify;
+    camera_data_callback data;
+    camera_request_memory get_memory;
+    void *user;
+    std::atomic<int32_t> msgs;
+    char *params;
+
+    camera_memory_t *heap;
+    uint32_t seq;
+
+    /* Auto focus due time, 0 while none runs */
+    std::atomic<long long> focusDue;
+
+    pthread_t thread;
+    std::atomic<bool> running;
+    bool started;
+} fake_camera1_t;
+
+#define FAKE1(device) ((fake_camera1_t *)(device))
+
+static void fake1_emit(fake_camera1_t *dev)
+{
+    int32_t msgs = dev->msgs.load(std::memory_order_relaxed);
+    uint32_t seq = dev->seq++;
+    unsigned int index = seq % FAKE_VENDOR_PREVIEW_BUFS;
+
+    if (dev->heap && dev->data && (msgs & CAMERA_MSG_PREVIEW_FRAME)) {
+        fake_vendor_frame *frame = (fake_vendor_frame *)
+                ((char *)dev->heap->data + index * FAKE_VENDOR_FRAME_SIZE);
+        frame->seq = seq;
+        frame->emitNs = fake_vendor_timestamp();
+
+        gFrames++;
+        dev->data(CAMERA_MSG_PREVIEW_FRAME, dev->heap, index, NULL, dev->user);
+    }
+
+    if (dev->notify && (msgs & CAMERA_MSG_FOCUS_MOVE) &&
+            dev->config.focusEvery > 0 && seq % dev->config.focusEvery == 0) {
+        gEmitNs[seq & (FAKE_VENDOR_EMIT_SLOTS - 1)].store(fake_vendor_timestamp(),
+                std::memory_order_release);
+
+        gNotifies++;
+        dev->notify(CAMERA_MSG_FOCUS_MOVE, seq & 1, seq, dev->user);
+    }
+
+    long long due = dev->focusDue.load(std::memory_order_relaxed);
+    if (due && fake_vendor_timestamp() >= due &&
+            dev->focusDue.compare_exchange_strong(due, 0) &&
+            dev->notify && (msgs & CAMERA_MSG_FOCUS)) {
+        gEmitNs[seq & (FAKE_VENDOR_EMIT_SLOTS - 1)].store(fake_vendor_timestamp(),
+                std::memory_order_release);
+
+        gNotifies++;
+        dev->notify(CAMERA_MSG_FOCUS, 1, seq, dev->user);
+    }
+}
+
+static void *fake1_preview_thread(void *arg)
+{
+    fake_camera1_t *dev = (fake_camera1_t *)arg;
+    fake_pacer pacer;
+
+    fake_pacer_init(&pacer, dev->id + 1);
+
+    while (dev->running.load(std::memory_order_acquire)) {
+        int frames = fake_pace(&pacer, &dev->config);
+
+        for (int i = 0; i < frames && dev->running.load(std::memory_order_acquire); i++) {
+            if (!dev->config.callbackUnderLock) {
+                fake1_emit(dev);
+                continue;
+            }
+
+            if (!fake_lock(&dev->lock, &dev->config, &dev->running, "preview"))
+                continue;
+            fake1_emit(dev);
+            pthread_mutex_unlock(&dev->lock);
+        }
+    }
+
+    return NULL;
+}
+
+static int fake1_set_preview_window(struct camera_device *device __unused,
+        struct preview_stream_ops *window __unused)
+{
+    return 0;
+}
+
+static void fake1_set_callbacks(struct camera_device *device, camera_notify_callback notify_cb,
+        camera_data_callback data_cb, camera_data_timestamp_callback data_cb_timestamp __unused,
+        camera_request_memory get_memory, void *user)
+{
+    fake_camera1_t *dev = FAKE1(device);
+
+    if (!fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__))
+        return;
+    dev->notify = notify_cb;
+    dev->data = data_cb;
+    dev->get_memory = get_memory;
+    dev->user = user;
+    pthread_mutex_unlock(&dev->lock);
+}
+
+static void fake1_enable_msg_type(struct camera_device *device, int32_t msg_type)
+{
+    FAKE1(device)->msgs |= msg_type;
+}
+
+static void fake1_disable_msg_type(struct camera_device *device, int32_t msg_type)
+{
+    FAKE1(device)->msgs &= ~msg_type;
+}
+
+static int fake1_msg_type_enabled(struct camera_device *device, int32_t msg_type)
+{
+    fake_camera1_t *dev = FAKE1(device);
+
+    /* Like the vendor HAL, this takes the device lock */
+    if (!fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__))
+        return 0;
+    int enabled = (dev->msgs & msg_type) == msg_type;
+    pthread_mutex_unlock(&dev->lock);
+
+    return enabled;
+}
+
+static int fake1_start_preview(struct camera_device *device)
+{
+    fake_camera1_t *dev = FAKE1(device);
+    int rv = 0;
+
+    if (!fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__))
+        return -ETIMEDOUT;
+
+    if (dev->started)
+        goto done;
+
+    if (!dev->heap && dev->get_memory) {
+        dev->heap = dev->get_memory(-1, FAKE_VENDOR_FRAME_SIZE, FAKE_VENDOR_PREVIEW_BUFS,
+                dev->user);
+        if (!dev->heap) {
+            rv = -ENOMEM;
+            goto done;
+        }
+    }
+
+    dev->running = true;
+    if (pthread_create(&dev->thread, NULL, fake1_preview_thread, dev)) {
+        dev->running = false;
+        rv = -errno;
+        goto done;
+    }
+    dev->started = true;
+
+done:
+    pthread_mutex_unlock(&dev->lock);
+    return rv;
+}
+
+static void fake1_stop_preview(struct camera_device *device)
+{
+    fake_camera1_t *dev = FAKE1(device);
+
+    if (!dev->config.joinUnderLock) {
+        if (!dev->started)
+            return;
+        dev->running = false;
+        pthread_join(dev->thread, NULL);
+        dev->started = false;
+        return;
+    }
+
+    /* The preview thread may be blocked on this lock, or in a callback that waits for it */
+    bool locked = fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__);
+    if (dev->started) {
+        dev->running = false;
+        pthread_join(dev->thread, NULL);
+        dev->started = false;
+    }
+    if (locked)
+        pthread_mutex_unlock(&dev->lock);
+}
+
+static int fake1_preview_enabled(struct camera_device *device)
+{
+    return FAKE1(device)->running.load();
+}
+
+static int fake1_store_meta_data_in_buffers(struct camera_device *device __unused,
+        int enable __unused)
+{
+    return 0;
+}
+
+static int fake1_start_recording(struct camera_device *device __unused)
+{
+    return 0;
+}
+
+static void fake1_stop_recording(struct camera_device *device __unused)
+{
+}
+
+static int fake1_recording_enabled(struct camera_device *device __unused)
+{
+    return 0;
+}
+
+static void fake1_release_recording_frame(struct camera_device *device __unused,
+        const void *opaque __unused)
+{
+}
+
+static int fake1_auto_focus(struct camera_device *device)
+{
+    FAKE1(device)->focusDue = fake_vendor_timestamp() + FAKE_VENDOR_FOCUS_MS * 1000000LL;
+    return 0;
+}
+
+static int fake1_cancel_auto_focus(struct camera_device *device)
+{
+    if (!FAKE1(device)->config.focusAfterCancel)
+        FAKE1(device)->focusDue = 0;
+    return 0;
+}
+
+static int fake1_take_picture(struct camera_device *device __unused)
+{
+    return 0;
+}
+
+static int fake1_cancel_picture(struct camera_device *device __unused)
+{
+    return 0;
+}
+
+static int fake1_set_parameters(struct camera_device *device, const char *params)
+{
+    fake_camera1_t *dev = FAKE1(device);
+    char *copy = params ? strdup(params) : NULL;
+
+    if (!copy)
+        return -EINVAL;
+
+    if (!fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__)) {
+        free(copy);
+        return -ETIMEDOUT;
+    }
+    free(dev->params);
+    dev->params = copy;
+    pthread_mutex_unlock(&dev->lock);
+
+    return 0;
+}
+
+static char *fake1_get_parameters(struct camera_device *device)
+{
+    fake_camera1_t *dev = FAKE1(device);
+
+    if (!fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__))
+        return NULL;
+    char *params = strdup(dev->params);
+    pthread_mutex_unlock(&dev->lock);
+
+    return params;
+}
+
+static void fake1_put_parameters(struct camera_device *device __unused, char *params)
+{
+    free(params);
+}
+
+static int fake1_send_command(struct camera_device *device __unused, int32_t cmd __unused,
+        int32_t arg1 __unused, int32_t arg2 __unused)
+{
+    return 0;
+}
+
+static void fake1_release(struct camera_device *device __unused)
+{
+}
+
+static int fake1_dump(struct camera_device *device, int fd)
+{
+    fake_vendor_stats stats;
+
+    fake_vendor_get_stats(&stats);
+    dprintf(fd, "FakeVendorCamera camera %d: %llu frames, %llu notifies, %llu deadlocks, "
+            "longest lock wait %lld uS\n", FAKE1(device)->id,
+            (unsigned long long)stats.frames, (unsigned long long)stats.notifies,
+            (unsigned long long)stats.deadlocks, stats.lockWaitMaxNs / 1000);
+
+    return 0;
+}
+
+static camera_device_ops_t sFake1Ops = {
+    .set_preview_window = fake1_set_preview_window,
+    .set_callbacks = fake1_set_callbacks,
+    .enable_msg_type = fake1_enable_msg_type,
+    .disable_msg_type = fake1_disable_msg_type,
+    .msg_type_enabled = fake1_msg_type_enabled,
+    .start_preview = fake1_start_preview,
+    .stop_preview = fake1_stop_preview,
+    .preview_enabled = fake1_preview_enabled,
+    .store_meta_data_in_buffers = fake1_store_meta_data_in_buffers,
+    .start_recording = fake1_start_recording,
+    .stop_recording = fake1_stop_recording,
+    .recording_enabled = fake1_recording_enabled,
+    .release_recording_frame = fake1_release_recording_frame,
+    .auto_focus = fake1_auto_focus,
+    .cancel_auto_focus = fake1_cancel_auto_focus,
+    .take_picture = fake1_take_picture,
+    .cancel_picture = fake1_cancel_picture,
+    .set_parameters = fake1_set_parameters,
+    .get_parameters = fake1_get_parameters,
+    .put_parameters = fake1_put_parameters,
+    .send_command = fake1_send_command,
+    .release = fake1_release,
+    .dump = fake1_dump,
+};
+
+static int fake1_close(hw_device_t *device)
+{
+    fake_camera1_t *dev = (fake_camera1_t *)device;
+
+    fake1_stop_preview(&dev->base);
+
+    if (dev->heap)
+        dev->heap->release(dev->heap);
+    free(dev->params);
+    pthread_mutex_destroy(&dev->lock);
+    delete dev;
+
+    return 0;
+}
+
+static int fake1_open(const hw_module_t *module, int id, hw_device_t **device)
+{
+    fake_camera1_t *dev = new fake_camera1_t();
+
+    dev->base.common.tag = HARDWARE_DEVICE_TAG;
+    dev->base.common.version = CAMERA_DEVICE_API_VERSION_1_0;
+    dev->base.common.module = (hw_module_t *)module;
+    dev->base.common.close = fake1_close;
+    dev->base.ops = &sFake1Ops;
+    dev->id = id;
+    fake_vendor_default_config(&dev->config);
+    pthread_mutex_init(&dev->lock, NULL);
+    dev->params = strdup(sDefaultParams);
+
+    *device = &dev->base.common;
+    return 0;
+}
+
+/*******************************************************************
+ * HAL3 camera
+ *******************************************************************/
+
+typedef struct fake_request {
+    uint32_t frameNumber;
+    uint32_t numBuffers;
+    camera3_stream_buffer_t buffers[FAKE_VENDOR_MAX_BUFFERS];
+} fake_request_t;
+
+typedef struct fake_camera3 {
+    camera3_device_t base;
+    int id;
+    fake_vendor_config config;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const camera3_callback_ops_t *ops;
+    camera_metadata_t *templates[CAMERA3_TEMPLATE_COUNT];
+    camera_metadata_t *result;
+
+    /* Requests waiting for their result, a ring of pipelineDepth */
+    fake_request_t queue[FAKE_VENDOR_MAX_PIPELINE];
+    uint32_t head;
+    uint32_t count;
+
+    pthread_t thread;
+    std::atomic<bool> running;
+    bool started;
+} fake_camera3_t;
+
+#define FAKE3(device) ((fake_camera3_t *)(device))
+
+static void fake3_complete(fake_camera3_t *dev, fake_request_t *request, bool error)
+{
+    camera3_notify_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    if (error) {
+        msg.type = CAMERA3_MSG_ERROR;
+        msg.message.error.frame_number = request->frameNumber;
+        msg.message.error.error_code = CAMERA3_MSG_ERROR_REQUEST;
+    } else {
+        msg.type = CAMERA3_MSG_SHUTTER;
+        msg.message.shutter.frame_number = request->frameNumber;
+        msg.message.shutter.timestamp = fake_vendor_timestamp();
+    }
+    dev->ops->notify(dev->ops, &msg);
+
+    for (uint32_t i = 0; i < request->numBuffers; i++) {
+        request->buffers[i].status = error ? CAMERA3_BUFFER_STATUS_ERROR : CAMERA3_BUFFER_STATUS_OK;
+        request->buffers[i].acquire_fence = -1;
+        request->buffers[i].release_fence = -1;
+    }
+
+    camera3_capture_result_t result;
+    memset(&result, 0, sizeof(result));
+    result.frame_number = request->frameNumber;
+    result.result = error ? NULL : dev->result;
+    result.num_output_buffers = request->numBuffers;
+    result.output_buffers = request->buffers;
+    result.partial_result = error ? 0 : 1;
+
+    gResults++;
+    dev->ops->process_capture_result(dev->ops, &result);
+}
+
+static void *fake3_result_thread(void *arg)
+{
+    fake_camera3_t *dev = (fake_camera3_t *)arg;
+    fake_pacer pacer;
+
+    fake_pacer_init(&pacer, dev->id + 1);
+
+    while (dev->running.load(std::memory_order_acquire)) {
+        int frames = fake_pace(&pacer, &dev->config);
+
+        for (int i = 0; i < frames && dev->running.load(std::memory_order_acquire); i++) {
+            if (!fake_lock(&dev->lock, &dev->config, &dev->running, "result"))
+                continue;
+
+            if (!dev->count) {
+                pthread_mutex_unlock(&dev->lock);
+                continue;
+            }
+
+            fake_request_t request = dev->queue[dev->head];
+            dev->head = (dev->head + 1) % dev->config.pipelineDepth;
+            dev->count--;
+            pthread_cond_broadcast(&dev->cond);
+
+            if (dev->config.callbackUnderLock) {
+                fake3_complete(dev, &request, false);
+                pthread_mutex_unlock(&dev->lock);
+            } else {
+                pthread_mutex_unlock(&dev->lock);
+                fake3_complete(dev, &request, false);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int fake3_initialize(const camera3_device_t *device, const camera3_callback_ops_t *callback_ops)
+{
+    fake_camera3_t *dev = FAKE3(device);
+
+    dev->ops = callback_ops;
+    dev->running = true;
+    if (pthread_create(&dev->thread, NULL, fake3_result_thread, dev)) {
+        dev->running = false;
+        return -errno;
+    }
+    dev->started = true;
+
+    return 0;
+}
+
+static int fake3_configure_streams(const camera3_device_t *device,
+        camera3_stream_configuration_t *stream_list)
+{
+    fake_camera3_t *dev = FAKE3(device);
+
+    if (!stream_list || !stream_list->num_streams)
+        return -EINVAL;
+
+    if (!fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__))
+        return -ETIMEDOUT;
+    for (uint32_t i = 0; i < stream_list->num_streams; i++)
+        stream_list->streams[i]->max_buffers = dev->config.pipelineDepth + 2;
+    pthread_mutex_unlock(&dev->lock);
+
+    return 0;
+}
+
+static const camera_metadata_t *fake3_construct_default_request_settings(
+        const camera3_device_t *device, int type)
+{
+    fake_camera3_t *dev = FAKE3(device);
+
+    if (type <= 0 || type >= CAMERA3_TEMPLATE_COUNT)
+        return NULL;
+
+    /* Like the vendor HAL, this takes the device lock */
+    if (!fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__))
+        return NULL;
+    if (!dev->templates[type])
+        dev->templates[type] = allocate_camera_metadata(8, 64);
+    const camera_metadata_t *settings = dev->templates[type];
+    pthread_mutex_unlock(&dev->lock);
+
+    return settings;
+}
+
+static int fake3_process_capture_request(const camera3_device_t *device,
+        camera3_capture_request_t *request)
+{
+    fake_camera3_t *dev = FAKE3(device);
+
+    if (!request || request->num_output_buffers > FAKE_VENDOR_MAX_BUFFERS)
+        return -EINVAL;
+
+    if (!fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__))
+        return -ETIMEDOUT;
+
+    /* Block the framework while the pipeline is full */
+    while (dev->count == (uint32_t)dev->config.pipelineDepth && dev->running)
+        pthread_cond_wait(&dev->cond, &dev->lock);
+
+    fake_request_t *slot = &dev->queue[(dev->head + dev->count) % dev->config.pipelineDepth];
+    slot->frameNumber = request->frame_number;
+    slot->numBuffers = request->num_output_buffers;
+    memcpy(slot->buffers, request->output_buffers,
+            request->num_output_buffers * sizeof(camera3_stream_buffer_t));
+    dev->count++;
+
+    pthread_mutex_unlock(&dev->lock);
+
+    return 0;
+}
+
+static void fake3_get_metadata_vendor_tag_ops(const camera3_device_t *device __unused,
+        vendor_tag_query_ops_t *ops __unused)
+{
+}
+
+static void fake3_dump(const camera3_device_t *device, int fd)
+{
+    fake_vendor_stats stats;
+
+    fake_vendor_get_stats(&stats);
+    dprintf(fd, "FakeVendorCamera camera %d: %llu results, %llu deadlocks, "
+            "longest lock wait %lld uS\n", FAKE3(device)->id,
+            (unsigned long long)stats.results, (unsigned long long)stats.deadlocks,
+            stats.lockWaitMaxNs / 1000);
+}
+
+static int fake3_flush(const camera3_device_t *device)
+{
+    fake_camera3_t *dev = FAKE3(device);
+
+    if (!fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__))
+        return -ETIMEDOUT;
+
+    while (dev->count) {
+        fake_request_t request = dev->queue[dev->head];
+        dev->head = (dev->head + 1) % dev->config.pipelineDepth;
+        dev->count--;
+        fake3_complete(dev, &request, true);
+    }
+    pthread_cond_broadcast(&dev->cond);
+
+    pthread_mutex_unlock(&dev->lock);
+
+    return 0;
+}
+
+static camera3_device_ops_t sFake3Ops = {
+    .initialize = fake3_initialize,
+    .configure_streams = fake3_configure_streams,
+    .register_stream_buffers = NULL,
+    .construct_default_request_settings = fake3_construct_default_request_settings,
+    .process_capture_request = fake3_process_capture_request,
+    .get_metadata_vendor_tag_ops = fake3_get_metadata_vendor_tag_ops,
+    .dump = fake3_dump,
+    .flush = fake3_flush,
+};
+
+static int fake3_close(hw_device_t *device)
+{
+    fake_camera3_t *dev = (fake_camera3_t *)device;
+
+    if (dev->started) {
+        bool locked = !dev->config.joinUnderLock ||
+                fake_lock(&dev->lock, &dev->config, NULL, __FUNCTION__);
+
+        dev->running = false;
+        pthread_cond_broadcast(&dev->cond);
+        pthread_join(dev->thread, NULL);
+
+        if (dev->config.joinUnderLock && locked)
+            pthread_mutex_unlock(&dev->lock);
+    }
+
+    for (int i = 0; i < CAMERA3_TEMPLATE_COUNT; i++)
+        if (dev->templates[i])
+            free_camera_metadata(dev->templates[i]);
+    free_camera_metadata(dev->result);
+    pthread_cond_destroy(&dev->cond);
+    pthread_mutex_destroy(&dev->lock);
+    delete dev;
+
+    return 0;
+}
+
+static int fake3_open(const hw_module_t *module, int id, hw_device_t **device)
+{
+    fake_camera3_t *dev = new fake_camera3_t();
+
+    dev->base.common.tag = HARDWARE_DEVICE_TAG;
+    dev->base.common.version = CAMERA_DEVICE_API_VERSION_3_4;
+    dev->base.common.module = (hw_module_t *)module;
+    dev->base.common.close = fake3_close;
+    dev->base.ops = &sFake3Ops;
+    dev->id = id;
+    fake_vendor_default_config(&dev->config);
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->cond, NULL);
+    dev->result = allocate_camera_metadata(8, 64);
+
+    *device = &dev->base.common;
+    return 0;
+}
+
+/*******************************************************************
+ * Module
+ *******************************************************************/
+
+static int fake_camera_id(const char *name)
+{
+    if (!name)
+        return -1;
+
+    int id = atoi(name);
+    return id >= 0 && id < FAKE_VENDOR_CAMERAS ? id : -1;
+}
+
+static int fake_module_open(const hw_module_t *module, const char *name, hw_device_t **device)
+{
+    int id = fake_camera_id(name);
+
+    if (id < 0)
+        return -EINVAL;
+
+    return fake3_open(module, id, device);
+}
+
+static int fake_get_number_of_cameras(void)
+{
+    return FAKE_VENDOR_CAMERAS;
+}
+
+static int fake_get_camera_info(int camera_id, struct camera_info *info)
+{
+    if (camera_id < 0 || camera_id >= FAKE_VENDOR_CAMERAS)
+        return -EINVAL;
+
+    memset(info, 0, sizeof(*info));
+    info->facing = camera_id;
+    info->orientation = camera_id ? 270 : 90;
+    info->device_version = CAMERA_DEVICE_API_VERSION_3_4;
+    info->resource_cost = 50;
+
+    return 0;
+}
+
+static int fake_set_callbacks(const camera_module_callbacks_t *callbacks)
+{
+    gModuleCallbacks = callbacks;
+    return 0;
+}
+
+static void fake_get_vendor_tag_ops(vendor_tag_ops_t *ops __unused)
+{
+}
+
+static int fake_open_legacy(const struct hw_module_t *module, const char *name,
+        uint32_t halVersion, struct hw_device_t **device)
+{
+    int id = fake_camera_id(name);
+
+    if (id < 0 || halVersion != CAMERA_DEVICE_API_VERSION_1_0)
+        return -EINVAL;
+
+    return fake1_open(module, id, device);
+}
+
+static int fake_set_torch_mode(const char *camera_id __unused, bool enabled __unused)
+{
+    return -ENOSYS;
+}
+
+static int fake_init()
+{
+    return 0;
+}
+
+static struct hw_module_methods_t sFakeModuleMethods = {
+    .open = fake_module_open,
+};
+
+camera_module_t gFakeVendorModule = {
+    .common = {
+         .tag = HARDWARE_MODULE_TAG,
+         .module_api_version = CAMERA_MODULE_API_VERSION_2_4,
+         .hal_api_version = HARDWARE_HAL_API_VERSION,
+         .id = CAMERA_HARDWARE_MODULE_ID,
+         .name = "Fake Vendor Camera",
+         .author = "The LineageOS Project",
+         .methods = &sFakeModuleMethods,
+         .dso = NULL,
+         .reserved = {0},
+    },
+    .get_number_of_cameras = fake_get_number_of_cameras,
+    .get_camera_info = fake_get_camera_info,
+    .set_callbacks = fake_set_callbacks,
+    .get_vendor_tag_ops = fake_get_vendor_tag_ops,
+    .open_legacy = fake_open_legacy,
+    .set_torch_mode = fake_set_torch_mode,
+    .init = fake_init,
+    .reserved = {0},
+};
+
+/* The wrapper loads the vendor HAL through libhardware, hand it the fake module instead */
+int hw_get_module_by_class(const char *class_id, const char *inst, const hw_module_t **module)
+{
+    if (!class_id || strcmp(class_id, CAMERA_HARDWARE_MODULE_ID) || !inst || strcmp(inst, "vendor"))
+        return -ENOENT;
+
+    *module = &gFakeVendorModule.common;
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _FAKE_VENDOR_CAMERA_H
+#define _FAKE_VENDOR_CAMERA_H
+
+#include <stdint.h>
+
+#include <hardware/camera.h>
+#include <hardware/camera3.h>
+
+/* Number of cameras the fake vendor module reports */
+#define FAKE_VENDOR_CAMERAS     2
+
+/* Buffers of the HAL1 preview heap requested from the client */
+#define FAKE_VENDOR_PREVIEW_BUFS    8
+
+/* Recent notify emit times kept for fake_vendor_emit_time, a power of two */
+#define FAKE_VENDOR_EMIT_SLOTS  1024
+
+/* Head of every HAL1 preview buffer, stamped when the vendor hands it out */
+struct fake_vendor_frame {
+    uint32_t seq;
+    long long emitNs;
+};
+
+struct fake_vendor_config {
+    /* Preview frames resp. HAL3 results per second, and a random delay of up to jitterUs on each */
+    int fps;
+    int jitterUs;
+
+    /* Every burstEvery frames, burst frames are sent back to back */
+    int burst;
+    int burstEvery;
+
+    /* Every focusEvery preview frames a CAMERA_MSG_FOCUS_MOVE notify follows, 0 for none */
+    int focusEvery;
+
+    /* cancel_auto_focus does not stop the report of the auto focus in flight */
+    bool focusAfterCancel;
+
+    /* Callbacks are sent while holding the device lock, as the Exynos HAL does */
+    bool callbackUnderLock;
+
+    /* stop_preview and close join the callback thread while holding the device lock */
+    bool joinUnderLock;
+
+    /* A vendor call that waits longer than this for the device lock counts as a deadlock */
+    int lockTimeoutMs;
+
+    /* HAL3 requests the vendor holds before process_capture_request blocks */
+    int pipelineDepth;
+};
+
+struct fake_vendor_stats {
+    uint64_t frames;
+    uint64_t notifies;
+    uint64_t results;
+
+    /* Vendor calls and callback rounds that gave up on the device lock */
+    uint64_t deadlocks;
+
+    /* Longest wait for the device lock */
+    long long lockWaitMaxNs;
+};
+
+/* Module the wrapper loads in place of the vendor camera HAL */
+extern camera_module_t gFakeVendorModule;
+
+/* Applies to cameras opened afterwards */
+void fake_vendor_configure(const struct fake_vendor_config* config);
+void fake_vendor_default_config(struct fake_vendor_config* config);
+
+void fake_vendor_get_stats(struct fake_vendor_stats* stats);
+
+/* Monotonic clock in nS, the one emit times are taken from */
+long long fake_vendor_timestamp();
+
+/* Emit time of a recent notify, by the sequence number sent in ext2 */
+long long fake_vendor_emit_time(uint32_t seq);
+
+#endif
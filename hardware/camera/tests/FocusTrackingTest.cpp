@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks which CAMERA_MSG_FOCUS reports of the fake vendor reach the client
+ * through the HAL1 wrapper, around cancel_auto_focus.
+ */
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "FakeVendorCamera.h"
+
+extern camera_module_t HAL_MODULE_INFO_SYM;
+
+/* Well past the fake vendor focus time, well before the wrapper focus timeout */
+#define FOCUS_WAIT_US   400000
+
+static std::atomic<int> gFocusReports;
+
+static void focus_release_memory(camera_memory_t *mem)
+{
+    free(mem->data);
+    delete mem;
+}
+
+static camera_memory_t *focus_get_memory(int fd __unused, size_t buf_size, unsigned int num_bufs,
+        void *user __unused)
+{
+    camera_memory_t *mem = new camera_memory_t();
+
+    mem->data = calloc(num_bufs, buf_size);
+    mem->size = buf_size * num_bufs;
+    mem->release = focus_release_memory;
+    return mem;
+}
+
+static void focus_notify(int32_t msg_type, int32_t ext1 __unused, int32_t ext2 __unused,
+        void *user __unused)
+{
+    if (msg_type == CAMERA_MSG_FOCUS)
+        gFocusReports++;
+}
+
+static void focus_data(int32_t msg_type __unused, const camera_memory_t *data __unused,
+        unsigned int index __unused, camera_frame_metadata_t *metadata __unused,
+        void *user __unused)
+{
+}
+
+class FocusTracking : public ::testing::Test {
+protected:
+    FocusTracking() : mDevice(NULL) {}
+
+    void Open(bool focusAfterCancel) {
+        fake_vendor_config config;
+        hw_device_t *device = NULL;
+
+        fake_vendor_default_config(&config);
+        config.focusAfterCancel = focusAfterCancel;
+        fake_vendor_configure(&config);
+
+        ASSERT_EQ(0, HAL_MODULE_INFO_SYM.open_legacy(&HAL_MODULE_INFO_SYM.common, "0",
+                CAMERA_DEVICE_API_VERSION_1_0, &device));
+        mDevice = (camera_device_t *)device;
+
+        mDevice->ops->set_callbacks(mDevice, focus_notify, focus_data, NULL, focus_get_memory,
+                NULL);
+        mDevice->ops->enable_msg_type(mDevice, CAMERA_MSG_PREVIEW_FRAME | CAMERA_MSG_FOCUS);
+        ASSERT_EQ(0, mDevice->ops->start_preview(mDevice));
+        gFocusReports = 0;
+    }
+
+    virtual void TearDown() {
+        if (!mDevice)
+            return;
+
+        mDevice->ops->stop_preview(mDevice);
+        mDevice->common.close(&mDevice->common);
+    }
+
+    camera_device_t *mDevice;
+};
+
+TEST_F(FocusTracking, ReportsAutoFocus) {
+    ASSERT_NO_FATAL_FAILURE(Open(false));
+
+    ASSERT_EQ(0, mDevice->ops->auto_focus(mDevice));
+    usleep(FOCUS_WAIT_US);
+    EXPECT_EQ(1, gFocusReports);
+}
+
+TEST_F(FocusTracking, DropsReportOfCancelledAutoFocus) {
+    ASSERT_NO_FATAL_FAILURE(Open(true));
+
+    ASSERT_EQ(0, mDevice->ops->auto_focus(mDevice));
+    ASSERT_EQ(0, mDevice->ops->cancel_auto_focus(mDevice));
+    usleep(FOCUS_WAIT_US);
+    EXPECT_EQ(0, gFocusReports);
+}
+
+/* The vendor never reports the cancelled auto focus, the report of the new one must get through */
+TEST_F(FocusTracking, ReportsAutoFocusRightAfterCancel) {
+    ASSERT_NO_FATAL_FAILURE(Open(false));
+
+    ASSERT_EQ(0, mDevice->ops->auto_focus(mDevice));
+    ASSERT_EQ(0, mDevice->ops->cancel_auto_focus(mDevice));
+    ASSERT_EQ(0, mDevice->ops->auto_focus(mDevice));
+    usleep(FOCUS_WAIT_US);
+    EXPECT_EQ(1, gFocusReports);
+}
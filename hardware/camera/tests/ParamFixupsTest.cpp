@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2019, The LineageOS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Checks the single pass fixups against the unflatten/set/flatten round trip
+ * through CameraParameters they replaced. DISABLED_Benchmark times both, run it
+ * with --gtest_also_run_disabled_tests.
+ *
+ * libcamera_client is not available on the host, so the round trip is modelled
+ * on CameraParameters: unflatten splits at the first '=' and the next ';', a
+ * repeated key keeps its last value, set() refuses keys and values containing
+ * '=' or ';', and flatten writes the keys sorted. Outputs are compared as
+ * parameter maps since the single pass keeps the vendor's key order.
+ */
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../ParamFixups.h"
+
+typedef std::map<std::string, std::string> ParamMap;
+
+static ParamMap unflatten(const std::string& params) {
+    ParamMap map;
+    const char* a = params.c_str();
+
+    for (;;) {
+        const char* b = strchr(a, '=');
+        if (!b)
+            break;
+
+        std::string key(a, b - a);
+        a = b + 1;
+        b = strchr(a, ';');
+        if (!b) {
+            map[key] = a;
+            break;
+        }
+
+        map[key] = std::string(a, b - a);
+        a = b + 1;
+    }
+
+    return map;
+}
+
+static std::string flatten(const ParamMap& map) {
+    std::string out;
+
+    for (ParamMap::const_iterator it = map.begin(); it != map.end(); ++it) {
+        if (!out.empty())
+            out += ";";
+        out += it->first + "=" + it->second;
+    }
+
+    return out;
+}
+
+static void set(ParamMap* map, const std::string& key, const std::string& value) {
+    if (key.find_first_of("=;") != std::string::npos || value.find_first_of("=;") != std::string::npos)
+        return;
+    (*map)[key] = value;
+}
+
+static std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> entries;
+    size_t pos = 0;
+
+    for (;;) {
+        size_t end = list.find(',', pos);
+        entries.push_back(list.substr(pos, end == std::string::npos ? end : end - pos));
+        if (end == std::string::npos)
+            break;
+        pos = end + 1;
+    }
+
+    return entries;
+}
+
+/* The old per-key fixups, generalized to the rule actions */
+static std::string legacy_fixup(const camera2_param_fixup_t* fixups, size_t count, int id,
+        int direction, const char* settings) {
+    ParamMap params = unflatten(settings);
+
+    for (size_t i = 0; i < count; i++) {
+        const camera2_param_fixup_t& fixup = fixups[i];
+
+        if (!(fixup.direction & direction) ||
+                (fixup.camera_id != FIXUP_ALL_CAMERAS && fixup.camera_id != id))
+            continue;
+
+        if (fixup.action == FIXUP_OVERRIDE) {
+            set(&params, fixup.key, fixup.value);
+        } else if (fixup.action == FIXUP_REMOVE) {
+            params.erase(fixup.key);
+        } else if (params.count(fixup.key)) {
+            std::vector<std::string> allowed = split(fixup.value);
+            std::string filtered;
+
+            for (const std::string& entry : split(params[fixup.key])) {
+                bool listed = false;
+                for (const std::string& a : allowed)
+                    listed |= a == entry;
+                if (!listed)
+                    continue;
+                if (!filtered.empty())
+                    filtered += ",";
+                filtered += entry;
+            }
+            set(&params, fixup.key, filtered);
+        }
+    }
+
+    return flatten(params);
+}
+
+static std::string single_pass(const camera2_param_fixup_t* fixups, size_t count, int id,
+        int direction, const char* settings) {
+    char* fixed = camera2_apply_fixups(fixups, count, id, direction, settings);
+    std::string out(fixed ? fixed : "");
+    free(fixed);
+    return out;
+}
+
+static void expect_same(const camera2_param_fixup_t* fixups, size_t count, int id,
+        int direction, const char* settings) {
+    std::string legacy = legacy_fixup(fixups, count, id, direction, settings);
+    std::string fixed = single_pass(fixups, count, id, direction, settings);
+
+    EXPECT_EQ(unflatten(legacy), unflatten(fixed))
+            << "camera " << id << " direction " << direction << "\n  in:     " << settings
+            << "\n  legacy: " << legacy << "\n  fixed:  " << fixed;
+}
+
+/* Trimmed get_parameters strings of the back and front camera */
+static const char* const sVendorParams[] = {
+    "antibanding=auto;antibanding-values=auto,50hz,60hz,off;auto-exposure-lock=false;"
+    "auto-exposure-lock-supported=true;auto-whitebalance-lock=false;effect=none;"
+    "effect-values=none,mono,negative,sepia,aqua;exposure-compensation=0;"
+    "flash-mode=off;flash-mode-values=off,auto,on,torch;focus-mode=auto;"
+    "focus-mode-values=auto,infinity,macro,continuous-video,continuous-picture;"
+    "jpeg-quality=96;max-zoom=80;picture-format=jpeg;picture-size=4032x3024;"
+    "picture-size-values=4032x3024,4032x2268,3024x3024,2560x1440,1920x1080,640x480;"
+    "preview-format=yuv420sp;preview-fps-range=15000,30000;"
+    "preview-fps-range-values=(4000,30000),(8000,30000),(15000,30000),(30000,30000);"
+    "preview-size=1920x1080;preview-size-values=1920x1080,1440x1080,1280x720,640x480;"
+    "video-size=1920x1080;video-size-values=3840x2160,1920x1080,1280x720,640x480;"
+    "video-stabilization=false;video-stabilization-supported=true;zoom=0;zoom-supported=true",
+
+    "antibanding=auto;effect=none;flash-mode-values=off;focus-mode=fixed;"
+    "focus-mode-values=fixed;picture-size=3264x2448;preview-size=1440x1080;"
+    "preview-size-values=1920x1080,1440x1080,1280x720,640x480;video-size=1920x1080;"
+    "zoom=0;zoom-supported=true",
+
+    "",
+    "zoom=0;",
+    "video-size-values=1920x1080;zoom=1;video-size-values=1280x720",
+};
+
+#define NUM_VENDOR_PARAMS (sizeof(sVendorParams) / sizeof(sVendorParams[0]))
+
+/* Every action, per camera and per direction rules */
+static const camera2_param_fixup_t sTestFixups[] = {
+    { FIXUP_ALL_CAMERAS, FIXUP_GET, FIXUP_OVERRIDE, "video-size-values", "1920x1080,1280x720" },
+    { 0, FIXUP_GET, FIXUP_FILTER, "focus-mode-values", "auto,continuous-picture,fixed" },
+    { 1, FIXUP_GET | FIXUP_SET, FIXUP_REMOVE, "flash-mode-values", NULL },
+    { FIXUP_ALL_CAMERAS, FIXUP_SET, FIXUP_REMOVE, "zoom", NULL },
+    { 1, FIXUP_GET, FIXUP_FILTER, "preview-size-values", "1440x1080,640x480" },
+    { FIXUP_ALL_CAMERAS, FIXUP_GET, FIXUP_OVERRIDE, "iso-values", "auto,100,200,400,800" },
+};
+
+#define NUM_TEST_FIXUPS (sizeof(sTestFixups) / sizeof(sTestFixups[0]))
+
+TEST(ParamFixups, WrapperRulesMatchRoundTrip) {
+    for (size_t i = 0; i < NUM_VENDOR_PARAMS; i++) {
+        for (int id = 0; id < 2; id++) {
+            expect_same(gParamFixups, gNumParamFixups, id, FIXUP_GET, sVendorParams[i]);
+            expect_same(gParamFixups, gNumParamFixups, id, FIXUP_SET, sVendorParams[i]);
+        }
+    }
+}
+
+TEST(ParamFixups, AllActionsMatchRoundTrip) {
+    for (size_t i = 0; i < NUM_VENDOR_PARAMS; i++) {
+        for (int id = 0; id < 3; id++) {
+            expect_same(sTestFixups, NUM_TEST_FIXUPS, id, FIXUP_GET, sVendorParams[i]);
+            expect_same(sTestFixups, NUM_TEST_FIXUPS, id, FIXUP_SET, sVendorParams[i]);
+        }
+    }
+}
+
+TEST(ParamFixups, NeedFixup) {
+    EXPECT_TRUE(camera2_need_fixup(gParamFixups, gNumParamFixups, 0, FIXUP_GET));
+    EXPECT_FALSE(camera2_need_fixup(gParamFixups, gNumParamFixups, 0, FIXUP_SET));
+    EXPECT_TRUE(camera2_need_fixup(sTestFixups, NUM_TEST_FIXUPS, 2, FIXUP_SET));
+}
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* A timing loop rather than a test, skipped unless disabled tests are asked for */
+TEST(ParamFixups, DISABLED_Benchmark) {
+    const int iterations = 20000;
+    size_t sink = 0;
+
+    long long start = now_ns();
+    for (int i = 0; i < iterations; i++)
+        sink += legacy_fixup(gParamFixups, gNumParamFixups, 0, FIXUP_GET, sVendorParams[0]).size();
+    long long legacy = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        char* fixed = camera2_apply_fixups(gParamFixups, gNumParamFixups, 0, FIXUP_GET,
+                sVendorParams[0]);
+        sink += strlen(fixed);
+        free(fixed);
+    }
+    long long single = now_ns() - start;
+
+    printf("round trip %lld nS, single pass %lld nS per get_parameters string (%zu)\n",
+            legacy / iterations, single / iterations, sink);
+}
@@ -15,21 +15,249 @@
  */
 
 #define LOG_TAG "ExynosCameraMemoryAllocator"
+#define ATRACE_TAG ATRACE_TAG_CAMERA
 #include "ExynosCameraMemory.h"
 
+#include <atomic>
+#include <new>
+#include <cutils/properties.h>
+#include <cutils/trace.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <utils/KeyedVector.h>
+#include <utils/Vector.h>
+
 namespace android {
 
 
 gralloc_module_t const *ExynosCameraGrallocAllocator::m_grallocHal;
 gralloc_module_t const *ExynosCameraStreamAllocator::m_grallocHal;
 
+/*
+ * Call timing of gralloc and ION.
+ *
+ * Every call is an ATRACE span, and while persist.vendor.sys.camera.memory.timing
+ * is set its duration also lands in a log2 histogram of its operation. The
+ * property is read at most every MEMORY_TIMING_CHECK_MSEC, so timing can be
+ * switched on and off on a running camera, and switching it on starts the
+ * histograms afresh. exynos_camera_memory_dump() writes them out.
+ */
+#define MEMORY_TIMING_CHECK_MSEC        (1000)
+#define MEMORY_HISTOGRAM_BUCKETS        (24)    /* log2 usec, the last one collects the rest */
+
+enum memory_op {
+    MEMORY_OP_DEQUEUE,
+    MEMORY_OP_ENQUEUE,
+    MEMORY_OP_CANCEL,
+    MEMORY_OP_LOCK_BUFFER,
+    MEMORY_OP_LOCK,
+    MEMORY_OP_LOCK_YCBCR,
+    MEMORY_OP_ION_ALLOC,
+    MEMORY_OP_ION_MAP,
+    MEMORY_OP_ION_FREE,
+    MEMORY_OP_MAX,
+};
+
+static const char *const gMemoryOpNames[MEMORY_OP_MAX] = {
+    "dequeueBuffer",
+    "enqueueBuffer",
+    "cancelBuffer",
+    "lock_buffer",
+    "lock",
+    "lock_ycbcr",
+    "ion alloc",
+    "ion map",
+    "ion free",
+};
+
+struct memory_histogram {
+    uint32_t count;
+    uint32_t buckets[MEMORY_HISTOGRAM_BUCKETS];
+    uint64_t maxUsec;
+};
+
+static Mutex                    gMemoryTimingLock;
+static memory_histogram         gMemoryTiming[MEMORY_OP_MAX];
+static std::atomic<bool>        gMemoryTimingEnabled(false);
+static std::atomic<nsecs_t>     gMemoryTimingChecked(0);
+
+static void memory_histogram_add(memory_histogram *histogram, uint64_t usec)
+{
+    int bucket = 0;
+
+    while (bucket < MEMORY_HISTOGRAM_BUCKETS - 1 && usec >= (2ULL << bucket))
+        bucket++;
+
+    histogram->count++;
+    histogram->buckets[bucket]++;
+    if (usec > histogram->maxUsec)
+        histogram->maxUsec = usec;
+}
+
+/* Upper bound of the bucket the given percentile falls in */
+static uint64_t memory_histogram_percentile(const memory_histogram *histogram, int percent)
+{
+    uint64_t target = ((uint64_t)histogram->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < MEMORY_HISTOGRAM_BUCKETS - 1; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= target)
+            return 2ULL << i;
+    }
+
+    return histogram->maxUsec;
+}
+
+static bool memory_timing_enabled(void)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t checked = gMemoryTimingChecked.load(std::memory_order_relaxed);
+
+    if ((checked == 0 || now - checked >= milliseconds_to_nanoseconds(MEMORY_TIMING_CHECK_MSEC)) &&
+            gMemoryTimingChecked.compare_exchange_strong(checked, now, std::memory_order_relaxed)) {
+        bool enabled = property_get_bool("persist.vendor.sys.camera.memory.timing", false);
+
+        if (enabled == true && gMemoryTimingEnabled.load(std::memory_order_relaxed) == false) {
+            Mutex::Autolock lock(gMemoryTimingLock);
+            memset(gMemoryTiming, 0, sizeof(gMemoryTiming));
+        }
+        gMemoryTimingEnabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    return gMemoryTimingEnabled.load(std::memory_order_relaxed);
+}
+
+/* Returns the start time to hand to memory_op_end(), 0 while timing is off */
+static nsecs_t memory_op_begin(memory_op op)
+{
+    ATRACE_BEGIN(gMemoryOpNames[op]);
+
+    return memory_timing_enabled() == true ? systemTime(SYSTEM_TIME_MONOTONIC) : 0;
+}
+
+static void memory_op_end(memory_op op, nsecs_t start)
+{
+    ATRACE_END();
+
+    if (start == 0)
+        return;
+
+    uint64_t usec = nanoseconds_to_microseconds(systemTime(SYSTEM_TIME_MONOTONIC) - start);
+
+    Mutex::Autolock lock(gMemoryTimingLock);
+    memory_histogram_add(&gMemoryTiming[op], usec);
+}
+
+/* ExynosCameraGraphicBufferAllocator as the vendor library was built against it */
+struct graphic_buffer_allocator_layout {
+    void              *vtable;
+    int                cameraId;
+    int                width;
+    int                height;
+    int                stride;
+    int                halPixelFormat;
+    int                grallocUsage;
+    private_handle_t  *privateHandle[VIDEO_MAX_FRAME];
+    sp<GraphicBuffer>  graphicBuffer[VIDEO_MAX_FRAME];
+    bool               flagGraphicBufferAlloc[VIDEO_MAX_FRAME];
+};
+
+static_assert(sizeof(ExynosCameraGraphicBufferAllocator) <= sizeof(graphic_buffer_allocator_layout),
+        "ExynosCameraGraphicBufferAllocator grew beyond the size the vendor allocates");
+
+/*
+ * One ExynosCameraGraphicBufferAllocator buffer. The handle lives in the slot
+ * itself instead of being allocated per buffer, and up to three planes of the
+ * multi-plane (_M) formats are wrapped in it.
+ *
+ * GraphicBuffers are handed out, so the one wrapping the inline handle may still
+ * be held after the slot is freed. The slot only keeps a weak reference to it to
+ * tell when the handle can be reused.
+ */
+struct ExynosCameraGraphicBufferAllocator::Slot {
+    bool               allocated;
+    sp<GraphicBuffer>  graphicBuffer;
+    wp<GraphicBuffer>  wrapper;
+    union {
+        private_handle_t   privateHandle;
+    };
+
+    Slot() : allocated(false) {}
+    ~Slot() {}
+};
+
+/*
+ * Handle storage that GraphicBuffers still wrap after the allocator let go of it:
+ * the slot chunks of a destroyed allocator and the handles allocated while a slot
+ * was still wrapped. It is released once none of its GraphicBuffers is left.
+ * WRAP_HANDLE buffers never touch their handle on the way out, so the weak
+ * references are enough to tell.
+ */
+struct graphic_buffer_orphan {
+    void               *storage;
+    void              (*release)(void *storage);
+    wp<GraphicBuffer>   wrapper;
+};
+
+static Mutex                            gGraphicBufferOrphanLock;
+static Vector<graphic_buffer_orphan>    gGraphicBufferOrphans;
+
+/* Keeps storage until wrapper is gone, caller holds gGraphicBufferOrphanLock */
+static void graphic_buffer_orphan_add_locked(void *storage, void (*release)(void *storage),
+        const sp<GraphicBuffer> &wrapper)
+{
+    graphic_buffer_orphan orphan;
+
+    orphan.storage = storage;
+    orphan.release = release;
+    orphan.wrapper = wrapper;
+
+    gGraphicBufferOrphans.add(orphan);
+}
+
+/* Releases the storage whose GraphicBuffers are all gone */
+static void graphic_buffer_orphans_sweep(void)
+{
+    Mutex::Autolock lock(gGraphicBufferOrphanLock);
+    size_t i = 0;
+
+    while (i < gGraphicBufferOrphans.size()) {
+        if (gGraphicBufferOrphans[i].wrapper.promote() != 0) {
+            i++;
+            continue;
+        }
+
+        void *storage = gGraphicBufferOrphans[i].storage;
+        void (*release)(void *storage) = gGraphicBufferOrphans[i].release;
+        bool shared = false;
+
+        gGraphicBufferOrphans.removeAt(i);
+
+        for (size_t j = 0; j < gGraphicBufferOrphans.size(); j++) {
+            if (gGraphicBufferOrphans[j].storage == storage) {
+                shared = true;
+                break;
+            }
+        }
+
+        if (shared == false)
+            release(storage);
+    }
+}
+
 ExynosCameraGraphicBufferAllocator::ExynosCameraGraphicBufferAllocator(int cameraId)
 {
     m_cameraId = cameraId;
+
+    m_slotChunks = NULL;
+    m_slotChunkCount = 0;
 }
 
 ExynosCameraGraphicBufferAllocator::~ExynosCameraGraphicBufferAllocator()
 {
+    m_freeSlots();
 }
 
 status_t ExynosCameraGraphicBufferAllocator::init(void)
@@ -40,13 +268,89 @@ status_t ExynosCameraGraphicBufferAllocator::init(void)
     m_halPixelFormat = 0;
     m_grallocUsage = GRALLOC_SET_USAGE_FOR_CAMERA;
 
-    for (int i = 0; i < VIDEO_MAX_FRAME; i++) {
-        m_flagGraphicBufferAlloc[i] = false;
+    /* Keep the chunks, the next configuration allocates the same indexes again */
+    for (int i = 0; i < m_slotChunkCount; i++) {
+        for (int j = 0; m_slotChunks[i] != NULL && j < GRAPHIC_BUFFER_SLOTS_PER_CHUNK; j++) {
+            m_slotChunks[i][j].allocated = false;
+            m_slotChunks[i][j].graphicBuffer = 0;
+        }
     }
 
     return NO_ERROR;
 }
 
+ExynosCameraGraphicBufferAllocator::Slot *ExynosCameraGraphicBufferAllocator::m_getSlot(int index, bool grow)
+{
+    int chunk = index / GRAPHIC_BUFFER_SLOTS_PER_CHUNK;
+
+    if (index < 0 || index >= GRAPHIC_BUFFER_MAX_SLOTS) {
+        ALOGE("ERR(%s[%d]):Buffer index error (%d/%d)",
+            __FUNCTION__, __LINE__, index, GRAPHIC_BUFFER_MAX_SLOTS);
+        return NULL;
+    }
+
+    if (chunk >= m_slotChunkCount) {
+        if (grow == false)
+            return NULL;
+
+        /* Only the chunk table moves, the slots stay where the GraphicBuffers point */
+        Slot **chunks = (Slot **)realloc(m_slotChunks, (chunk + 1) * sizeof(Slot *));
+        if (chunks == NULL) {
+            ALOGE("ERR(%s[%d]):chunk table allocation fail", __FUNCTION__, __LINE__);
+            return NULL;
+        }
+
+        for (int i = m_slotChunkCount; i <= chunk; i++)
+            chunks[i] = NULL;
+
+        m_slotChunks = chunks;
+        m_slotChunkCount = chunk + 1;
+    }
+
+    if (m_slotChunks[chunk] == NULL) {
+        if (grow == false)
+            return NULL;
+
+        m_slotChunks[chunk] = new Slot[GRAPHIC_BUFFER_SLOTS_PER_CHUNK];
+    }
+
+    return &m_slotChunks[chunk][index % GRAPHIC_BUFFER_SLOTS_PER_CHUNK];
+}
+
+void ExynosCameraGraphicBufferAllocator::m_freeSlots(void)
+{
+    graphic_buffer_orphans_sweep();
+
+    for (int i = 0; i < m_slotChunkCount; i++) {
+        Slot *chunk = m_slotChunks[i];
+        bool orphaned = false;
+
+        if (chunk == NULL)
+            continue;
+
+        /* Hand the chunk over if a GraphicBuffer still wraps one of its handles */
+        gGraphicBufferOrphanLock.lock();
+        for (int j = 0; j < GRAPHIC_BUFFER_SLOTS_PER_CHUNK; j++) {
+            chunk[j].graphicBuffer = 0;
+
+            sp<GraphicBuffer> wrapper = chunk[j].wrapper.promote();
+            if (wrapper != 0) {
+                graphic_buffer_orphan_add_locked(chunk,
+                        [](void *storage) { delete[] (Slot *)storage; }, wrapper);
+                orphaned = true;
+            }
+        }
+        gGraphicBufferOrphanLock.unlock();
+
+        if (orphaned == false)
+            delete[] chunk;
+    }
+
+    ::free(m_slotChunks);
+    m_slotChunks = NULL;
+    m_slotChunkCount = 0;
+}
+
 status_t ExynosCameraGraphicBufferAllocator::setSize(int width, int height, int stride)
 {
     m_width  = width;
@@ -91,23 +395,19 @@ int ExynosCameraGraphicBufferAllocator::getGrallocUsage(void)
 
 sp<GraphicBuffer> ExynosCameraGraphicBufferAllocator::alloc(int index, int planeCount, int fdArr[], char *bufAddr[], unsigned int bufSize[])
 {
-    if ((index < 0) || (index >= VIDEO_MAX_FRAME)) {
-        android_printAssert(NULL, LOG_TAG, "ASSERT(%s[%d]):Buffer index error (%d/%d), assert!!!!",
-            __FUNCTION__, __LINE__, index, VIDEO_MAX_FRAME);
-    }
-
     sp<GraphicBuffer> graphicBuffer;
+    Slot *slot = m_getSlot(index, false);
 
-    if (m_flagGraphicBufferAlloc[index] == false) {
+    if (slot == NULL || slot->allocated == false) {
         graphicBuffer = m_alloc(index, planeCount, fdArr, bufAddr, bufSize, m_width, m_height, m_halPixelFormat, m_grallocUsage, m_stride);
         if (graphicBuffer == 0) {
             ALOGE("ERR(%s[%d]):m_alloc() fail", __FUNCTION__, __LINE__);
             goto done;
         }
     } else {
-        graphicBuffer = m_graphicBuffer[index];
+        graphicBuffer = slot->graphicBuffer;
         if (graphicBuffer == 0) {
-            ALOGE("ERR(%s[%d]):m_graphicBuffer[%d] == 0. so, fail", __FUNCTION__, __LINE__, index);
+            ALOGE("ERR(%s[%d]):slot %d has no graphicBuffer. so, fail", __FUNCTION__, __LINE__, index);
             goto done;
         }
     }
@@ -118,15 +418,13 @@ done:
 
 status_t ExynosCameraGraphicBufferAllocator::free(int index)
 {
-    if (m_flagGraphicBufferAlloc[index] == false)
-        return NO_ERROR;
-
-    m_flagGraphicBufferAlloc[index] = false;
+    Slot *slot = m_getSlot(index, false);
 
-    delete m_privateHandle[index];
-    m_privateHandle[index] = NULL;
+    if (slot == NULL || slot->allocated == false)
+        return NO_ERROR;
 
-    m_graphicBuffer[index] = 0;
+    slot->allocated = false;
+    slot->graphicBuffer = 0;
 
     return NO_ERROR;
 }
@@ -142,13 +440,27 @@ sp<GraphicBuffer> ExynosCameraGraphicBufferAllocator::m_alloc(int index,
                                                               int grallocUsage,
                                                               int stride)
 {
-    if (m_flagGraphicBufferAlloc[index] == true) {
+    sp<GraphicBuffer> graphicBuffer;
+    private_handle_t *privateHandle = NULL;
+    void *handleStorage = NULL;
+    bool inlineHandle = true;
+    Slot *slot = m_getSlot(index, true);
+
+    graphic_buffer_orphans_sweep();
+
+    if (slot == NULL) {
+        ALOGE("ERR(%s[%d]):no slot for %d. so, fail!!",
+            __FUNCTION__, __LINE__, index);
+        goto done;
+    }
+
+    if (slot->allocated == true) {
         ALOGE("ERR(%s[%d]):%d is already allocated. so, fail!!",
             __FUNCTION__, __LINE__, index);
         goto done;
     }
 
-    if (planeCount <= 0) {
+    if (planeCount <= 0 || planeCount > GRAPHIC_BUFFER_MAX_PLANES) {
         ALOGE("ERR(%s[%d]):invalid value : planeCount(%d). so, fail!!",
             __FUNCTION__, __LINE__, planeCount);
         goto done;
@@ -160,27 +472,340 @@ sp<GraphicBuffer> ExynosCameraGraphicBufferAllocator::m_alloc(int index,
         goto done;
     }
 
-    if (planeCount == 1) {
-        m_privateHandle[index] = new private_handle_t(fdArr[0], -1, -1, bufSize[0], 0, 0, grallocUsage, width, height,
+    /* The inline handle is taken as long as the GraphicBuffer of an earlier alloc is held */
+    if (slot->wrapper.promote() != 0) {
+        handleStorage = ::operator new(sizeof(private_handle_t), std::nothrow);
+        if (handleStorage == NULL) {
+            ALOGE("ERR(%s[%d]):handle allocation fail for %d", __FUNCTION__, __LINE__, index);
+            goto done;
+        }
+        inlineHandle = false;
+    } else {
+        handleStorage = &slot->privateHandle;
+    }
+
+    /* Each plane of the multi-plane formats is a buffer of its own */
+    privateHandle = new (handleStorage) private_handle_t(
+            fdArr[0],
+            planeCount > 1 ? fdArr[1] : -1,
+            planeCount > 2 ? fdArr[2] : -1,
+            bufSize[0],
+            planeCount > 1 ? bufSize[1] : 0,
+            planeCount > 2 ? bufSize[2] : 0,
+            grallocUsage, width, height,
             halPixelFormat, halPixelFormat, halPixelFormat, width, height, 0);
 
-        m_privateHandle[index]->base = (uint64_t)bufAddr[0];
-        m_privateHandle[index]->offset = 0;
+    privateHandle->base = (uint64_t)bufAddr[0];
+    privateHandle->offset = 0;
+    if (planeCount > 1)
+        privateHandle->base1 = (uint64_t)bufAddr[1];
+    if (planeCount > 2)
+        privateHandle->base2 = (uint64_t)bufAddr[2];
+
+    ALOGV("DEBUG(%s[%d]):new GraphicBuffer(bufAddr(%p), planeCount(%d), width(%d), height(%d), halPixelFormat(%d), grallocUsage(%d), stride(%d), privateHandle[%d](%p), false)",
+            __FUNCTION__, __LINE__, bufAddr[0], planeCount, width, height, halPixelFormat, grallocUsage, stride, index, privateHandle);
+
+    slot->graphicBuffer = new GraphicBuffer((native_handle_t*)privateHandle, GraphicBuffer::WRAP_HANDLE,
+                                            width, height, (PixelFormat)halPixelFormat, 1, (uint64_t)grallocUsage, stride);
+    slot->allocated = true;
+
+    if (inlineHandle == true) {
+        slot->wrapper = slot->graphicBuffer;
     } else {
-        android_printAssert(NULL, LOG_TAG, "ASSERT(%s[%d]):planeCount(%d) is not yet support, assert!!!!",
-            __FUNCTION__, __LINE__, planeCount);
+        Mutex::Autolock lock(gGraphicBufferOrphanLock);
+        graphic_buffer_orphan_add_locked(handleStorage,
+                [](void *storage) {
+                    ((private_handle_t *)storage)->~private_handle_t();
+                    ::operator delete(storage);
+                }, slot->graphicBuffer);
     }
 
-    ALOGV("DEBUG(%s[%d]):new GraphicBuffer(bufAddr(%p), width(%d), height(%d), halPixelFormat(%d), grallocUsage(%d), stride(%d), m_privateHandle[%d](%p), false)",
-            __FUNCTION__, __LINE__, bufAddr[0], width, height, halPixelFormat, grallocUsage, stride, index, m_privateHandle[index]);
+    graphicBuffer = slot->graphicBuffer;
+
+done:
+    return graphicBuffer;
+}
+
+/*
+ * Recycling pool of ION buffers, shared by every ExynosCameraIonAllocator.
+ *
+ * Resolution and mode switches free and allocate the same set of buffers over
+ * and over, each time with a fresh ION allocation, a fresh mmap and the page
+ * faults that come with it. Freed buffers are parked here, still open and mapped,
+ * and handed out again to an alloc with the same heap mask and flags (which
+ * include caching) whose size they fit within ION_POOL_SIZE_SLACK.
+ *
+ * A fresh ION allocation comes zeroed, so a reused buffer is cleared before it
+ * is handed out again and the previous user's frames never leak into the next
+ * one. Only mapped buffers can be cleared from here, so only those are pooled.
+ *
+ * Buffers are tracked from alloc to free by fd together with their mapping.
+ * The fd number alone is not enough, it is reused as soon as a buffer is closed
+ * behind our back, so a free of anything that does not match takes the normal
+ * path. Parked memory is trimmed back to the low watermark when it exceeds the
+ * high one, released after ION_POOL_MAX_IDLE_MSEC unused, and given back
+ * entirely when an ION allocation fails or MemAvailable drops below
+ * ION_POOL_MIN_AVAILABLE_KB.
+ */
+#define ION_POOL_MAX_BUFFERS        (64)
+#define ION_POOL_HIGH_WATERMARK     (96 * 1024 * 1024)
+#define ION_POOL_LOW_WATERMARK      (48 * 1024 * 1024)
+#define ION_POOL_MAX_IDLE_MSEC      (5000)
+#define ION_POOL_PRESSURE_MSEC      (1000)              /* how often MemAvailable is checked */
+#define ION_POOL_MIN_AVAILABLE_KB   (256 * 1024)        /* below it the pool is emptied */
+#define ION_POOL_SIZE_SLACK(size)   ((size) >> 3)     /* reuse buffers up to 1/8 larger */
+
+struct ion_pool_buffer {
+    int          fd;
+    char        *addr;
+    int          size;
+    unsigned int mask;
+    unsigned int flags;
+    nsecs_t      parkedTime;
+};
+
+static Mutex                                 gIonPoolLock;
+static Condition                             gIonPoolCond;
+static Vector<ion_pool_buffer>               gIonPoolLive;
+static Vector<ion_pool_buffer>               gIonPoolParked;
+static size_t                                gIonPoolParkedBytes;
+static bool                                  gIonPoolReaper;
+static uint32_t                              gIonPoolHits;
+static uint32_t                              gIonPoolMisses;
+static uint32_t                              gIonPoolReleased;
+static uint32_t                              gIonPoolStale;
+static uint32_t                              gIonPoolPressureTrims;
+
+static void ion_pool_release_buffer(const ion_pool_buffer *buf)
+{
+    if (munmap(buf->addr, buf->size) < 0)
+        ALOGE("ERR(%s):munmap failed", __FUNCTION__);
+
+#ifdef USE_LIB_ION_LEGACY
+    ion_close(buf->fd);
+#else
+    exynos_ion_close(buf->fd);
+#endif
+}
 
-    m_graphicBuffer[index] = new GraphicBuffer((native_handle_t*)m_privateHandle[index], GraphicBuffer::WRAP_HANDLE,
-                                               width, height, (PixelFormat)halPixelFormat, 1, (uint64_t)grallocUsage, stride);
+/* Releases the oldest parked buffers down to the given bounds, caller holds gIonPoolLock */
+static int ion_pool_trim_locked(size_t maxBytes, size_t maxBuffers, nsecs_t idleBefore)
+{
+    int released = 0;
 
-    m_flagGraphicBufferAlloc[index] = true;
+    while (gIonPoolParked.size() > 0) {
+        const ion_pool_buffer &oldest = gIonPoolParked[0];
 
-done:
-    return m_graphicBuffer[index];
+        if (gIonPoolParkedBytes <= maxBytes && gIonPoolParked.size() <= maxBuffers &&
+                oldest.parkedTime >= idleBefore)
+            break;
+
+        gIonPoolParkedBytes -= oldest.size;
+        ion_pool_release_buffer(&oldest);
+        gIonPoolParked.removeAt(0);
+        released++;
+    }
+
+    if (released > 0) {
+        gIonPoolReleased += released;
+        ALOGD("DEBUG(%s):released %d buffers, %zu parked (%zu KB), hits(%u) misses(%u) released(%u)",
+                __FUNCTION__, released, gIonPoolParked.size(), gIonPoolParkedBytes / 1024,
+                gIonPoolHits, gIonPoolMisses, gIonPoolReleased);
+    }
+
+    return released;
+}
+
+static int ion_pool_trim(size_t maxBytes)
+{
+    Mutex::Autolock lock(gIonPoolLock);
+    int released = ion_pool_trim_locked(maxBytes, ION_POOL_MAX_BUFFERS, 0);
+
+    /* Let the reaper see the pool shrink, it exits once it is empty */
+    if (released > 0)
+        gIonPoolCond.signal();
+
+    return released;
+}
+
+/* Returns MemAvailable of /proc/meminfo in KB, or -1 if it can not be read */
+static long ion_pool_mem_available(void)
+{
+    char line[128];
+    long availableKb = -1;
+    FILE *fp = fopen("/proc/meminfo", "re");
+
+    if (fp == NULL)
+        return -1;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "MemAvailable: %ld kB", &availableKb) == 1)
+            break;
+    }
+
+    fclose(fp);
+
+    return availableKb;
+}
+
+/*
+ * Releases buffers that stayed parked too long, and all of them once the system
+ * runs low on memory. Checks every ION_POOL_PRESSURE_MSEC or when ion_pool_trim
+ * signals, and exits once the pool is empty.
+ */
+static void *ion_pool_reaper(__unused void *arg)
+{
+    Mutex::Autolock lock(gIonPoolLock);
+
+    while (gIonPoolParked.size() > 0) {
+        gIonPoolCond.waitRelative(gIonPoolLock, milliseconds_to_nanoseconds(ION_POOL_PRESSURE_MSEC));
+
+        gIonPoolLock.unlock();
+        long availableKb = ion_pool_mem_available();
+        gIonPoolLock.lock();
+
+        if (availableKb >= 0 && availableKb < ION_POOL_MIN_AVAILABLE_KB && gIonPoolParked.size() > 0) {
+            ALOGD("DEBUG(%s):%ld KB available, releasing the pool", __FUNCTION__, availableKb);
+            gIonPoolPressureTrims++;
+            ion_pool_trim_locked(0, 0, 0);
+            continue;
+        }
+
+        ion_pool_trim_locked(ION_POOL_HIGH_WATERMARK, ION_POOL_MAX_BUFFERS,
+                systemTime(SYSTEM_TIME_MONOTONIC) - milliseconds_to_nanoseconds(ION_POOL_MAX_IDLE_MSEC));
+    }
+
+    gIonPoolReaper = false;
+
+    return NULL;
+}
+
+/*
+ * Starts tracking a buffer handed to the vendor, caller holds gIonPoolLock. The fd
+ * number was free to be handed out, so an entry still holding it belongs to a
+ * buffer that was closed without going through free, forget it.
+ */
+static void ion_pool_add_live_locked(const ion_pool_buffer &buf)
+{
+    for (size_t i = 0; i < gIonPoolLive.size(); i++) {
+        if (gIonPoolLive[i].fd != buf.fd)
+            continue;
+
+        ALOGW("WRN(%s):fd(%d) was closed without free, forgetting it", __FUNCTION__, buf.fd);
+        gIonPoolLive.removeAt(i);
+        gIonPoolStale++;
+        break;
+    }
+
+    gIonPoolLive.add(buf);
+}
+
+static bool ion_pool_get(int size, unsigned int mask, unsigned int flags, int *fd, char **addr)
+{
+    Mutex::Autolock lock(gIonPoolLock);
+    int best = -1;
+
+    for (size_t i = 0; i < gIonPoolParked.size(); i++) {
+        const ion_pool_buffer &buf = gIonPoolParked[i];
+
+        if (buf.mask != mask || buf.flags != flags)
+            continue;
+        if (buf.size < size || buf.size > size + ION_POOL_SIZE_SLACK(size))
+            continue;
+        if (best < 0 || buf.size < gIonPoolParked[best].size)
+            best = i;
+    }
+
+    if (best < 0) {
+        gIonPoolMisses++;
+        return false;
+    }
+
+    ion_pool_buffer buf = gIonPoolParked[best];
+    gIonPoolParked.removeAt(best);
+    gIonPoolParkedBytes -= buf.size;
+    ion_pool_add_live_locked(buf);
+    gIonPoolHits++;
+
+    *fd   = buf.fd;
+    *addr = buf.addr;
+
+    return true;
+}
+
+static void ion_pool_track(int fd, char *addr, int size, unsigned int mask, unsigned int flags)
+{
+    Mutex::Autolock lock(gIonPoolLock);
+    ion_pool_buffer buf;
+
+    buf.fd         = fd;
+    buf.addr       = addr;
+    buf.size       = size;
+    buf.mask       = mask;
+    buf.flags      = flags;
+    buf.parkedTime = 0;
+
+    ion_pool_add_live_locked(buf);
+}
+
+/* Parks or releases a buffer we allocated, returns false if the caller has to release it */
+static bool ion_pool_put(int fd, char *addr, bool mapNeeded)
+{
+    Mutex::Autolock lock(gIonPoolLock);
+    ssize_t index = -1;
+
+    for (size_t i = 0; i < gIonPoolLive.size(); i++) {
+        if (gIonPoolLive[i].fd == fd) {
+            index = i;
+            break;
+        }
+    }
+
+    if (index < 0)
+        return false;
+
+    ion_pool_buffer buf = gIonPoolLive[index];
+    gIonPoolLive.removeAt(index);
+
+    /*
+     * Only one open file can have this fd number, so if it is not our mapping ours
+     * was closed behind our back and this is someone else's buffer.
+     */
+    if (buf.addr != addr) {
+        ALOGW("WRN(%s):fd(%d) is not the buffer we allocated with it, forgetting ours",
+                __FUNCTION__, fd);
+        gIonPoolStale++;
+        return false;
+    }
+
+    /* Freed differently than it was allocated, release it the way it was allocated */
+    if (mapNeeded == false) {
+        ALOGW("WRN(%s):fd(%d) freed with a different mapping, releasing it", __FUNCTION__, fd);
+        ion_pool_release_buffer(&buf);
+        return true;
+    }
+
+    buf.parkedTime = systemTime(SYSTEM_TIME_MONOTONIC);
+    gIonPoolParked.add(buf);
+    gIonPoolParkedBytes += buf.size;
+
+    if (gIonPoolParked.size() > ION_POOL_MAX_BUFFERS || gIonPoolParkedBytes > ION_POOL_HIGH_WATERMARK)
+        ion_pool_trim_locked(ION_POOL_LOW_WATERMARK, ION_POOL_MAX_BUFFERS, 0);
+
+    if (gIonPoolReaper == false && gIonPoolParked.size() > 0) {
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, ion_pool_reaper, NULL) == 0)
+            gIonPoolReaper = true;
+        else
+            ALOGE("ERR(%s):failed to start the pool reaper", __FUNCTION__);
+        pthread_attr_destroy(&attr);
+    }
+
+    return true;
 }
 
 ExynosCameraIonAllocator::ExynosCameraIonAllocator(int cameraId)
@@ -192,8 +817,93 @@ ExynosCameraIonAllocator::ExynosCameraIonAllocator(int cameraId)
     m_ionFlags    = 0;
 }
 
+status_t ExynosCameraIonAllocator::alloc(
+        int size,
+        int *fd,
+        char **addr,
+        bool mapNeeded)
+{
+    return alloc(size, fd, addr, m_ionHeapMask, m_ionFlags, mapNeeded);
+}
+
+status_t ExynosCameraIonAllocator::alloc(
+        int size,
+        int *fd,
+        char **addr,
+        int  mask,
+        int  flags,
+        bool mapNeeded)
+{
+    status_t ret = NO_ERROR;
+    int ionFd = -1;
+    char *ionAddr = NULL;
+    nsecs_t opStart = memory_op_begin(MEMORY_OP_ION_ALLOC);
+
+    if (m_ionClient == 0) {
+        ALOGE("ERR(%s):allocator is not yet created", __FUNCTION__);
+        ret = INVALID_OPERATION;
+        goto func_exit;
+    }
+
+    if (size <= 0) {
+        ALOGE("ERR(%s):size(%d) is invalid", __FUNCTION__, size);
+        ret = BAD_VALUE;
+        goto func_exit;
+    }
+
+    if (mapNeeded == true && ion_pool_get(size, mask, flags, &ionFd, &ionAddr) == true) {
+        memset(ionAddr, 0, size);
+        goto func_exit;
+    }
+
+    for (int retry = 0; retry < 2; retry++) {
+#ifdef USE_LIB_ION_LEGACY
+        if (ion_alloc_fd(m_ionClient, size, m_ionAlign, mask, flags, &ionFd) < 0)
+            ionFd = -1;
+#else
+        ionFd = exynos_ion_alloc(m_ionClient, size, mask, flags);
+#endif
+        if (ionFd >= 0)
+            break;
+
+        /* Out of ION memory, give back what the pool holds and try once more */
+        if (ion_pool_trim(0) == 0)
+            break;
+    }
+
+    if (ionFd < 0) {
+        ALOGE("ERR(%s):ion_alloc_fd(size=%d, mask=0x%x, flags=0x%x) failed(%s)",
+            __FUNCTION__, size, mask, flags, strerror(errno));
+        ionFd = -1;
+        ret = INVALID_OPERATION;
+        goto func_exit;
+    }
+
+    if (mapNeeded == true) {
+        /* map closes the fd when it fails */
+        if (map(size, ionFd, &ionAddr) != NO_ERROR) {
+            ALOGE("ERR(%s):map failed", __FUNCTION__);
+            ionFd = -1;
+            ret = INVALID_OPERATION;
+            goto func_exit;
+        }
+    }
+
+    if (mapNeeded == true)
+        ion_pool_track(ionFd, ionAddr, size, mask, flags);
+
+func_exit:
+
+    memory_op_end(MEMORY_OP_ION_ALLOC, opStart);
+
+    *fd   = ionFd;
+    *addr = ionAddr;
+
+    return ret;
+}
+
 status_t ExynosCameraIonAllocator::free(
-        __unused int size,
+        int size,
         int *fd,
         char **addr,
         bool mapNeeded)
@@ -201,6 +911,7 @@ status_t ExynosCameraIonAllocator::free(
     status_t ret = NO_ERROR;
     int ionFd = *fd;
     char *ionAddr = *addr;
+    nsecs_t opStart = memory_op_begin(MEMORY_OP_ION_FREE);
 
     if (ionFd < 0) {
         ALOGE("ERR(%s):ion_fd is lower than zero", __FUNCTION__);
@@ -208,6 +919,13 @@ status_t ExynosCameraIonAllocator::free(
         goto func_exit;
     }
 
+    /* Keep a buffer we allocated open and mapped for the next alloc that fits it */
+    if (ion_pool_put(ionFd, ionAddr, mapNeeded) == true) {
+        ionFd   = -1;
+        ionAddr = NULL;
+        goto func_exit;
+    }
+
     if (mapNeeded == true) {
         if (ionAddr == NULL) {
             ALOGE("ERR(%s):ion_addr equals NULL", __FUNCTION__);
@@ -234,6 +952,8 @@ func_close_exit:
 
 func_exit:
 
+    memory_op_end(MEMORY_OP_ION_FREE, opStart);
+
     *fd   = ionFd;
     *addr = ionAddr;
 
@@ -244,6 +964,7 @@ status_t ExynosCameraIonAllocator::map(int size, int fd, char **addr)
 {
     status_t ret = NO_ERROR;
     char *ionAddr = NULL;
+    nsecs_t opStart = memory_op_begin(MEMORY_OP_ION_MAP);
 
     if (size == 0) {
         ALOGE("ERR(%s):size equals zero", __FUNCTION__);
@@ -269,11 +990,184 @@ status_t ExynosCameraIonAllocator::map(int size, int fd, char **addr)
 
 func_exit:
 
+    memory_op_end(MEMORY_OP_ION_MAP, opStart);
+
     *addr = ionAddr;
 
     return ret;
 }
 
+/*
+ * Dequeue-ahead of ExynosCameraGrallocAllocator.
+ *
+ * alloc() used to dequeue, lock_buffer and lock_ycbcr on the caller's thread,
+ * so the preview pipeline stalled whenever SurfaceFlinger was slow to hand a
+ * buffer back. A thread per allocator now keeps up to the
+ * persist.vendor.sys.camera.memory.dequeue_ahead (GRALLOC_DEQUEUE_AHEAD_DEPTH by
+ * default, 0 turns it off) buffers dequeued and locked, and alloc() takes them
+ * from its ready queue. Those buffers and the ones alloc() handed out that are
+ * not yet enqueued or cancelled never exceed the buffer count minus
+ * getMinUndequeueBuffer(), so the window is never asked for a buffer it would
+ * block on. Handed out buffers are tracked by handle, so only an enqueue or
+ * cancel of one of them frees up room, and they stay counted across buffer
+ * count and geometry changes until the window itself is replaced. Ready buffers
+ * are cancelled before the window, the buffer count or the geometry changes.
+ */
+struct gralloc_ahead_buffer {
+    buffer_handle_t *handle;
+    int              stride;
+    int              fd[3];
+    char            *addr[3];
+};
+
+struct gralloc_ahead {
+    Mutex                           lock;
+    Condition                       cond;
+    pthread_t                       thread;
+    bool                            exit;
+    bool                            active;
+    bool                            inflight;
+    int                             depth;
+    int                             bufCount;
+    int                             limit;
+    Vector<buffer_handle_t>         handed;
+    Vector<gralloc_ahead_buffer>    ready;
+    uint32_t                        hits;
+    uint32_t                        misses;
+};
+
+static Mutex                                                                gGrallocAheadLock;
+static KeyedVector<const ExynosCameraGrallocAllocator *, gralloc_ahead *>   gGrallocAheads;
+
+static gralloc_ahead *gralloc_ahead_find(const ExynosCameraGrallocAllocator *allocator)
+{
+    Mutex::Autolock lock(gGrallocAheadLock);
+    ssize_t index = gGrallocAheads.indexOfKey(allocator);
+
+    return index < 0 ? NULL : gGrallocAheads.valueAt(index);
+}
+
+static int gralloc_plane_count(int halPixelFormat)
+{
+    switch (halPixelFormat) {
+    case HAL_PIXEL_FORMAT_EXYNOS_YV12_M:
+        return 3;
+    case HAL_PIXEL_FORMAT_EXYNOS_YCrCb_420_SP_M:
+    case HAL_PIXEL_FORMAT_EXYNOS_YCrCb_420_SP_M_FULL:
+    case HAL_PIXEL_FORMAT_EXYNOS_YCbCr_420_SP_M:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Counts a buffer alloc() hands out, caller holds ahead->lock. The window just
+ * dequeued it, so if it is still counted it went back without us seeing it.
+ */
+static void gralloc_ahead_handed_locked(gralloc_ahead *ahead, buffer_handle_t handle)
+{
+    for (size_t i = 0; i < ahead->handed.size(); i++) {
+        if (ahead->handed[i] == handle)
+            return;
+    }
+
+    ahead->handed.add(handle);
+}
+
+/* A buffer went back to the window, only the ones alloc() handed out make room */
+static void gralloc_ahead_returned(const ExynosCameraGrallocAllocator *allocator, buffer_handle_t handle)
+{
+    gralloc_ahead *ahead = gralloc_ahead_find(allocator);
+
+    if (ahead == NULL || handle == NULL)
+        return;
+
+    Mutex::Autolock lock(ahead->lock);
+
+    for (size_t i = 0; i < ahead->handed.size(); i++) {
+        if (ahead->handed[i] == handle) {
+            ahead->handed.removeAt(i);
+            ahead->cond.broadcast();
+            break;
+        }
+    }
+}
+
+void *ExynosCameraGrallocAllocator::m_dequeueAheadThread(void *arg)
+{
+    ExynosCameraGrallocAllocator *allocator = (ExynosCameraGrallocAllocator *)arg;
+    gralloc_ahead *ahead = gralloc_ahead_find(allocator);
+    Mutex::Autolock lock(ahead->lock);
+
+    while (ahead->exit == false) {
+        gralloc_ahead_buffer buffer;
+        bool isLocked = false;
+
+        if (ahead->active == false || ahead->inflight == true ||
+                (int)ahead->ready.size() >= ahead->depth ||
+                (int)(ahead->handed.size() + ahead->ready.size()) >= ahead->limit) {
+            ahead->cond.wait(ahead->lock);
+            continue;
+        }
+
+        ahead->inflight = true;
+        ahead->lock.unlock();
+
+        memset(&buffer, 0, sizeof(buffer));
+        status_t ret = allocator->m_alloc(&buffer.handle, buffer.fd, buffer.addr, &buffer.stride, &isLocked);
+
+        ahead->lock.lock();
+        ahead->inflight = false;
+
+        if (ret == NO_ERROR) {
+            ahead->ready.add(buffer);
+        } else {
+            /* Leave it to alloc() until the window is set up again */
+            ALOGW("WRN(%s):dequeue ahead failed(%d), stopped", __FUNCTION__, ret);
+            ahead->active = false;
+        }
+
+        ahead->cond.broadcast();
+    }
+
+    return NULL;
+}
+
+/* Stops dequeueing ahead and gives the ready buffers back, before the window changes */
+void ExynosCameraGrallocAllocator::m_cancelDequeuedAhead(void)
+{
+    gralloc_ahead *ahead = gralloc_ahead_find(this);
+    Vector<gralloc_ahead_buffer> ready;
+
+    if (ahead == NULL)
+        return;
+
+    {
+        Mutex::Autolock lock(ahead->lock);
+
+        ahead->active = false;
+        while (ahead->inflight == true)
+            ahead->cond.wait(ahead->lock);
+
+        ready = ahead->ready;
+        ahead->ready.clear();
+
+        if (ahead->hits > 0 || ahead->misses > 0)
+            ALOGD("DEBUG(%s):camera(%d) %u allocs from dequeued ahead buffers, %u waited on the window",
+                    __FUNCTION__, m_cameraId, ahead->hits, ahead->misses);
+        ahead->hits = 0;
+        ahead->misses = 0;
+    }
+
+    for (size_t i = 0; i < ready.size(); i++) {
+        if (m_grallocHal->unlock(m_grallocHal, *ready[i].handle) != 0)
+            ALOGE("ERR(%s):grallocHal->unlock failed", __FUNCTION__);
+        if (m_allocator == NULL || m_allocator->cancel_buffer(m_allocator, ready[i].handle) != 0)
+            ALOGE("ERR(%s):cancel_buffer failed", __FUNCTION__);
+    }
+}
+
 ExynosCameraGrallocAllocator::ExynosCameraGrallocAllocator(int cameraId)
 {
     m_cameraId = cameraId;
@@ -287,6 +1181,23 @@ ExynosCameraGrallocAllocator::ExynosCameraGrallocAllocator(int cameraId)
 
 ExynosCameraGrallocAllocator::~ExynosCameraGrallocAllocator()
 {
+    gralloc_ahead *ahead = gralloc_ahead_find(this);
+
+    if (ahead != NULL) {
+        ahead->lock.lock();
+        ahead->exit = true;
+        ahead->cond.broadcast();
+        ahead->lock.unlock();
+        pthread_join(ahead->thread, NULL);
+
+        m_cancelDequeuedAhead();
+
+        gGrallocAheadLock.lock();
+        gGrallocAheads.removeItem(this);
+        gGrallocAheadLock.unlock();
+        delete ahead;
+    }
+
     m_minUndequeueBufferMargin = 0;
 }
 
@@ -297,6 +1208,15 @@ status_t ExynosCameraGrallocAllocator::init(
         int grallocUsage)
 {
     status_t ret = NO_ERROR;
+    gralloc_ahead *ahead = gralloc_ahead_find(this);
+
+    m_cancelDequeuedAhead();
+
+    /* Buffers handed out of another window never come back to this one */
+    if (ahead != NULL && allocator != m_allocator) {
+        Mutex::Autolock lock(ahead->lock);
+        ahead->handed.clear();
+    }
 
     m_allocator = allocator;
     if( minUndequeueBufferCount < 0 ) {
@@ -342,6 +1262,81 @@ status_t ExynosCameraGrallocAllocator::alloc(
         char *addr[],
         int  *bufStride,
         bool *isLocked)
+{
+    status_t ret = NO_ERROR;
+    gralloc_ahead *ahead = gralloc_ahead_find(this);
+
+    if (ahead == NULL)
+        return m_alloc(bufHandle, fd, addr, bufStride, isLocked);
+
+    /* Buffers dequeued ahead are locked, callers that lock themselves dequeue on demand */
+    if (*isLocked == true) {
+        ret = m_alloc(bufHandle, fd, addr, bufStride, isLocked);
+
+        /* Still out of the window, so count it like the others */
+        if (ret == NO_ERROR) {
+            Mutex::Autolock lock(ahead->lock);
+            gralloc_ahead_handed_locked(ahead, **bufHandle);
+        }
+
+        return ret;
+    }
+
+    ahead->lock.lock();
+
+    if (ahead->active == false && ahead->bufCount > 0) {
+        int minUndequeueBuffer = getMinUndequeueBuffer();
+
+        ahead->limit  = minUndequeueBuffer < 0 ? 0 : ahead->bufCount - minUndequeueBuffer;
+        ahead->active = ahead->limit > 0;
+    }
+
+    /* One dequeue at a time, a second one could block on the window */
+    while (ahead->ready.size() == 0 && ahead->inflight == true)
+        ahead->cond.wait(ahead->lock);
+
+    if (ahead->ready.size() > 0) {
+        gralloc_ahead_buffer buffer = ahead->ready[0];
+
+        ahead->ready.removeAt(0);
+        gralloc_ahead_handed_locked(ahead, *buffer.handle);
+        ahead->hits++;
+        ahead->cond.broadcast();
+        ahead->lock.unlock();
+
+        *bufHandle = buffer.handle;
+        *bufStride = buffer.stride;
+        for (int i = 0; i < gralloc_plane_count(m_halPixelFormat); i++) {
+            fd[i]   = buffer.fd[i];
+            addr[i] = buffer.addr[i];
+        }
+        *isLocked = true;
+
+        return NO_ERROR;
+    }
+
+    ahead->inflight = true;
+    ahead->misses++;
+    ahead->lock.unlock();
+
+    ret = m_alloc(bufHandle, fd, addr, bufStride, isLocked);
+
+    ahead->lock.lock();
+    ahead->inflight = false;
+    if (ret == NO_ERROR)
+        gralloc_ahead_handed_locked(ahead, **bufHandle);
+    ahead->cond.broadcast();
+    ahead->lock.unlock();
+
+    return ret;
+}
+
+status_t ExynosCameraGrallocAllocator::m_alloc(
+        buffer_handle_t **bufHandle,
+        int fd[],
+        char *addr[],
+        int  *bufStride,
+        bool *isLocked)
 {
     status_t ret = NO_ERROR;
     int   width  = 0;
@@ -351,6 +1346,7 @@ status_t ExynosCameraGrallocAllocator::alloc(
     const private_handle_t *priv_handle = NULL;
     ExynosCameraDurationTimer   dequeuebufferTimer;
     ExynosCameraDurationTimer   lockbufferTimer;
+    nsecs_t opStart = 0;
 
     for (int retryCount = 5; retryCount > 0; retryCount--) {
 #ifdef EXYNOS_CAMERA_MEMORY_TRACE
@@ -364,17 +1360,14 @@ status_t ExynosCameraGrallocAllocator::alloc(
         }
 
         dequeuebufferTimer.start();
+        opStart = memory_op_begin(MEMORY_OP_DEQUEUE);
         ret = m_allocator->dequeue_buffer(m_allocator, bufHandle, bufStride);
+        memory_op_end(MEMORY_OP_DEQUEUE, opStart);
         dequeuebufferTimer.stop();
 
-#if defined (EXYNOS_CAMERA_MEMORY_TRACE_GRALLOC_PERFORMANCE)
-        ALOGD("DEBUG(%s[%d]):Check dequeue buffer performance, duration(%ju usec)",
-                __FUNCTION__, __LINE__, dequeuebufferTimer.durationUsecs());
-#else
         if (dequeuebufferTimer.durationMsecs() > GRALLOC_WARNING_DURATION_MSEC)
             ALOGW("WRN(%s[%d]):dequeue_buffer() duration(%ju msec)",
                     __FUNCTION__, __LINE__, dequeuebufferTimer.durationMsecs());
-#endif
 
         if (ret == NO_INIT) {
             ALOGW("WARN(%s):BufferQueue is abandoned", __FUNCTION__);
@@ -390,34 +1383,28 @@ status_t ExynosCameraGrallocAllocator::alloc(
         }
 
         lockbufferTimer.start();
+        opStart = memory_op_begin(MEMORY_OP_LOCK_BUFFER);
         ret = m_allocator->lock_buffer(m_allocator, *bufHandle);
+        memory_op_end(MEMORY_OP_LOCK_BUFFER, opStart);
         lockbufferTimer.stop();
         if (ret != 0)
             ALOGE("ERR(%s):lock_buffer failed, but go on to the next step ...", __FUNCTION__);
 
-#if defined (EXYNOS_CAMERA_MEMORY_TRACE_GRALLOC_PERFORMANCE)
-        ALOGD("DEBUG(%s[%d]):Check lock buffer performance, duration(%ju usec)",
-                __FUNCTION__, __LINE__, lockbufferTimer.durationUsecs());
-#else
         if (lockbufferTimer.durationMsecs() > GRALLOC_WARNING_DURATION_MSEC)
             ALOGW("WRN(%s[%d]):lock_buffer() duration(%ju msec)",
                     __FUNCTION__, __LINE__, lockbufferTimer.durationMsecs());
-#endif
 
         if (*isLocked == false) {
             lockbufferTimer.start();
+            opStart = memory_op_begin(MEMORY_OP_LOCK_YCBCR);
             ret = m_grallocHal->lock_ycbcr(m_grallocHal, **bufHandle, GRALLOC_LOCK_FOR_CAMERA,
                                     0, 0,/* left, top */ width, height, &ycbcr);
+            memory_op_end(MEMORY_OP_LOCK_YCBCR, opStart);
             lockbufferTimer.stop();
 
-#if defined (EXYNOS_CAMERA_MEMORY_TRACE_GRALLOC_PERFORMANCE)
-            ALOGD("DEBUG(%s[%d]):Check grallocHAL lock performance, duration(%ju usec)",
-                    __FUNCTION__, __LINE__, lockbufferTimer.durationUsecs());
-#else
             if (lockbufferTimer.durationMsecs() > GRALLOC_WARNING_DURATION_MSEC)
                 ALOGW("WRN(%s[%d]):grallocHAL->lock_ycbcr() duration(%ju msec)",
                         __FUNCTION__, __LINE__, lockbufferTimer.durationMsecs());
-#endif
 
             if (ret != 0) {
                 ALOGE("ERR(%s):grallocHal->lock_ycbcr failed.. retry", __FUNCTION__);
@@ -485,6 +1472,9 @@ func_exit:
 status_t ExynosCameraGrallocAllocator::setBufferCount(int bufCount)
 {
     status_t ret = NO_ERROR;
+    gralloc_ahead *ahead = NULL;
+
+    m_cancelDequeuedAhead();
 
     if (m_allocator == NULL) {
         ALOGE("ERR(%s):m_allocator equals NULL", __FUNCTION__);
@@ -497,6 +1487,40 @@ status_t ExynosCameraGrallocAllocator::setBufferCount(int bufCount)
         ret = INVALID_OPERATION;
     }
 
+    ahead = gralloc_ahead_find(this);
+    if (ahead == NULL) {
+        int depth = property_get_int32("persist.vendor.sys.camera.memory.dequeue_ahead",
+                GRALLOC_DEQUEUE_AHEAD_DEPTH);
+        if (depth <= 0)
+            return ret;
+
+        ahead = new gralloc_ahead();
+        ahead->exit     = false;
+        ahead->active   = false;
+        ahead->inflight = false;
+        ahead->depth    = depth;
+        ahead->limit    = 0;
+        ahead->hits     = 0;
+        ahead->misses   = 0;
+
+        gGrallocAheadLock.lock();
+        gGrallocAheads.add(this, ahead);
+        gGrallocAheadLock.unlock();
+
+        if (pthread_create(&ahead->thread, NULL, m_dequeueAheadThread, this) != 0) {
+            ALOGE("ERR(%s):failed to start dequeue ahead, dequeueing on demand", __FUNCTION__);
+            gGrallocAheadLock.lock();
+            gGrallocAheads.removeItem(this);
+            gGrallocAheadLock.unlock();
+            delete ahead;
+            return ret;
+        }
+    }
+
+    ahead->lock.lock();
+    ahead->bufCount = ret == NO_ERROR ? bufCount : 0;
+    ahead->lock.unlock();
+
     return ret;
 }
 status_t ExynosCameraGrallocAllocator::setBuffersGeometry(
@@ -512,6 +1536,8 @@ status_t ExynosCameraGrallocAllocator::setBuffersGeometry(
         return ret;
     }
 
+    m_cancelDequeuedAhead();
+
     if (m_allocator->set_buffers_geometry(
                     m_allocator,
                     width, height,
@@ -581,6 +1607,8 @@ status_t ExynosCameraGrallocAllocator::enqueueBuffer(buffer_handle_t *handle, Mu
 {
     status_t ret = NO_ERROR;
     ExynosCameraDurationTimer   enqueuebufferTimer;
+    nsecs_t opStart = 0;
+    buffer_handle_t returned = handle != NULL ? *handle : NULL;
 
     if (m_allocator == NULL) {
         ALOGE("ERR(%s):m_allocator equals NULL", __FUNCTION__);
@@ -589,18 +1617,17 @@ status_t ExynosCameraGrallocAllocator::enqueueBuffer(buffer_handle_t *handle, Mu
 
     enqueuebufferTimer.start();
     lock->unlock();
+    opStart = memory_op_begin(MEMORY_OP_ENQUEUE);
     ret = m_allocator->enqueue_buffer(m_allocator, handle);
+    memory_op_end(MEMORY_OP_ENQUEUE, opStart);
     lock->lock();
     enqueuebufferTimer.stop();
 
-#if defined (EXYNOS_CAMERA_MEMORY_TRACE_GRALLOC_PERFORMANCE)
-    ALOGD("DEBUG(%s[%d]):Check enqueue buffer performance, duration(%ju usec)",
-            __FUNCTION__, __LINE__, enqueuebufferTimer.durationUsecs());
-#else
     if (enqueuebufferTimer.durationMsecs() > GRALLOC_WARNING_DURATION_MSEC)
         ALOGW("WRN(%s[%d]):enqueue_buffer() duration(%ju msec)",
                 __FUNCTION__, __LINE__, enqueuebufferTimer.durationMsecs());
-#endif
+
+    gralloc_ahead_returned(this, returned);
 
     if (ret != 0) {
         ALOGE("ERR(%s):enqueue_buffer failed", __FUNCTION__);
@@ -614,6 +1641,8 @@ status_t ExynosCameraGrallocAllocator::cancelBuffer(buffer_handle_t *handle, Mut
 {
     status_t ret = NO_ERROR;
     ExynosCameraDurationTimer   cancelbufferTimer;
+    nsecs_t opStart = 0;
+    buffer_handle_t returned = handle != NULL ? *handle : NULL;
 
     if (m_allocator == NULL) {
         ALOGE("ERR(%s):m_allocator equals NULL", __FUNCTION__);
@@ -627,18 +1656,17 @@ status_t ExynosCameraGrallocAllocator::cancelBuffer(buffer_handle_t *handle, Mut
 
     cancelbufferTimer.start();
     lock->unlock();
+    opStart = memory_op_begin(MEMORY_OP_CANCEL);
     ret = m_allocator->cancel_buffer(m_allocator, handle);
+    memory_op_end(MEMORY_OP_CANCEL, opStart);
     lock->lock();
     cancelbufferTimer.stop();
 
-#if defined (EXYNOS_CAMERA_MEMORY_TRACE_GRALLOC_PERFORMANCE)
-    ALOGD("DEBUG(%s[%d]):Check cancel buffer performance, duration(%ju usec)",
-            __FUNCTION__, __LINE__, cancelbufferTimer.durationUsecs());
-#else
     if (cancelbufferTimer.durationMsecs() > GRALLOC_WARNING_DURATION_MSEC)
         ALOGW("WRN(%s[%d]):cancel_buffer() duration(%ju msec)",
                 __FUNCTION__, __LINE__, cancelbufferTimer.durationMsecs());
-#endif
+
+    gralloc_ahead_returned(this, returned);
 
     if (ret != 0) {
         ALOGE("ERR(%s):cancel_buffer failed", __FUNCTION__);
@@ -675,6 +1703,9 @@ int ExynosCameraStreamAllocator::lock(
     int   grallocFd[3] = {0};
     android_ycbcr ycbcr;
     ExynosCameraDurationTimer   lockbufferTimer;
+    nsecs_t opStart = 0;
+
+    memset(&ycbcr, 0, sizeof(ycbcr));
 
     if (bufHandle == NULL) {
         ALOGE("ERR(%s):bufHandle equals NULL, failed", __FUNCTION__);
@@ -693,6 +1724,8 @@ int ExynosCameraStreamAllocator::lock(
     usage  = m_allocator->usage;
     format = m_allocator->format;
 
+    lockbufferTimer.start();
+
     switch (format) {
     case HAL_PIXEL_FORMAT_EXYNOS_ARGB_8888:
     case HAL_PIXEL_FORMAT_RGBA_8888:
@@ -705,7 +1738,7 @@ int ExynosCameraStreamAllocator::lock(
     case HAL_PIXEL_FORMAT_BLOB:
     case HAL_PIXEL_FORMAT_YCbCr_422_I:
         if (planeCount == 1) {
-            lockbufferTimer.start();
+            opStart = memory_op_begin(MEMORY_OP_LOCK);
             ret = m_grallocHal->lock(
                     m_grallocHal,
                     **bufHandle,
@@ -713,12 +1746,11 @@ int ExynosCameraStreamAllocator::lock(
                     0, 0, /* left, top */
                     width, height,
                     grallocAddr);
-            lockbufferTimer.stop();
+            memory_op_end(MEMORY_OP_LOCK, opStart);
             break;
         }
     default:
-        android_ycbcr ycbcr;
-        lockbufferTimer.start();
+        opStart = memory_op_begin(MEMORY_OP_LOCK_YCBCR);
         ret = m_grallocHal->lock_ycbcr(
                 m_grallocHal,
                 **bufHandle,
@@ -726,18 +1758,15 @@ int ExynosCameraStreamAllocator::lock(
                 0, 0, /* left, top */
                 width, height,
                 &ycbcr);
-        lockbufferTimer.stop();
+        memory_op_end(MEMORY_OP_LOCK_YCBCR, opStart);
         break;
     }
 
-#if defined (EXYNOS_CAMERA_MEMORY_TRACE_GRALLOC_PERFORMANCE)
-    ALOGD("DEBUG(%s[%d]):Check grallocHAL lock performance, duration(%ju usec)",
-            __FUNCTION__, __LINE__, lockbufferTimer.durationUsecs());
-#else
+    lockbufferTimer.stop();
+
     if (lockbufferTimer.durationMsecs() > GRALLOC_WARNING_DURATION_MSEC)
         ALOGW("WRN(%s[%d]):grallocHAL->lock() duration(%ju msec)",
                 __FUNCTION__, __LINE__, lockbufferTimer.durationMsecs());
-#endif
 
     if (ret != 0) {
         ALOGE("ERR(%s):grallocHal->lock failed.. ", __FUNCTION__);
@@ -783,4 +1812,54 @@ func_exit:
 
     return ret;
 }
+
+static void memory_histogram_dump(int fd, const char *name, const memory_histogram *histogram)
+{
+    dprintf(fd, "%s%u calls, p50 <%ju p99 <%ju max %ju uS", name, histogram->count,
+            memory_histogram_percentile(histogram, 50), memory_histogram_percentile(histogram, 99),
+            histogram->maxUsec);
+}
+
+static void memory_dump(int fd)
+{
+    bool enabled = memory_timing_enabled();
+
+    dprintf(fd, "ExynosCameraMemory, call timing %s (persist.vendor.sys.camera.memory.timing)\n",
+            enabled == true ? "on" : "off");
+
+    gMemoryTimingLock.lock();
+    for (int i = 0; i < MEMORY_OP_MAX; i++) {
+        if (gMemoryTiming[i].count == 0)
+            continue;
+
+        dprintf(fd, "  %-14s ", gMemoryOpNames[i]);
+        memory_histogram_dump(fd, "", &gMemoryTiming[i]);
+        dprintf(fd, "\n");
+    }
+    gMemoryTimingLock.unlock();
+
+    gIonPoolLock.lock();
+    dprintf(fd, "  ion pool: %zu live, %zu parked (%zu KB), hits(%u) misses(%u) released(%u) "
+            "stale(%u) pressure trims(%u)\n",
+            gIonPoolLive.size(), gIonPoolParked.size(), gIonPoolParkedBytes / 1024,
+            gIonPoolHits, gIonPoolMisses, gIonPoolReleased, gIonPoolStale, gIonPoolPressureTrims);
+    gIonPoolLock.unlock();
+
+    gGrallocAheadLock.lock();
+    for (size_t i = 0; i < gGrallocAheads.size(); i++) {
+        gralloc_ahead *ahead = gGrallocAheads.valueAt(i);
+        Mutex::Autolock lock(ahead->lock);
+
+        dprintf(fd, "  preview dequeue ahead %s: depth %d, limit %d, %zu ready, %zu handed out, "
+                "%u allocs served ahead, %u waited on the window\n",
+                ahead->active == true ? "on" : "off", ahead->depth, ahead->limit,
+                ahead->ready.size(), ahead->handed.size(), ahead->hits, ahead->misses);
+    }
+    gGrallocAheadLock.unlock();
+}
+}
+
+extern "C" void exynos_camera_memory_dump(int fd)
+{
+    android::memory_dump(fd);
 }
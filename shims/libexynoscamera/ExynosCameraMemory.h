@@ -47,12 +47,28 @@ namespace android {
 
 /* #define EXYNOS_CAMERA_MEMORY_TRACE */
 
-/* EXYNOS_CAMERA_MEMORY_TRACE_GRALLOC_PERFORMANCE define is log of gralloc function(xxxxx) duration.
- * If you want check function duration, enable this define.
+/*
+ * The prebuilt vendor library allocates these classes and was built against
+ * their original layout. None of them may grow, and members the vendor code
+ * reads must keep their offsets, so state the shim adds is kept in tables in
+ * ExynosCameraMemory.cpp instead.
+ */
+
+/*
+ * gralloc and ION calls are traced as ATRACE_TAG_CAMERA spans. Their durations
+ * are collected in histograms while persist.vendor.sys.camera.memory.timing is
+ * set, see exynos_camera_memory_dump().
  */
-/* #define EXYNOS_CAMERA_MEMORY_TRACE_GRALLOC_PERFORMANCE */
 #define GRALLOC_WARNING_DURATION_MSEC   (180)     /* 180ms */
 
+/* ExynosCameraGraphicBufferAllocator buffers, allocated a chunk at a time */
+#define GRAPHIC_BUFFER_SLOTS_PER_CHUNK  (16)
+#define GRAPHIC_BUFFER_MAX_SLOTS        (256)
+#define GRAPHIC_BUFFER_MAX_PLANES       (3)
+
+/* Locked preview buffers ExynosCameraGrallocAllocator keeps dequeued ahead of alloc() */
+#define GRALLOC_DEQUEUE_AHEAD_DEPTH     (2)
+
 class ExynosCameraGraphicBufferAllocator {
 public:
     ExynosCameraGraphicBufferAllocator(int cameraId = 0);
@@ -93,9 +109,19 @@ private:
     int                m_halPixelFormat;
     int                m_grallocUsage;
 
-    private_handle_t  *m_privateHandle[VIDEO_MAX_FRAME];
-    sp<GraphicBuffer>  m_graphicBuffer[VIDEO_MAX_FRAME];
-    bool               m_flagGraphicBufferAlloc[VIDEO_MAX_FRAME];
+    /*
+     * Buffers are kept in chunks of GRAPHIC_BUFFER_SLOTS_PER_CHUNK slots with the
+     * handle inline, so a GraphicBuffer wrapping a handle never sees it move. A
+     * chunk outlives the allocator while a GraphicBuffer still wraps one of its
+     * handles.
+     */
+    struct Slot;
+
+    Slot *m_getSlot(int index, bool grow);
+    void  m_freeSlots(void);
+
+    Slot             **m_slotChunks;
+    int                m_slotChunkCount;
 };
 
 class ExynosCameraIonAllocator {
@@ -204,6 +230,15 @@ public:
     status_t cancelBuffer(buffer_handle_t *bufHandle, Mutex *lock);
 
 private:
+    status_t m_alloc(
+                buffer_handle_t **bufHandle,
+                int fd[],
+                char *addr[],
+                int  *bufStride,
+                bool *isLocked);
+    void     m_cancelDequeuedAhead(void);
+    static void *m_dequeueAheadThread(void *arg);
+
     int                             m_cameraId;
     preview_stream_ops              *m_allocator;
     static gralloc_module_t const   *m_grallocHal;
@@ -233,4 +268,8 @@ private:
     static gralloc_module_t const   *m_grallocHal;
 };
 }
+
+/* Writes the call timing histograms and buffer cache statistics */
+extern "C" void exynos_camera_memory_dump(int fd);
+
 #endif